@@ -30,6 +30,32 @@ namespace detail
     {
         return *str ? id_hash(str + 1, (hash ^ hash_type(*str)) * fnv_prime) : hash;
     }
+
+    // incremental version of id_hash() for use at runtime
+    // hashing multiple strings gives the same result as id_hash() of their concatenation
+    class id_hasher
+    {
+    public:
+        id_hasher() noexcept : hash_(fnv_basis) {}
+
+        id_hasher& append(const char* str) noexcept
+        {
+            // local copy, so the compiler doesn't need to store it after every character
+            auto hash = hash_;
+            for (; *str; ++str)
+                hash = (hash ^ hash_type(*str)) * fnv_prime;
+            hash_ = hash;
+            return *this;
+        }
+
+        hash_type hash() const noexcept
+        {
+            return hash_;
+        }
+
+    private:
+        hash_type hash_;
+    };
 } // namespace detail
 
 /// A [ts::strong_typedef]() representing the unique id of a [cppast::cpp_entity]().
@@ -40,7 +66,12 @@ struct cpp_entity_id : type_safe::strong_typedef<cpp_entity_id, detail::hash_typ
 {
     explicit cpp_entity_id(const std::string& str) : cpp_entity_id(str.c_str()) {}
 
-    explicit cpp_entity_id(const char* str) : strong_typedef(detail::id_hash(str)) {}
+    explicit cpp_entity_id(const char* str)
+    : strong_typedef(detail::id_hasher().append(str).hash())
+    {}
+
+    /// \exclude
+    explicit cpp_entity_id(const detail::id_hasher& hasher) : strong_typedef(hasher.hash()) {}
 };
 
 inline namespace literals
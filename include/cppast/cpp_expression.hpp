@@ -7,6 +7,8 @@
 #include <atomic>
 #include <memory>
 
+#include <type_safe/optional.hpp>
+
 #include <cppast/cpp_token.hpp>
 #include <cppast/cpp_type.hpp>
 
@@ -89,23 +91,55 @@ public:
             new cpp_unexposed_expression(std::move(type), std::move(str)));
     }
 
+    /// \returns A newly created unexposed expression whose string are the tokens `[begin, end)`
+    /// of the buffer.
+    /// \notes The string is only created when it is accessed for the first time.
+    static std::unique_ptr<cpp_unexposed_expression> build(
+        std::unique_ptr<cpp_type> type, std::shared_ptr<const cpp_token_buffer> buffer,
+        std::size_t begin, std::size_t end)
+    {
+        return std::unique_ptr<cpp_unexposed_expression>(
+            new cpp_unexposed_expression(std::move(type), std::move(buffer), begin, end));
+    }
+
+    ~cpp_unexposed_expression() noexcept override;
+
     /// \returns The expression as a string.
+    /// \notes This function is thread-safe, even if the string is created lazily.
     const cpp_token_string& expression() const noexcept
     {
-        return str_;
+        return str_ ? str_.value() : lazy_expression();
     }
 
 private:
     cpp_unexposed_expression(std::unique_ptr<cpp_type> type, cpp_token_string str)
-    : cpp_expression(std::move(type)), str_(std::move(str))
+    : cpp_expression(std::move(type)), str_(std::move(str)), lazy_str_(nullptr), begin_(0u),
+      end_(0u)
     {}
 
+    cpp_unexposed_expression(std::unique_ptr<cpp_type> type,
+                             std::shared_ptr<const cpp_token_buffer> buffer, std::size_t begin,
+                             std::size_t end)
+    : cpp_expression(std::move(type)), lazy_str_(nullptr), buffer_(std::move(buffer)),
+      begin_(begin), end_(end)
+    {
+        DEBUG_ASSERT(buffer_ && begin_ <= end_ && end_ <= buffer_->size(),
+                     detail::precondition_error_handler{}, "invalid token range");
+    }
+
     cpp_expression_kind do_get_kind() const noexcept override
     {
         return cpp_expression_kind::unexposed_t;
     }
 
-    cpp_token_string str_;
+    // creates the string from the buffer on first access
+    // terminates if it cannot be allocated
+    const cpp_token_string& lazy_expression() const noexcept;
+
+    type_safe::optional<cpp_token_string>        str_;      // empty if it has a buffer
+    mutable std::atomic<const cpp_token_string*> lazy_str_; // only used if it has a buffer
+    std::shared_ptr<const cpp_token_buffer>      buffer_;
+    std::size_t                                  begin_, end_;
 };
 
 /// A [cppast::cpp_expression]() that is a literal.
@@ -4,6 +4,7 @@
 #ifndef CPPAST_CPP_TOKEN_HPP_INCLUDED
 #define CPPAST_CPP_TOKEN_HPP_INCLUDED
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -131,6 +132,40 @@ inline bool operator!=(const cpp_token_string& lhs, const cpp_token_string& rhs)
 {
     return !(lhs == rhs);
 }
+
+/// A compact storage of tokens [cppast::cpp_token_string]()s can be created from later on.
+///
+/// It stores the spelling of all tokens in one string,
+/// so it needs a lot less memory than the corresponding [cppast::cpp_token_string]()s.
+class cpp_token_buffer
+{
+public:
+    cpp_token_buffer() = default;
+
+    /// \effects Adds a token.
+    void add_token(cpp_token_kind kind, const char* spelling, std::size_t length);
+
+    /// \returns The number of tokens in the buffer.
+    /// This is the index of the next token that is going to be added.
+    std::size_t size() const noexcept
+    {
+        return tokens_.size();
+    }
+
+    /// \returns A string consisting of the tokens in the range `[begin, end)`.
+    /// \requires The range must be a valid range of tokens.
+    cpp_token_string get(std::size_t begin, std::size_t end) const;
+
+private:
+    struct token
+    {
+        std::uint32_t  end; // end of the spelling
+        cpp_token_kind kind;
+    };
+
+    std::string        spellings_;
+    std::vector<token> tokens_;
+};
 } // namespace cppast
 
 #endif // CPPAST_CPP_TOKEN_HPP_INCLUDED
@@ -121,6 +121,8 @@ struct whitespace_t;
 template <class Derived, typename T>
 class cpp_entity_container;
 template <class Parser>
+class parallel_file_parser;
+template <class Parser>
 class simple_file_parser;
 template <typename T, typename Predicate>
 class basic_cpp_entity_ref;
@@ -4,12 +4,35 @@
 #ifndef CPPAST_LIBCLANG_PARSER_HPP_INCLUDED
 #define CPPAST_LIBCLANG_PARSER_HPP_INCLUDED
 
+#include <functional>
 #include <stdexcept>
 
+#include <cppast/cpp_entity_kind.hpp>
 #include <cppast/parser.hpp>
 
 namespace cppast
 {
+/// Information about an entity the [cppast::libclang_parser]() is about to parse,
+/// passed to the filter set by [cppast::libclang_compile_config::parse_filter]().
+struct libclang_parse_filter_info
+{
+    /// The kind of the entity that is going to be created.
+    /// \notes Bitfields are reported as [cppast::cpp_entity_kind::member_variable_t],
+    /// entities libclang doesn't expose as [cppast::cpp_entity_kind::unexposed_t].
+    cpp_entity_kind kind;
+    /// The name of the entity as written in the source code, empty if it doesn't have one.
+    std::string name;
+    /// The names of the namespaces and classes the entity is declared in, separated by `::`,
+    /// e.g. `foo::detail`. It is empty for entities in the global scope and unnamed scopes are
+    /// left out.
+    std::string scope;
+};
+
+/// The filter of the [cppast::libclang_parser]().
+///
+/// It returns `true` if the entity should be parsed, and `false` if it should be skipped.
+using libclang_parse_filter = std::function<bool(const libclang_parse_filter_info&)>;
+
 namespace detail
 {
     struct libclang_compile_config_access
@@ -23,6 +46,25 @@ namespace detail
         static bool fast_preprocessing(const libclang_compile_config& config);
 
         static bool remove_comments_in_macro(const libclang_compile_config& config);
+
+        static bool in_process_preprocessing(const libclang_compile_config& config);
+
+        static std::size_t preprocessor_workers(const libclang_compile_config& config);
+
+        static const std::string& preprocessor_cache_directory(
+            const libclang_compile_config& config);
+
+        static std::size_t preprocessor_cache_size(const libclang_compile_config& config);
+
+        static bool revalidate_file_metadata(const libclang_compile_config& config);
+
+        static bool precompiled_preamble(const libclang_compile_config& config);
+
+        static bool skip_function_bodies(const libclang_compile_config& config);
+
+        static bool lazy_expressions(const libclang_compile_config& config);
+
+        static const libclang_parse_filter& parse_filter(const libclang_compile_config& config);
     };
 
     void for_each_file(const libclang_compilation_database& database, void* user_data,
@@ -143,6 +185,16 @@ public:
     /// order might end up being wrong.
     bool set_clang_binary(std::string binary);
 
+    /// \effects Sets a file where the results of probing clang binaries are stored,
+    /// or disables it if the file name is empty. Default is disabled.
+    /// \notes Probing runs the clang binary to check whether it is valid and to get the default
+    /// include directories, which happens in the constructors and [*set_clang_binary]().
+    /// The results are always cached in the process,
+    /// identified by the full path and modification time of the binary as well as the language.
+    /// The file shares them between processes, it can be used by multiple processes at once.
+    /// \notes This setting is global and affects all configurations created afterwards.
+    static void clang_probe_cache(std::string file);
+
     /// \effects Sets whether or not the preprocessed file will be written out.
     /// Default value is `false`.
     void write_preprocessed(bool b) noexcept
@@ -172,6 +224,109 @@ public:
         remove_comments_in_macro_ = b;
     }
 
+    /// \effects Sets whether or not preprocessing is done in-process instead of by invoking the
+    /// clang binary. Default value is `false`.
+    /// \notes The in-process preprocessor passes the file as-is to libclang and reads the include
+    /// directives and macro definitions from its preprocessing record,
+    /// so no child process is started for the file.
+    /// Macros are then expanded by libclang, so tokens of entities using macros are the tokens as
+    /// written in the source code, and comments inside macro replacements are dropped.
+    /// If this option is `true`, the option for fast preprocessing is ignored.
+    void in_process_preprocessing(bool b) noexcept
+    {
+        in_process_preprocessing_ = b;
+    }
+
+    /// \effects Sets the number of long-lived worker processes that invoke the preprocessor.
+    /// If it is `0`, the parser process starts the preprocessor directly for every file.
+    /// Default value is `0`.
+    /// \notes The workers are shared by all parsers in the process and are started on demand,
+    /// so their number grows up to the biggest count requested.
+    /// \notes Worker processes are not supported on Windows, the option is ignored there.
+    void preprocessor_workers(std::size_t count) noexcept
+    {
+        preprocessor_workers_ = count;
+    }
+
+    /// \effects Enables caching of the preprocessor output in the given directory,
+    /// or disables it if the directory is empty. Default is disabled.
+    /// Once the cache is bigger than `max_size` bytes, the least recently used entries are removed.
+    /// \notes The output is reused if the file, all files it includes,
+    /// the path of the clang binary and the flags are the same.
+    /// The directory can be shared between multiple processes.
+    /// \notes The cache isn't used for in-process preprocessing.
+    void preprocessor_cache(std::string directory, std::size_t max_size = 512 * 1024 * 1024u)
+    {
+        preprocessor_cache_directory_ = std::move(directory);
+        preprocessor_cache_size_      = max_size;
+    }
+
+    /// \effects Sets whether or not cached information about files is checked to be up-to-date.
+    /// Default value is `true`.
+    /// \notes The preprocessor caches whether a file exists, its include guard and a hash of its
+    /// content for the lifetime of the process, as headers are accessed for many files.
+    /// If this option is `true`, an entry is recomputed when the modification time or the size of
+    /// the file changed, otherwise files are only read the first time they are accessed.
+    /// Disable it only if the files don't change while the process is running.
+    void revalidate_file_metadata(bool b) noexcept
+    {
+        revalidate_file_metadata_ = b;
+    }
+
+    /// \effects Sets whether or not translation units are kept alive to be reparsed.
+    /// Default value is `false`.
+    /// \notes If this option is `true`, libclang creates a precompiled preamble for the includes
+    /// at the beginning of the file and the [cppast::libclang_parser]() keeps the translation unit
+    /// after parsing. When the same file is parsed again with the same flags and options,
+    /// the translation unit is reparsed, which reuses the preamble if it hasn't changed.
+    /// This speeds up parsing a file repeatedly after it was edited,
+    /// but every translation unit is kept in memory until
+    /// [cppast::libclang_parser::release_translation_units]() is called.
+    void precompiled_preamble(bool b) noexcept
+    {
+        precompiled_preamble_ = b;
+    }
+
+    /// \effects Sets whether or not libclang skips the bodies of function definitions.
+    /// Default value is `false`.
+    /// \notes cppast doesn't expose function bodies, so libclang doesn't need to parse and check
+    /// them. The body kind of functions is still reported correctly, but diagnostics for errors
+    /// inside function bodies are no longer issued.
+    void skip_function_bodies(bool b) noexcept
+    {
+        skip_function_bodies_ = b;
+    }
+
+    /// \effects Sets whether or not the strings of unexposed expressions are created lazily.
+    /// Default value is `false`.
+    /// \notes This affects the expressions of default values, initializers, noexcept conditions
+    /// and the like. If this option is `true`, the parser only stores their tokens compactly in a
+    /// buffer shared by the file, and [cppast::cpp_unexposed_expression::expression]() creates the
+    /// string on first access. This saves time and memory if most expressions are never looked at,
+    /// but the buffer is kept alive as long as one of the expressions of the file is.
+    void lazy_expressions(bool b) noexcept
+    {
+        lazy_expressions_ = b;
+    }
+
+    /// \effects Sets the filter that decides which entities are parsed,
+    /// or disables filtering if it is empty. Default is disabled.
+    /// \notes The filter is called before anything of the entity is parsed,
+    /// entities it rejects are not created at all, along with all of their children,
+    /// and their documentation comments are dropped.
+    /// Unlike a [cppast::visit_filter]() this saves the work of parsing them,
+    /// but the filter can only look at the kind, name and scope of the entity.
+    /// Rejected entities are not registered in the [cppast::cpp_entity_index]() either,
+    /// so references to them can't be resolved.
+    /// \notes The filter is called for every entity in the file except for the ones in language
+    /// linkage specifications (which aren't filtered themselves) and for the entity of a template,
+    /// which is parsed if the template is.
+    /// It can be called concurrently if files are parsed in parallel.
+    void parse_filter(libclang_parse_filter filter)
+    {
+        parse_filter_ = std::move(filter);
+    }
+
 private:
     void do_set_flags(cpp_standard standard, compile_flags flags) override;
 
@@ -190,11 +345,20 @@ private:
 
     bool do_use_c() const noexcept override;
 
-    std::string clang_binary_;
-    bool        write_preprocessed_ : 1;
-    bool        fast_preprocessing_ : 1;
-    bool        remove_comments_in_macro_ : 1;
-    bool        use_c_ : 1;
+    std::string           clang_binary_;
+    std::string           preprocessor_cache_directory_;
+    libclang_parse_filter parse_filter_;
+    std::size_t           preprocessor_cache_size_;
+    std::size_t           preprocessor_workers_;
+    bool                  write_preprocessed_ : 1;
+    bool                  fast_preprocessing_ : 1;
+    bool                  remove_comments_in_macro_ : 1;
+    bool                  in_process_preprocessing_ : 1;
+    bool                  revalidate_file_metadata_ : 1;
+    bool                  precompiled_preamble_ : 1;
+    bool                  skip_function_bodies_ : 1;
+    bool                  lazy_expressions_ : 1;
+    bool                  use_c_ : 1;
 
     friend detail::libclang_compile_config_access;
 };
@@ -211,6 +375,15 @@ type_safe::optional<libclang_compile_config> find_config_for(
     const libclang_compilation_database& database, std::string file_name);
 
 /// A parser that uses libclang.
+///
+/// If libclang reports that it crashed while creating or reparsing the translation unit of a file,
+/// only that file is affected: the crash is logged as a critical diagnostic and [*parse]() returns
+/// `nullptr`.
+/// \notes This relies on the crash recovery of libclang and doesn't isolate the process:
+/// a crash in any other libclang call, e.g. while the AST is converted,
+/// or a fatal error that exits the process still terminates it,
+/// and so does every crash if the environment variable `LIBCLANG_DISABLE_CRASH_RECOVERY` is set.
+/// Parse in a separate process if that must not happen.
 class libclang_parser final : public parser
 {
 public:
@@ -227,6 +400,44 @@ public:
 
     ~libclang_parser() noexcept override;
 
+    /// \effects Preprocesses the given file without parsing it.
+    /// \returns The [cppast::cpp_file]() object containing only the
+    /// [cppast::cpp_include_directive]() and [cppast::cpp_macro_definition]() entities of the file.
+    /// It can be `nullptr`, if there was an error or the specified file already registered in the
+    /// index.
+    /// \notes This is a lot faster than [*parse](), as no translation unit is created.
+    /// The option for in-process preprocessing is ignored, as it requires a translation unit.
+    /// \notes The file is registered in the index like a parsed file,
+    /// so the [cppast::cpp_file_ref]() of the include directives of other files can be resolved.
+    /// As a file can only be registered once, use a different index if the file is going to be
+    /// parsed as well.
+    /// \notes This function is thread safe.
+    std::unique_ptr<cpp_file> preprocess(const cpp_entity_index& idx, std::string path,
+                                         const libclang_compile_config& config) const;
+
+    /// \effects Queues the given file to be parsed by [*parse]() using a copy of the given
+    /// configuration.
+    /// \returns A future that returns the resulting file, the parsing can be cancelled through it
+    /// as long as it hasn't been started.
+    /// \requires The index must outlive the parsing.
+    /// \notes The files are parsed by a pool of threads, one per hardware thread,
+    /// that is created on the first call.
+    /// Destroying the parser cancels the files that haven't been started and waits for the others.
+    /// \notes This function is thread safe.
+    parse_future parse_async(const cpp_entity_index& idx, std::string path,
+                             libclang_compile_config config) const;
+
+    /// \effects Sets whether or not the threads libclang creates while parsing run with background
+    /// priority. Default value is `false`.
+    /// \notes Every thread calling [*parse]() at the same time uses its own `CXIndex`,
+    /// they are kept for later calls. This sets the global options of all of them.
+    void background_priority(bool b) noexcept;
+
+    /// \effects Destroys the translation units kept alive for reparsing,
+    /// see [cppast::libclang_compile_config::precompiled_preamble]().
+    /// \notes This function is thread safe.
+    void release_translation_units() noexcept;
+
 private:
     std::unique_ptr<cpp_file> do_parse(const cpp_entity_index& idx, std::string path,
                                        const compile_config& config) const override;
@@ -267,6 +478,12 @@ void parse_files(FileParser& parser, Range&& file_names,
 /// \requires `FileParser` must have the same requirements as for
 /// [cppast::parse_files](standardese://parse_files_basic/). It must also use the libclang parser,
 /// i.e. `FileParser::parser` must be an alias of [cppast::libclang_parser]().
+///
+/// \notes With a [cppast::parallel_file_parser]() the files are parsed concurrently,
+/// call its `finish()` function afterwards to wait for them.
+/// Give it [cppast::file_parse_costs]() to parse the most expensive files of the database first,
+/// and call its `hold()` function before, so that the files are only parsed once all of them are
+/// queued.
 template <class FileParser>
 void parse_database(FileParser& parser, const libclang_compilation_database& database)
 {
@@ -284,6 +501,84 @@ void parse_database(FileParser& parser, const libclang_compilation_database& dat
         data.parser.parse(std::move(file), std::move(config));
     });
 }
+
+/// Preprocesses the files specified in a compilation database using a [cppast::libclang_parser]().
+///
+/// \effects For each file specified in the compilation database,
+/// invokes [cppast::libclang_parser::preprocess]() with the configuration specified in the
+/// database. The files are preprocessed in parallel using `no_threads` threads,
+/// or one per hardware thread if it is `0`.
+///
+/// \returns The resulting files in the order of the database,
+/// an element is `nullptr` if [cppast::libclang_parser::preprocess]() returned `nullptr`.
+///
+/// \throws The first exception thrown while preprocessing a file,
+/// after all threads have finished.
+std::vector<std::unique_ptr<cpp_file>> preprocess_database(
+    const libclang_parser& parser, const cpp_entity_index& idx,
+    const libclang_compilation_database& database, unsigned no_threads = 0u);
+
+/// The filter of [cppast::find_database_headers]().
+///
+/// It returns `true` if the included header should be parsed, and `false` otherwise.
+using libclang_include_filter = std::function<bool(const cpp_include_directive&)>;
+
+/// A header included by a file of a compilation database.
+struct libclang_database_header
+{
+    /// The full path of the header.
+    std::string path;
+    /// The configuration of the first file including it.
+    libclang_compile_config config;
+};
+
+/// Finds the headers included by the files specified in a compilation database.
+///
+/// \effects Preprocesses the files as [cppast::preprocess_database]() does.
+/// Every header included by one of them for which the filter returns `true` is preprocessed as
+/// well, to find the headers it includes, and so on.
+///
+/// \returns Every header found exactly once, even if it is included through different paths,
+/// in the order they were found,
+/// along with the configuration of the first file including it.
+/// The files of the database are not part of the result.
+///
+/// \throws The first exception thrown while preprocessing a file,
+/// after all threads have finished.
+std::vector<libclang_database_header> find_database_headers(
+    const libclang_parser& parser, const libclang_compilation_database& database,
+    const libclang_include_filter& filter, unsigned no_threads = 0u);
+
+/// Parses the files specified in a compilation database and the headers they include,
+/// parsing every header only once.
+///
+/// \effects Uses [cppast::find_database_headers]() with the given `preprocessor` to find the
+/// headers for which the filter returns `true`. Then it invokes [cppast::parse_database]() and
+/// parses every header with the configuration returned alongside it.
+///
+/// \requires `FileParser` must have the same requirements as for [cppast::parse_database]().
+///
+/// \notes The `preprocessor` is only used to find the headers,
+/// give it the same logger as the parser of `FileParser`.
+///
+/// \notes The entities of a header are only part of the [cppast::cpp_file]() of the header itself,
+/// so they are registered in the index exactly once.
+/// Calling [cppast::resolve_includes]() for every file instead parses a header again for every file
+/// including it.
+template <class FileParser>
+void parse_database_with_headers(FileParser& parser, const libclang_parser& preprocessor,
+                                 const libclang_compilation_database& database,
+                                 const libclang_include_filter&       filter)
+{
+    static_assert(std::is_same<typename FileParser::parser, libclang_parser>::value,
+                  "must use the libclang parser");
+    // find them first, so a parallel parser can parse them along with the files of the database
+    auto headers = find_database_headers(preprocessor, database, filter);
+
+    parse_database(parser, database);
+    for (auto& header : headers)
+        parser.parse(std::move(header.path), std::move(header.config));
+}
 } // namespace cppast
 
 #endif // CPPAST_LIBCLANG_PARSER_HPP_INCLUDED
@@ -4,7 +4,18 @@
 #ifndef CPPAST_PARSER_HPP_INCLUDED
 #define CPPAST_PARSER_HPP_INCLUDED
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <cppast/compile_config.hpp>
 #include <cppast/cpp_file.hpp>
@@ -86,9 +97,120 @@ private:
     mutable std::atomic<bool>                      error_;
 };
 
+/// Exception thrown by [cppast::parse_future::get]() if the parsing was cancelled.
+class parse_cancelled : public std::runtime_error
+{
+public:
+    parse_cancelled() : std::runtime_error("parsing was cancelled") {}
+};
+
+namespace detail
+{
+    struct async_parse_state
+    {
+        enum status_t : int
+        {
+            queued,
+            running,
+            cancelled,
+        };
+
+        std::atomic<int>                        status;
+        std::promise<std::unique_ptr<cpp_file>> promise;
+
+        async_parse_state() : status(queued) {}
+
+        // cancels it if it hasn't started yet
+        bool cancel()
+        {
+            auto expected = int(queued);
+            if (!status.compare_exchange_strong(expected, cancelled))
+                return false;
+            promise.set_exception(std::make_exception_ptr(parse_cancelled()));
+            return true;
+        }
+
+        // runs the function if it hasn't been cancelled
+        template <typename Fn>
+        void run(Fn&& parse)
+        {
+            auto expected = int(queued);
+            if (!status.compare_exchange_strong(expected, running))
+                return;
+
+            std::unique_ptr<cpp_file> result;
+            std::exception_ptr        error;
+            try
+            {
+                result = std::forward<Fn>(parse)();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            if (error)
+                promise.set_exception(error);
+            else
+                promise.set_value(std::move(result));
+        }
+    };
+} // namespace detail
+
+/// The result of a file that is parsed asynchronously.
+///
+/// It behaves like a `std::future<std::unique_ptr<cpp_file>>`,
+/// but the parsing can be cancelled as long as it hasn't been started.
+class parse_future
+{
+public:
+    /// \effects Creates it from the state shared with the thread parsing the file.
+    /// \exclude
+    explicit parse_future(std::shared_ptr<detail::async_parse_state> state)
+    : state_(std::move(state)), future_(state_->promise.get_future())
+    {}
+
+    /// \effects Waits until the file is parsed.
+    /// \returns The result of [cppast::parser::parse]().
+    /// \throws The exception thrown while parsing,
+    /// or [cppast::parse_cancelled]() if the parsing was cancelled.
+    /// \requires It must only be called once.
+    std::unique_ptr<cpp_file> get()
+    {
+        return future_.get();
+    }
+
+    /// \effects Waits until the file is parsed or the parsing was cancelled.
+    void wait() const
+    {
+        future_.wait();
+    }
+
+    /// \effects Waits until the file is parsed or the parsing was cancelled,
+    /// but at most the given duration.
+    /// \returns The status of the underlying `std::future`.
+    template <class Rep, class Period>
+    std::future_status wait_for(const std::chrono::duration<Rep, Period>& duration) const
+    {
+        return future_.wait_for(duration);
+    }
+
+    /// \effects Cancels the parsing, if it hasn't been started yet.
+    /// \returns Whether or not it was cancelled.
+    /// If it returns `false`, the file is already being parsed or has been parsed.
+    bool cancel()
+    {
+        return state_->cancel();
+    }
+
+private:
+    std::shared_ptr<detail::async_parse_state> state_;
+    std::future<std::unique_ptr<cpp_file>>     future_;
+};
+
 /// A simple `FileParser` that parses all files synchronously.
 ///
-/// More advanced parsers could use a thread pool, for example.
+/// See [cppast::parallel_file_parser]() for a parser using a thread pool.
 template <class Parser>
 class simple_file_parser
 {
@@ -150,6 +272,301 @@ private:
     type_safe::object_ref<const cpp_entity_index> idx_;
 };
 
+/// The estimated costs of parsing files.
+///
+/// It is used by the [cppast::parallel_file_parser]() to parse the most expensive files first,
+/// so a single expensive file doesn't delay the end of the parsing.
+///
+/// The cost of a file is the time it took to parse it the last time, if that has been recorded.
+/// Otherwise, it is estimated from the size of the file,
+/// scaled to match the recorded times of other files.
+/// The file isn't read for that, so it is cheap to estimate the cost while queuing files.
+/// The recorded times can be stored in a file to use them in the next run.
+///
+/// \notes All member functions are thread safe.
+class file_parse_costs
+{
+public:
+    /// \effects Creates it without any recorded times.
+    file_parse_costs() : total_seconds_(0.), total_heuristic_(0.) {}
+
+    /// \effects Creates it reading the recorded times from the given file, if it exists.
+    /// [*save()]() will write them back to the same file.
+    explicit file_parse_costs(std::string file);
+
+    file_parse_costs(const file_parse_costs&)            = delete;
+    file_parse_costs& operator=(const file_parse_costs&) = delete;
+
+    /// \returns The estimated time it takes to parse the given file, in seconds.
+    /// If it isn't known, it is `0`.
+    double estimate(const std::string& path) const;
+
+    /// \effects Records the time it took to parse the given file, in seconds.
+    void record(const std::string& path, double seconds);
+
+    /// \effects Writes the recorded times to the file given in the constructor,
+    /// merging them with the times recorded by other processes in the mean time.
+    /// \returns Whether or not the file was written successfully.
+    /// If no file was given in the constructor, it does nothing and returns `false`.
+    bool save() const;
+
+private:
+    struct entry
+    {
+        double seconds;   // the recorded time
+        double heuristic; // the heuristic cost when it was recorded
+    };
+
+    void read_file() const;
+
+    std::string                                    file_;
+    mutable std::mutex                             mutex_;
+    mutable std::unordered_map<std::string, entry> entries_;
+    mutable double                                 total_seconds_, total_heuristic_;
+};
+
+namespace detail
+{
+    // a pool of threads executing jobs
+    // the queued job with the highest priority is executed next,
+    // jobs with the same priority in the order they were submitted
+    class parse_executor
+    {
+    public:
+        // uses no_threads threads, or one per hardware thread if it is 0,
+        // they are started when the first job is submitted
+        explicit parse_executor(unsigned no_threads = 0u);
+
+        parse_executor(const parse_executor&)            = delete;
+        parse_executor& operator=(const parse_executor&) = delete;
+
+        ~parse_executor() noexcept
+        {
+            stop();
+        }
+
+        // queues the job, discard is called instead of run if stop() discards it
+        void submit(std::function<void()> run, std::function<void()> discard = nullptr,
+                    double priority = 0.);
+
+        // queued jobs aren't started until release() is called
+        void hold() noexcept;
+        void release() noexcept;
+
+        // discards the queued jobs and waits for the running ones
+        // no job must be submitted afterwards
+        void stop() noexcept;
+
+    private:
+        struct job
+        {
+            double                priority;
+            std::size_t           index;
+            std::function<void()> run, discard;
+        };
+
+        struct job_less
+        {
+            bool operator()(const job& lhs, const job& rhs) const noexcept
+            {
+                if (lhs.priority != rhs.priority)
+                    return lhs.priority < rhs.priority;
+                return lhs.index > rhs.index;
+            }
+        };
+
+        void work();
+
+        std::mutex               mutex_;
+        std::condition_variable  queued_;
+        std::vector<job>         jobs_; // heap ordered by job_less
+        std::vector<std::thread> threads_;
+        std::size_t              no_submitted_;
+        unsigned                 no_threads_;
+        bool                     held_, stop_;
+    };
+} // namespace detail
+
+/// A `FileParser` that parses the files asynchronously using a pool of threads.
+///
+/// [*parse()]() only queues the file, it is then parsed by one of the threads,
+/// which registers it in the index as soon as it is finished.
+/// [*finish()]() waits until all queued files are parsed and makes them available in [*files()]()
+/// in the order they were queued.
+///
+/// By default, the files are parsed in the order they were queued.
+/// If [cppast::file_parse_costs]() are given, the queued file with the highest estimated cost is
+/// parsed next instead, and the time it took to parse a file is recorded.
+/// As idle threads start parsing a file as soon as it is queued,
+/// call [*hold()]() before queuing the files, so that all of them are ordered.
+///
+/// \notes [*parse()]() and [*finish()]() must be called from the same thread.
+template <class Parser>
+class parallel_file_parser
+{
+    static_assert(std::is_base_of<cppast::parser, Parser>::value,
+                  "Parser must be derived from cppast::parser");
+
+public:
+    using parser = Parser;
+    using config = typename Parser::config;
+
+    /// \effects Creates a file parser populating the given index,
+    /// using `no_threads` threads, or one per hardware thread if it is `0`,
+    /// and using the parser created by forwarding the given arguments.
+    template <typename... Args>
+    explicit parallel_file_parser(type_safe::object_ref<const cpp_entity_index> idx,
+                                  unsigned no_threads, Args&&... args)
+    : parser_(std::forward<Args>(args)...), idx_(idx), pending_(0u), executor_(no_threads)
+    {}
+
+    parallel_file_parser(const parallel_file_parser&)            = delete;
+    parallel_file_parser& operator=(const parallel_file_parser&) = delete;
+
+    /// \effects Discards all files that are queued but not yet being parsed,
+    /// and waits for the ones that are.
+    ~parallel_file_parser() noexcept
+    {
+        executor_.stop();
+    }
+
+    /// \effects Sets the costs used to determine the order in which queued files are parsed,
+    /// and where the time it took to parse a file is recorded.
+    /// If it is `nullptr`, the files are parsed in the order they were queued.
+    /// \requires No file must be queued or being parsed.
+    void set_costs(type_safe::optional_ref<file_parse_costs> costs) noexcept
+    {
+        costs_ = costs;
+    }
+
+    /// \effects Queued files aren't parsed until the next call to [*finish()]().
+    void hold() noexcept
+    {
+        executor_.hold();
+    }
+
+    /// \effects Queues the given file to be parsed using a copy of the given configuration.
+    void parse(std::string path, config c)
+    {
+        parser_.logger().log("parallel file parser", diagnostic{"queuing file '" + path + "'",
+                                                                source_location(),
+                                                                severity::info});
+        auto cost = costs_ ? costs_.value().estimate(path) : 0.;
+
+        std::size_t index;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            index = results_.size();
+            results_.emplace_back();
+            ++pending_;
+        }
+
+        try
+        {
+            executor_.submit([this, index, path, c] { parse_file(index, path, c); }, nullptr,
+                             cost);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --pending_;
+            throw;
+        }
+    }
+
+    /// \effects Waits until all queued files are parsed,
+    /// and appends the ones that were parsed successfully to [*files()]().
+    /// \throws The first exception thrown while parsing a file,
+    /// after all files have been parsed.
+    void finish()
+    {
+        executor_.release();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_.wait(lock, [&] { return pending_ == 0u; });
+
+        for (auto& file : results_)
+            if (file)
+                files_.push_back(std::move(file));
+        results_.clear();
+
+        auto error = error_;
+        error_     = nullptr;
+        lock.unlock();
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    /// \returns The result of [cppast::parser::error]().
+    bool error() const noexcept
+    {
+        return parser_.error();
+    }
+
+    /// \effects Calls [cppast::parser::reset_error]().
+    void reset_error() noexcept
+    {
+        parser_.reset_error();
+    }
+
+    /// \returns The index that is being populated.
+    const cpp_entity_index& index() const noexcept
+    {
+        return *idx_;
+    }
+
+    /// \returns An iteratable object iterating over all the files that have been parsed
+    /// before the last call to [*finish()]().
+    /// \exclude return
+    detail::iteratable_intrusive_list<cpp_file> files() const noexcept
+    {
+        return type_safe::ref(files_);
+    }
+
+private:
+    void parse_file(std::size_t index, const std::string& path, const config& c)
+    {
+        std::unique_ptr<cpp_file> file;
+        std::exception_ptr        error;
+        try
+        {
+            auto start = std::chrono::steady_clock::now();
+            file       = parser_.parse(*idx_, path, c);
+            if (costs_)
+            {
+                std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+                costs_.value().record(path, duration.count());
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        // store it at the position it was queued, so the order doesn't depend on the timing
+        results_[index] = std::move(file);
+        if (error && !error_)
+            error_ = error;
+        if (--pending_ == 0u)
+            finished_.notify_all();
+    }
+
+    Parser                                        parser_;
+    detail::intrusive_list<cpp_file>              files_;
+    type_safe::object_ref<const cpp_entity_index> idx_;
+    type_safe::optional_ref<file_parse_costs>     costs_;
+
+    std::mutex                             mutex_;
+    std::condition_variable                finished_;
+    std::vector<std::unique_ptr<cpp_file>> results_;
+    std::size_t                            pending_;
+    std::exception_ptr                     error_;
+
+    detail::parse_executor executor_;
+};
+
 namespace detail
 {
     struct std_begin
@@ -5,6 +5,25 @@
 
 using namespace cppast;
 
+cpp_unexposed_expression::~cpp_unexposed_expression() noexcept
+{
+    delete lazy_str_.load();
+}
+
+const cpp_token_string& cpp_unexposed_expression::lazy_expression() const noexcept
+{
+    if (auto str = lazy_str_.load(std::memory_order_acquire))
+        return *str;
+
+    std::unique_ptr<const cpp_token_string> str(new cpp_token_string(buffer_->get(begin_, end_)));
+    const cpp_token_string* expected = nullptr;
+    if (lazy_str_.compare_exchange_strong(expected, str.get(), std::memory_order_acq_rel))
+        return *str.release();
+    else
+        // another thread was faster
+        return *expected;
+}
+
 namespace
 {
 void write_literal(code_generator::output& output, const cpp_literal_expression& expr)
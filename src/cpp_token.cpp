@@ -625,3 +625,24 @@ bool cppast::operator==(const cpp_token_string& lhs, const cpp_token_string& rhs
         return false;
     return std::equal(lhs.tokens_.begin(), lhs.tokens_.end(), rhs.tokens_.begin());
 }
+
+void cpp_token_buffer::add_token(cpp_token_kind kind, const char* spelling, std::size_t length)
+{
+    spellings_.append(spelling, length);
+    tokens_.push_back({std::uint32_t(spellings_.size()), kind});
+}
+
+cpp_token_string cpp_token_buffer::get(std::size_t begin, std::size_t end) const
+{
+    DEBUG_ASSERT(begin <= end && end <= tokens_.size(), detail::precondition_error_handler{},
+                 "invalid token range");
+
+    std::vector<cpp_token> result;
+    result.reserve(end - begin);
+    for (auto i = begin; i != end; ++i)
+    {
+        auto first = i == 0u ? 0u : tokens_[i - 1u].end;
+        result.emplace_back(tokens_[i].kind, spellings_.substr(first, tokens_[i].end - first));
+    }
+    return cpp_token_string(std::move(result));
+}
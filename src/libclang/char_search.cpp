@@ -0,0 +1,160 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#include "char_search.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#include <cppast/detail/assert.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define CPPAST_CHAR_SEARCH_SSE2 1
+#    include <emmintrin.h>
+
+#    if defined(__AVX2__)
+// AVX2 is always available
+#        define CPPAST_CHAR_SEARCH_AVX2 1
+#        define CPPAST_TARGET_AVX2
+#        include <immintrin.h>
+#    elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+// AVX2 is only used if the CPU supports it
+#        define CPPAST_CHAR_SEARCH_AVX2 2
+#        define CPPAST_TARGET_AVX2 __attribute__((target("avx2")))
+#        include <immintrin.h>
+#    endif
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#    include <intrin.h>
+#endif
+
+// the vectorized search reads whole aligned blocks, which can include bytes before the string
+// this is fine as an aligned block never crosses a page boundary,
+// but address sanitizer would complain
+#if defined(__clang__) || defined(__GNUC__)
+#    define CPPAST_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#    define CPPAST_NO_SANITIZE_ADDRESS
+#endif
+
+using namespace cppast;
+
+const char* detail::find_first_of_scalar(const char* str, const char* set) noexcept
+{
+    return std::strpbrk(str, set);
+}
+
+#if defined(CPPAST_CHAR_SEARCH_SSE2)
+namespace
+{
+unsigned count_trailing_zeros(std::uint32_t mask) noexcept
+{
+#    if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long result;
+    _BitScanForward(&result, mask);
+    return unsigned(result);
+#    else
+    return unsigned(__builtin_ctz(mask));
+#    endif
+}
+
+// bit i is set if the ith character is null or in the set
+std::uint32_t match_sse2(const char* ptr, const __m128i* needles, std::size_t no_needles) noexcept
+{
+    auto chunk   = _mm_load_si128(reinterpret_cast<const __m128i*>(ptr));
+    auto matches = _mm_cmpeq_epi8(chunk, _mm_setzero_si128());
+    for (auto i = 0u; i != no_needles; ++i)
+        matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, needles[i]));
+    return std::uint32_t(_mm_movemask_epi8(matches));
+}
+
+CPPAST_NO_SANITIZE_ADDRESS
+const char* find_first_of_sse2(const char* str, const char* set) noexcept
+{
+    __m128i     needles[8];
+    std::size_t no_needles = 0u;
+    for (; set[no_needles]; ++no_needles)
+    {
+        DEBUG_ASSERT(no_needles < 8u, detail::assert_handler{}, "too many characters");
+        needles[no_needles] = _mm_set1_epi8(set[no_needles]);
+    }
+
+    // start at the aligned block containing str, ignoring the characters before it
+    auto offset = std::size_t(reinterpret_cast<std::uintptr_t>(str) % sizeof(__m128i));
+    auto ptr    = str - offset;
+    auto mask   = match_sse2(ptr, needles, no_needles) & (~std::uint32_t(0) << offset);
+    while (mask == 0u)
+    {
+        ptr += sizeof(__m128i);
+        mask = match_sse2(ptr, needles, no_needles);
+    }
+
+    auto result = ptr + count_trailing_zeros(mask);
+    return *result ? result : nullptr;
+}
+
+#    if defined(CPPAST_CHAR_SEARCH_AVX2)
+// same as the SSE2 version, but with 32 characters at once
+// the intrinsics can only be inlined into functions compiled for AVX2,
+// so it can't share the code
+CPPAST_TARGET_AVX2
+std::uint32_t match_avx2(const char* ptr, const __m256i* needles, std::size_t no_needles) noexcept
+{
+    auto chunk   = _mm256_load_si256(reinterpret_cast<const __m256i*>(ptr));
+    auto matches = _mm256_cmpeq_epi8(chunk, _mm256_setzero_si256());
+    for (auto i = 0u; i != no_needles; ++i)
+        matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(chunk, needles[i]));
+    return std::uint32_t(_mm256_movemask_epi8(matches));
+}
+
+CPPAST_TARGET_AVX2 CPPAST_NO_SANITIZE_ADDRESS
+const char* find_first_of_avx2(const char* str, const char* set) noexcept
+{
+    __m256i     needles[8];
+    std::size_t no_needles = 0u;
+    for (; set[no_needles]; ++no_needles)
+    {
+        DEBUG_ASSERT(no_needles < 8u, detail::assert_handler{}, "too many characters");
+        needles[no_needles] = _mm256_set1_epi8(set[no_needles]);
+    }
+
+    auto offset = std::size_t(reinterpret_cast<std::uintptr_t>(str) % sizeof(__m256i));
+    auto ptr    = str - offset;
+    auto mask   = match_avx2(ptr, needles, no_needles) & (~std::uint32_t(0) << offset);
+    while (mask == 0u)
+    {
+        ptr += sizeof(__m256i);
+        mask = match_avx2(ptr, needles, no_needles);
+    }
+
+    auto result = ptr + count_trailing_zeros(mask);
+    return *result ? result : nullptr;
+}
+
+bool has_avx2() noexcept
+{
+#        if CPPAST_CHAR_SEARCH_AVX2 == 1
+    return true;
+#        else
+    static const bool result = __builtin_cpu_supports("avx2") != 0;
+    return result;
+#        endif
+}
+#    endif
+} // namespace
+
+const char* detail::find_first_of(const char* str, const char* set) noexcept
+{
+#    if defined(CPPAST_CHAR_SEARCH_AVX2)
+    if (has_avx2())
+        return find_first_of_avx2(str, set);
+#    endif
+    return find_first_of_sse2(str, set);
+}
+#else
+const char* detail::find_first_of(const char* str, const char* set) noexcept
+{
+    return find_first_of_scalar(str, set);
+}
+#endif
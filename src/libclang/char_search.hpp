@@ -0,0 +1,24 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#ifndef CPPAST_CHAR_SEARCH_HPP_INCLUDED
+#define CPPAST_CHAR_SEARCH_HPP_INCLUDED
+
+#include <cstddef>
+
+namespace cppast
+{
+namespace detail
+{
+    // returns a pointer to the first character in the null-terminated str that is in set,
+    // or nullptr if there is none
+    // same as std::strpbrk(), but uses SSE2 if available, and AVX2 if the CPU supports it
+    // requires: set has at most 8 characters
+    const char* find_first_of(const char* str, const char* set) noexcept;
+
+    // the scalar implementation, always std::strpbrk()
+    const char* find_first_of_scalar(const char* str, const char* set) noexcept;
+} // namespace detail
+} // namespace cppast
+
+#endif // CPPAST_CHAR_SEARCH_HPP_INCLUDED
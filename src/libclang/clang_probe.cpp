@@ -0,0 +1,326 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#include "clang_probe.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+
+#include <process.hpp>
+
+#include <cppast/detail/assert.hpp>
+
+#include "file_metadata.hpp"
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#    include <process.h>
+#else
+#    include <unistd.h>
+#endif
+
+using namespace cppast;
+namespace tpl = TinyProcessLib;
+
+#if (defined(WIN32) || defined(_WIN32) || defined(__WIN32)) && !defined(__CYGWIN__)
+#    define CPPAST_DETAIL_WINDOWS 1
+#else
+#    define CPPAST_DETAIL_WINDOWS 0
+#endif
+
+namespace
+{
+//=== probing ===//
+std::atomic<std::size_t> probe_count(0u);
+
+bool run_is_valid_binary(const std::string& binary)
+{
+    ++probe_count;
+    tpl::Process process(
+        binary + " -v", "", [](const char*, std::size_t) {}, [](const char*, std::size_t) {});
+    return process.get_exit_status() == 0;
+}
+
+std::vector<std::string> run_get_default_include_dirs(const std::string& binary, bool use_c)
+{
+    ++probe_count;
+    std::string  verbose_output;
+    std::string  language = use_c ? "-xc" : "-xc++";
+    tpl::Process process(
+        binary + " " + language + " -v -", "", [](const char*, std::size_t) {},
+        [&](const char* str, std::size_t n) { verbose_output.append(str, n); }, true);
+    process.write("", 1);
+    process.close_stdin();
+    process.get_exit_status();
+
+    std::vector<std::string> result;
+
+    auto pos = verbose_output.find("#include <...>");
+    DEBUG_ASSERT(pos != std::string::npos, detail::assert_handler{});
+    while (verbose_output[pos] != '\n')
+        ++pos;
+    ++pos;
+
+    // now every line is an include path, starting with a space
+    while (verbose_output[pos] == ' ')
+    {
+        auto start = pos + 1;
+        while (verbose_output[pos] != '\r' && verbose_output[pos] != '\n')
+            ++pos;
+        auto end = pos;
+        ++pos;
+
+        auto        line = verbose_output.substr(start, end - start);
+        std::string path;
+        for (auto c : line)
+        {
+            if (c == ' ')
+            { // escape spaces
+#if CPPAST_DETAIL_WINDOWS
+                path += "^ ";
+#else
+                path += "\\ ";
+#endif
+            }
+            // clang under MacOS adds comments to paths using '(' at the end, so they have to be
+            // ignored however, Windows uses '(' in paths, so they don't have to be ignored
+#if !CPPAST_DETAIL_WINDOWS
+            else if (c == '(')
+                break;
+#endif
+            else
+                path += c;
+        }
+
+        result.push_back(std::move(path));
+    }
+
+    return result;
+}
+
+//=== binary lookup ===//
+bool get_file_info(const std::string& path, long long& mtime)
+{
+#ifdef _WIN32
+    struct _stat info;
+    if (_stat(path.c_str(), &info) != 0 || (info.st_mode & _S_IFREG) == 0)
+        return false;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+        return false;
+#endif
+    mtime = static_cast<long long>(info.st_mtime);
+    return true;
+}
+
+// returns the full path of the binary as the shell would find it,
+// or an empty string if it doesn't exist
+std::string find_binary(const std::string& binary, long long& mtime)
+{
+#ifdef _WIN32
+    const char* const extensions[] = {"", ".exe"};
+    const auto        separator    = ';';
+#else
+    const char* const extensions[] = {""};
+    const auto        separator    = ':';
+#endif
+    auto find = [&](const std::string& path) {
+        for (auto extension : extensions)
+        {
+            auto file = path + extension;
+            if (get_file_info(file, mtime))
+                return detail::get_canonical_path(file);
+        }
+        return std::string();
+    };
+
+    if (binary.find_first_of("/\\") != std::string::npos)
+        // path to a binary
+        return find(binary);
+
+    auto path = std::getenv("PATH");
+    for (auto cur = path; cur && *cur;)
+    {
+        auto end = cur;
+        while (*end && *end != separator)
+            ++end;
+
+        if (end != cur)
+        {
+            auto result = find(std::string(cur, end) + "/" + binary);
+            if (!result.empty())
+                return result;
+        }
+
+        cur = *end ? end + 1 : end;
+    }
+
+    return "";
+}
+
+//=== cache ===//
+// entries are stored one per line in the file:
+// <full path>\t<mtime>\t<kind>\t<value>...
+const char probe_cache_header[] = "cppast clang probe cache 1";
+
+std::vector<std::string> split(const std::string& line)
+{
+    std::vector<std::string> result;
+    for (std::size_t begin = 0u, end = 0u; end != std::string::npos; begin = end + 1u)
+    {
+        end = line.find('\t', begin);
+        result.push_back(line.substr(begin, end - begin));
+    }
+    return result;
+}
+
+class probe_cache
+{
+public:
+    static probe_cache& get()
+    {
+        static probe_cache cache;
+        return cache;
+    }
+
+    void set_file(std::string file)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_   = std::move(file);
+        loaded_ = false;
+        // write the entries of the process on next lookup
+        dirty_ = !entries_.empty();
+    }
+
+    // returns the cached result of compute() for the binary
+    template <typename Fn>
+    std::vector<std::string> lookup(const std::string& binary, const char* kind, Fn compute)
+    {
+        long long mtime;
+        auto      path = find_binary(binary, mtime);
+        if (path.empty())
+            // can't identify the binary, so don't cache it
+            return compute();
+        auto key = path + '\t' + std::to_string(mtime) + '\t' + kind;
+
+        // the lock is held while computing, so every binary is probed only once
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!loaded_)
+        {
+            read_file();
+            loaded_ = true;
+        }
+
+        auto iter = entries_.find(key);
+        if (iter == entries_.end())
+        {
+            iter   = entries_.emplace(key, compute()).first;
+            dirty_ = true;
+        }
+        auto result = iter->second;
+
+        if (dirty_ && !file_.empty())
+        {
+            // merge with entries of other processes
+            read_file();
+            write_file();
+        }
+        dirty_ = false;
+
+        return result;
+    }
+
+private:
+    probe_cache() : loaded_(false), dirty_(false) {}
+
+    void read_file()
+    {
+        std::ifstream file(file_);
+        std::string   line;
+        if (file_.empty() || !std::getline(file, line) || line != probe_cache_header)
+            return;
+
+        while (std::getline(file, line))
+        {
+            auto fields = split(line);
+            if (fields.size() < 3u)
+                continue;
+
+            auto key = fields[0] + '\t' + fields[1] + '\t' + fields[2];
+            entries_.emplace(std::move(key),
+                             std::vector<std::string>(fields.begin() + 3, fields.end()));
+        }
+    }
+
+    void write_file() const
+    {
+        // write to a temporary file first and rename it,
+        // so concurrent processes never see partially written files
+#ifdef _WIN32
+        auto temporary = file_ + "." + std::to_string(_getpid()) + ".tmp";
+#else
+        auto temporary = file_ + "." + std::to_string(getpid()) + ".tmp";
+#endif
+        {
+            std::ofstream file(temporary);
+            file << probe_cache_header << '\n';
+            for (auto& entry : entries_)
+            {
+                file << entry.first;
+                for (auto& value : entry.second)
+                    file << '\t' << value;
+                file << '\n';
+            }
+
+            if (!file)
+            {
+                file.close();
+                std::remove(temporary.c_str());
+                return;
+            }
+        }
+        if (std::rename(temporary.c_str(), file_.c_str()) != 0)
+        {
+            // rename() doesn't replace existing files on Windows
+            std::remove(file_.c_str());
+            if (std::rename(temporary.c_str(), file_.c_str()) != 0)
+                std::remove(temporary.c_str());
+        }
+    }
+
+    std::mutex                                                mutex_;
+    std::string                                               file_;
+    std::unordered_map<std::string, std::vector<std::string>> entries_;
+    bool                                                      loaded_, dirty_;
+};
+} // namespace
+
+bool detail::is_valid_binary(const std::string& binary)
+{
+    auto result = probe_cache::get().lookup(binary, "valid", [&] {
+        return std::vector<std::string>{run_is_valid_binary(binary) ? "1" : "0"};
+    });
+    return result.size() == 1u && result.front() == "1";
+}
+
+std::vector<std::string> detail::get_default_include_dirs(const std::string& binary, bool use_c)
+{
+    return probe_cache::get().lookup(binary, use_c ? "c" : "c++", [&] {
+        return run_get_default_include_dirs(binary, use_c);
+    });
+}
+
+void detail::set_probe_cache_file(std::string file)
+{
+    probe_cache::get().set_file(std::move(file));
+}
+
+std::size_t detail::get_probe_count() noexcept
+{
+    return probe_count;
+}
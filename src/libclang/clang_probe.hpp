@@ -0,0 +1,36 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#ifndef CPPAST_CLANG_PROBE_HPP_INCLUDED
+#define CPPAST_CLANG_PROBE_HPP_INCLUDED
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace cppast
+{
+namespace detail
+{
+    // information obtained by running a clang binary
+    // the results are cached for the lifetime of the process (and in the probe cache file, if set),
+    // an entry is identified by the full path and the modification time of the binary,
+    // so they are invalidated when the binary changes
+    // notes: all functions are thread-safe
+
+    // returns whether the binary can be executed
+    bool is_valid_binary(const std::string& binary);
+
+    // returns the default include directories of the binary for C or C++,
+    // spaces are already escaped for the shell
+    std::vector<std::string> get_default_include_dirs(const std::string& binary, bool use_c);
+
+    // the file the results are written to and read from, disabled if empty
+    void set_probe_cache_file(std::string file);
+
+    // returns how often a clang binary has been run to probe it
+    std::size_t get_probe_count() noexcept;
+} // namespace detail
+} // namespace cppast
+
+#endif // CPPAST_CLANG_PROBE_HPP_INCLUDED
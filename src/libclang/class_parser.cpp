@@ -50,7 +50,7 @@ cpp_class_kind parse_class_kind(detail::cxtoken_stream& stream)
 
 cpp_class::builder make_class_builder(const detail::parse_context& context, const CXCursor& cur)
 {
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     auto kind       = parse_class_kind(stream);
@@ -94,7 +94,7 @@ void add_base_class(cpp_class::builder& builder, const detail::parse_context& co
     auto access     = convert_access(cur);
     auto is_virtual = clang_isVirtualBase(cur) != 0u;
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     // [<attribute>] [virtual] [<access>] <name>
@@ -138,7 +138,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_class(const detail::parse_context&
                                 clang_getCursorLexicalParent(cur)))
         {
             // out-of-line definition
-            detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+            detail::cxtokenizer    tokenizer(context.tokens, cur);
             detail::cxtoken_stream stream(tokenizer, cur);
 
             std::string name = detail::get_cursor_name(cur).c_str();
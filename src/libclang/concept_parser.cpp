@@ -18,7 +18,7 @@ std::unique_ptr<cpp_entity> detail::try_parse_cpp_concept(const detail::parse_co
     if (libclang_definitely_has_concept_support && cur.kind != CXCursor_ConceptDecl)
         return nullptr;
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     if (!detail::skip_if(stream, "template"))
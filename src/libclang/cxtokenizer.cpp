@@ -3,7 +3,9 @@
 
 #include "cxtokenizer.hpp"
 
+#include <algorithm>
 #include <cctype>
+#include <cstring>
 
 #include "libclang_visitor.hpp"
 #include "parse_error.hpp"
@@ -55,167 +57,94 @@ bool has_inline_type_definition(CXCursor var_decl)
     return is_in_range(type_loc, var_range);
 }
 
-class simple_tokenizer
-{
-public:
-    explicit simple_tokenizer(const CXTranslationUnit& tu, const CXSourceRange& range) : tu_(tu)
-    {
-        clang_tokenize(tu, range, &tokens_, &no_);
-    }
-
-    ~simple_tokenizer()
-    {
-        clang_disposeTokens(tu_, tokens_, no_);
-    }
-
-    simple_tokenizer(const simple_tokenizer&)            = delete;
-    simple_tokenizer& operator=(const simple_tokenizer&) = delete;
-
-    unsigned size() const noexcept
-    {
-        return no_;
-    }
-
-    const CXToken& operator[](unsigned i) const noexcept
-    {
-        DEBUG_ASSERT(i < no_, detail::assert_handler{});
-        return tokens_[i];
-    }
-
-    std::string get_spelling(std::size_t length) noexcept
-    {
-        // might need multiple tokens, because [[, for example, is treated as two separate tokens
-
-        std::string result;
-        for (auto cur = 0u; cur < no_; ++cur)
-        {
-            auto cur_spelling = detail::cxstring(clang_getTokenSpelling(tu_, tokens_[cur]));
-            result += cur_spelling.c_str();
-            if (result.length() >= length)
-                return result;
-        }
-        return result;
-    }
-
-private:
-    CXTranslationUnit tu_;
-    CXToken*          tokens_;
-    unsigned          no_;
-};
-
-CXSourceLocation get_next_location_impl(const CXTranslationUnit& tu, CXFile file,
-                                        const CXSourceLocation& loc, int inc = 1)
+CXSourceLocation get_next_location(const detail::cxtoken_table& tokens,
+                                   const CXSourceLocation& loc, std::size_t token_length)
 {
     DEBUG_ASSERT(clang_Location_isFromMainFile(loc), detail::assert_handler{});
 
-    unsigned offset;
-    clang_getSpellingLocation(loc, nullptr, nullptr, nullptr, &offset);
-    if (inc >= 0)
-        offset += unsigned(inc);
-    else
-        offset -= unsigned(-inc);
-    return clang_getLocationForOffset(tu, file, offset);
-}
-
-CXSourceLocation get_next_location(const CXTranslationUnit& tu, const CXFile& file,
-                                   const CXSourceLocation& loc, std::size_t token_length)
-{
     // simple move over by token_length
-    return get_next_location_impl(tu, file, loc, int(token_length));
+    auto offset = tokens.get_offset(loc) + unsigned(token_length);
+    return tokens.get_location(offset);
 }
 
-CXSourceLocation get_prev_location(const CXTranslationUnit& tu, const CXFile& file,
+CXSourceLocation get_prev_location(const detail::cxtoken_table& tokens,
                                    const CXSourceLocation& loc, std::size_t token_length)
 {
-    auto inc = 1;
-    while (true)
-    {
-        auto loc_before = get_next_location_impl(tu, file, loc, -inc);
-        DEBUG_ASSERT(!clang_equalLocations(loc_before, loc), detail::assert_handler{});
-
-        if (!clang_Location_isFromMainFile(loc_before))
-            // out of range
-            return clang_getNullLocation();
-
-        simple_tokenizer tokenizer(tu, clang_getRange(loc_before, loc));
-
-        auto token_location = clang_getTokenLocation(tu, tokenizer[0]);
-        if (clang_equalLocations(loc_before, token_location))
-        {
-            // actually found a new token and not just whitespace
-            // loc_before is now the last character of the new token
-            // need to move by token_length - 1 to get to the first character
-            return get_next_location_impl(tu, file, loc, -1 * (inc + int(token_length) - 1));
-        }
-        else
-            ++inc;
-    }
+    DEBUG_ASSERT(clang_Location_isFromMainFile(loc), detail::assert_handler{});
 
-    return clang_getNullLocation();
+    auto token_end = tokens.get_prev_token_end(tokens.get_offset(loc));
+    if (!token_end || token_end.value() < token_length)
+        // out of range
+        return clang_getNullLocation();
+    // assume the token has the given length to get to the first character
+    return tokens.get_location(token_end.value() - unsigned(token_length));
 }
 
-bool token_at_is(const CXTranslationUnit& tu, const CXFile& file, const CXSourceLocation& loc,
+bool token_at_is(const detail::cxtoken_table& tokens, const CXSourceLocation& loc,
                  const char* token_str)
 {
     auto length = std::strlen(token_str);
 
-    auto loc_after = get_next_location(tu, file, loc, length);
+    auto loc_after = get_next_location(tokens, loc, length);
     if (!clang_Location_isFromMainFile(loc_after))
         return false;
 
-    simple_tokenizer tokenizer(tu, clang_getRange(loc, loc_after));
-    return tokenizer.get_spelling(length) == token_str;
+    return tokens.get_spelling(tokens.get_offset(loc), tokens.get_offset(loc_after), length)
+           == token_str;
 }
 
-bool consume_if_token_at_is(const CXTranslationUnit& tu, const CXFile& file, CXSourceLocation& loc,
+bool consume_if_token_at_is(const detail::cxtoken_table& tokens, CXSourceLocation& loc,
                             const char* token_str)
 {
-    auto length = std::strlen(token_str);
-
-    auto loc_after = get_next_location(tu, file, loc, length);
-    if (!clang_Location_isFromMainFile(loc_after))
+    if (!token_at_is(tokens, loc, token_str))
         return false;
 
-    simple_tokenizer tokenizer(tu, clang_getRange(loc, loc_after));
-    if (tokenizer.get_spelling(length) == token_str)
-    {
-        loc = loc_after;
-        return true;
-    }
-    else
-        return false;
+    loc = get_next_location(tokens, loc, std::strlen(token_str));
+    return true;
 }
 
-bool token_before_is(const CXTranslationUnit& tu, const CXFile& file, const CXSourceLocation& loc,
+bool token_before_is(const detail::cxtoken_table& tokens, const CXSourceLocation& loc,
                      const char* token_str)
 {
     auto length = std::strlen(token_str);
 
-    auto loc_before = get_prev_location(tu, file, loc, length);
+    auto loc_before = get_prev_location(tokens, loc, length);
     if (!clang_Location_isFromMainFile(loc_before))
         return false;
 
-    simple_tokenizer tokenizer(tu, clang_getRange(loc_before, loc));
-    return tokenizer.get_spelling(length) == token_str;
+    return tokens.get_spelling(tokens.get_offset(loc_before), tokens.get_offset(loc), length)
+           == token_str;
 }
 
-bool consume_if_token_before_is(const CXTranslationUnit& tu, const CXFile& file,
-                                CXSourceLocation& loc, const char* token_str)
+bool consume_if_token_before_is(const detail::cxtoken_table& tokens, CXSourceLocation& loc,
+                                const char* token_str)
 {
-    auto length = std::strlen(token_str);
-
-    auto loc_before = get_prev_location(tu, file, loc, length);
-    if (!clang_Location_isFromMainFile(loc_before))
+    if (!token_before_is(tokens, loc, token_str))
         return false;
 
-    simple_tokenizer tokenizer(tu, clang_getRange(loc_before, loc));
-    if (tokenizer.get_spelling(length) == token_str)
+    loc = get_prev_location(tokens, loc, std::strlen(token_str));
+    return true;
+}
+
+// returns the location of the try of a function try block in the range, if there is one
+type_safe::optional<CXSourceLocation> get_function_try(const detail::cxtoken_table& tokens,
+                                                       const CXSourceRange&         range)
+{
+    auto tokens_in_range = tokens.lookup(range);
+    auto bracket_count   = 0;
+    for (auto iter = tokens_in_range.first; iter != tokens_in_range.second; ++iter)
     {
-        loc = loc_before;
-        return true;
+        if (bracket_count == 0 && *iter == "try")
+            return clang_getTokenLocation(tokens.tu(), tokens.raw(iter));
+        else if (bracket_count == 0 && *iter == "{")
+            // function body
+            break;
+        else if (*iter == "(" || *iter == "[" || *iter == "{")
+            ++bracket_count;
+        else if (*iter == ")" || *iter == "]" || *iter == "}")
+            --bracket_count;
     }
-    else
-        return false;
+    return type_safe::nullopt;
 }
 
 struct Extent
@@ -228,7 +157,7 @@ struct Extent
 // this function returns the actual CXSourceRange that covers all parts required for parsing
 // might include more tokens
 // this function is the reason you shouldn't use libclang
-Extent get_extent(const CXTranslationUnit& tu, const CXFile& file, const CXCursor& cur)
+Extent get_extent(const detail::cxtoken_table& tokens, const CXCursor& cur)
 {
     auto extent = clang_getCursorExtent(cur);
     auto begin  = clang_getRangeStart(extent);
@@ -241,33 +170,33 @@ Extent get_extent(const CXTranslationUnit& tu, const CXFile& file, const CXCurso
         || kind == CXCursor_VarDecl || kind == CXCursor_FieldDecl || kind == CXCursor_ParmDecl
         || kind == CXCursor_NonTypeTemplateParameter)
     {
-        while (token_before_is(tu, file, begin, "]]") || token_before_is(tu, file, begin, ")"))
+        while (token_before_is(tokens, begin, "]]") || token_before_is(tokens, begin, ")"))
         {
             auto save_begin = begin;
-            if (consume_if_token_before_is(tu, file, begin, "]]"))
+            if (consume_if_token_before_is(tokens, begin, "]]"))
             {
-                while (!consume_if_token_before_is(tu, file, begin, "[["))
-                    begin = get_prev_location(tu, file, begin, 1);
+                while (!consume_if_token_before_is(tokens, begin, "[["))
+                    begin = get_prev_location(tokens, begin, 1);
             }
-            else if (consume_if_token_before_is(tu, file, begin, ")"))
+            else if (consume_if_token_before_is(tokens, begin, ")"))
             {
                 // maybe alignas specifier
 
                 auto paren_count = 1;
                 for (auto last_begin = begin; paren_count != 0; last_begin = begin)
                 {
-                    if (token_before_is(tu, file, begin, "("))
+                    if (token_before_is(tokens, begin, "("))
                         --paren_count;
-                    else if (token_before_is(tu, file, begin, ")"))
+                    else if (token_before_is(tokens, begin, ")"))
                         ++paren_count;
 
-                    begin = get_prev_location(tu, file, begin, 1);
+                    begin = get_prev_location(tokens, begin, 1);
                     DEBUG_ASSERT(!clang_equalLocations(last_begin, begin),
                                  detail::parse_error_handler{}, cur,
                                  "infinite loop in alignas parsing");
                 }
 
-                if (!consume_if_token_before_is(tu, file, begin, "alignas"))
+                if (!consume_if_token_before_is(tokens, begin, "alignas"))
                 {
                     // not alignas
                     begin = save_begin;
@@ -282,8 +211,8 @@ Extent get_extent(const CXTranslationUnit& tu, const CXFile& file, const CXCurso
         if (clang_CXXMethod_isDefaulted(cur) || !clang_isCursorDefinition(cur))
         {
             // defaulted or declaration: extend until semicolon
-            while (!token_at_is(tu, file, end, ";"))
-                end = get_next_location(tu, file, end, 1);
+            while (!token_at_is(tokens, end, ";"))
+                end = get_next_location(tokens, end, 1);
         }
         else
         {
@@ -301,13 +230,55 @@ Extent get_extent(const CXTranslationUnit& tu, const CXFile& file, const CXCurso
                     has_children      = true;
                 }
             });
+
+            auto function_try
+                = has_children ? type_safe::nullopt
+                               : get_function_try(tokens, clang_getRange(begin, end));
+            if (function_try)
+                // body was skipped, but is part of the extent
+                // it ends with the last handler, so remove everything starting at the try,
+                // like the function try block child would
+                end = function_try.value();
+            else if (!has_children && consume_if_token_before_is(tokens, end, "}"))
+            {
+                // body was skipped, but is part of the extent
+                // remove it by going back to the matching opening brace
+                for (auto brace_count = 1; brace_count != 0;)
+                {
+                    if (token_before_is(tokens, end, "}"))
+                        ++brace_count;
+                    else if (token_before_is(tokens, end, "{"))
+                        --brace_count;
+                    end = get_prev_location(tokens, end, 1);
+                }
+            }
+            else if (!has_children)
+            {
+                // body was skipped or function is deleted, the extent ends at the declarator
+                // extend until the body to get the virtual specifiers
+                // (this includes a function try block or member initializers)
+                auto body          = end;
+                auto bracket_count = 0;
+                while (bracket_count != 0
+                       || (!token_at_is(tokens, body, "{") && !token_at_is(tokens, body, ";")))
+                {
+                    if (token_at_is(tokens, body, "(") || token_at_is(tokens, body, "["))
+                        ++bracket_count;
+                    else if (token_at_is(tokens, body, ")") || token_at_is(tokens, body, "]"))
+                        --bracket_count;
+                    body = get_next_location(tokens, body, 1);
+                }
+
+                if (token_at_is(tokens, body, "{"))
+                    end = body;
+            }
         }
     }
     else if (cursor_is_var(kind) || cursor_is_var(clang_getTemplateCursorKind(cur)))
     {
         // need to extend until the semicolon
-        while (!token_at_is(tu, file, end, ";"))
-            end = get_next_location(tu, file, end, 1);
+        while (!token_at_is(tokens, end, ";"))
+            end = get_next_location(tokens, end, 1);
 
         if (has_inline_type_definition(cur))
         {
@@ -322,59 +293,59 @@ Extent get_extent(const CXTranslationUnit& tu, const CXFile& file, const CXCurso
             return {clang_getRange(begin, type_begin), clang_getRange(type_end, end)};
         }
     }
-    else if (kind == CXCursor_TemplateTypeParameter && token_at_is(tu, file, end, "("))
+    else if (kind == CXCursor_TemplateTypeParameter && token_at_is(tokens, end, "("))
     {
         // if you have decltype as default argument for a type template parameter
         // libclang doesn't include the parameters
-        auto next = get_next_location(tu, file, end, 1);
+        auto next = get_next_location(tokens, end, 1);
         auto prev = end;
-        for (auto paren_count = 1; paren_count != 0; next = get_next_location(tu, file, next, 1))
+        for (auto paren_count = 1; paren_count != 0; next = get_next_location(tokens, next, 1))
         {
-            if (token_at_is(tu, file, next, "("))
+            if (token_at_is(tokens, next, "("))
                 ++paren_count;
-            else if (token_at_is(tu, file, next, ")"))
+            else if (token_at_is(tokens, next, ")"))
                 --paren_count;
             prev = next;
         }
         end = next;
     }
-    else if (kind == CXCursor_TemplateTemplateParameter && token_at_is(tu, file, end, "<"))
+    else if (kind == CXCursor_TemplateTemplateParameter && token_at_is(tokens, end, "<"))
     {
         // if you have a template template parameter in a template template parameter,
         // the tokens are all messed up, only contain the `template`
 
         // first: skip to closing angle bracket
         // luckily no need to handle expressions here
-        auto next = get_next_location(tu, file, end, 1);
-        for (auto angle_count = 1; angle_count != 0; next = get_next_location(tu, file, next, 1))
+        auto next = get_next_location(tokens, end, 1);
+        for (auto angle_count = 1; angle_count != 0; next = get_next_location(tokens, next, 1))
         {
-            if (token_at_is(tu, file, next, ">"))
+            if (token_at_is(tokens, next, ">"))
                 --angle_count;
-            else if (token_at_is(tu, file, next, ">>"))
+            else if (token_at_is(tokens, next, ">>"))
                 angle_count -= 2;
-            else if (token_at_is(tu, file, next, "<"))
+            else if (token_at_is(tokens, next, "<"))
                 ++angle_count;
         }
 
         // second: skip until end of parameter
         // no need to handle default, so look for '>' or ','
-        while (!token_at_is(tu, file, next, ">") && !token_at_is(tu, file, next, ","))
-            next = get_next_location(tu, file, next, 1);
+        while (!token_at_is(tokens, next, ">") && !token_at_is(tokens, next, ","))
+            next = get_next_location(tokens, next, 1);
         // now we found the proper end of the token
-        end = get_prev_location(tu, file, next, 1);
+        end = get_prev_location(tokens, next, 1);
     }
     else if ((kind == CXCursor_TemplateTypeParameter || kind == CXCursor_NonTypeTemplateParameter
               || kind == CXCursor_TemplateTemplateParameter))
     {
         // variadic tokens in unnamed parameter not included
-        consume_if_token_at_is(tu, file, end, "...");
+        consume_if_token_at_is(tokens, end, "...");
     }
-    else if (kind == CXCursor_EnumDecl && !token_at_is(tu, file, end, ";"))
+    else if (kind == CXCursor_EnumDecl && !token_at_is(tokens, end, ";"))
     {
-        while (!token_at_is(tu, file, end, ";"))
-            end = get_next_location(tu, file, end, 1);
+        while (!token_at_is(tokens, end, ";"))
+            end = get_next_location(tokens, end, 1);
     }
-    else if (kind == CXCursor_EnumConstantDecl && !token_at_is(tu, file, end, ","))
+    else if (kind == CXCursor_EnumConstantDecl && !token_at_is(tokens, end, ","))
     {
         // need to support attributes
         // just give up and extend the range to the range of the entire enum...
@@ -384,30 +355,133 @@ Extent get_extent(const CXTranslationUnit& tu, const CXFile& file, const CXCurso
     else if (kind == CXCursor_UnexposedDecl)
     {
         // include semicolon, if necessary
-        if (token_at_is(tu, file, end, ";"))
-            end = get_next_location(tu, file, end, 1);
+        if (token_at_is(tokens, end, ";"))
+            end = get_next_location(tokens, end, 1);
     }
 
     return Extent{clang_getRange(begin, end), clang_getNullRange()};
 }
 } // namespace
 
-detail::cxtokenizer::cxtokenizer(const CXTranslationUnit& tu, const CXFile& file,
-                                 const CXCursor& cur)
+detail::cxtoken_table::cxtoken_table(const CXTranslationUnit& tu, const CXFile& file)
+: tu_(tu), file_(file), raw_tokens_(nullptr), no_raw_tokens_(0u)
+{
+    // the extent of the translation unit is the entire main file
+    auto extent = clang_getCursorExtent(clang_getTranslationUnitCursor(tu));
+    clang_tokenize(tu, extent, &raw_tokens_, &no_raw_tokens_);
+
+    tokens_.reserve(no_raw_tokens_);
+    begin_offsets_.reserve(no_raw_tokens_);
+    end_offsets_.reserve(no_raw_tokens_);
+    for (auto i = 0u; i != no_raw_tokens_; ++i)
+    {
+        tokens_.emplace_back(tu, raw_tokens_[i]);
+
+        auto token_extent = clang_getTokenExtent(tu, raw_tokens_[i]);
+        begin_offsets_.push_back(get_offset(clang_getRangeStart(token_extent)));
+        end_offsets_.push_back(get_offset(clang_getRangeEnd(token_extent)));
+    }
+}
+
+detail::cxtoken_table::~cxtoken_table() noexcept
 {
-    auto extent = get_extent(tu, file, cur);
+    clang_disposeTokens(tu_, raw_tokens_, no_raw_tokens_);
+}
 
-    simple_tokenizer tokenizer(tu, extent.first_part);
-    tokens_.reserve(tokenizer.size());
-    for (auto i = 0u; i != tokenizer.size(); ++i)
-        tokens_.emplace_back(tu, tokenizer[i]);
+unsigned detail::cxtoken_table::get_offset(const CXSourceLocation& loc) const noexcept
+{
+    unsigned offset;
+    clang_getSpellingLocation(loc, nullptr, nullptr, nullptr, &offset);
+    return offset;
+}
 
-    if (!clang_Range_isNull(extent.second_part))
+CXSourceLocation detail::cxtoken_table::get_location(unsigned offset) const noexcept
+{
+    return clang_getLocationForOffset(tu_, file_, offset);
+}
+
+type_safe::optional<unsigned> detail::cxtoken_table::get_prev_token_end(
+    unsigned offset) const noexcept
+{
+    // last token starting before the offset
+    auto iter = std::lower_bound(begin_offsets_.begin(), begin_offsets_.end(), offset);
+    if (iter == begin_offsets_.begin())
+        return type_safe::nullopt;
+    auto index = std::size_t(iter - begin_offsets_.begin()) - 1u;
+    // if the offset is inside the token, it ends there
+    return std::min(offset, end_offsets_[index]);
+}
+
+std::string detail::cxtoken_table::get_spelling(unsigned begin, unsigned end,
+                                                std::size_t length) const
+{
+    // clang_tokenize() lexes the first token starting at begin,
+    // if begin is inside a token, the lexer only sees the rest of it
+    // it then continues as long as the previous token ended before end
+    // might need multiple tokens, because [[, for example, is treated as two separate tokens
+    std::string result;
+    for (auto iter = std::upper_bound(end_offsets_.begin(), end_offsets_.end(), begin);
+         iter != end_offsets_.end(); ++iter)
+    {
+        auto  index    = std::size_t(iter - end_offsets_.begin());
+        auto& spelling = tokens_[index].value();
+        if (begin_offsets_[index] < begin)
+            result.append(spelling.c_str() + (begin - begin_offsets_[index]));
+        else
+            result.append(spelling.c_str());
+
+        if (result.length() >= length || *iter >= end)
+            break;
+    }
+    return result;
+}
+
+std::pair<detail::cxtoken_iterator, detail::cxtoken_iterator> detail::cxtoken_table::lookup(
+    const CXSourceRange& range) const
+{
+    auto begin_offset = get_offset(clang_getRangeStart(range));
+    auto end_offset   = get_offset(clang_getRangeEnd(range));
+
+    // clang_tokenize() starts lexing at the beginning of the range,
+    // and continues as long as the previous token ended before the end of the range
+    auto first = std::size_t(
+        std::lower_bound(begin_offsets_.begin(), begin_offsets_.end(), begin_offset)
+        - begin_offsets_.begin());
+    if (first == tokens_.size())
+        return std::make_pair(tokens_.end(), tokens_.end());
+
+    auto last = std::size_t(
+                    std::lower_bound(end_offsets_.begin() + std::ptrdiff_t(first),
+                                     end_offsets_.end(), end_offset)
+                    - end_offsets_.begin())
+                + 1u;
+    last = std::min(last, tokens_.size());
+    return std::make_pair(tokens_.begin() + std::ptrdiff_t(first),
+                          tokens_.begin() + std::ptrdiff_t(last));
+}
+
+detail::cxtokenizer::cxtokenizer(const cxtoken_table& table, const CXCursor& cur)
+{
+    auto extent = get_extent(table, cur);
+
+    auto first = table.lookup(extent.first_part);
+    if (clang_Range_isNull(extent.second_part))
     {
-        simple_tokenizer second_tokenizer(tu, extent.second_part);
-        tokens_.reserve(tokens_.size() + second_tokenizer.size());
-        for (auto i = 0u; i != second_tokenizer.size(); ++i)
-            tokens_.emplace_back(tu, second_tokenizer[i]);
+        begin_ = first.first;
+        end_   = first.second;
+    }
+    else
+    {
+        // the tokens have a gap, so need a copy
+        auto second = table.lookup(extent.second_part);
+        tokens_.reserve(std::size_t((first.second - first.first) + (second.second - second.first)));
+        for (auto iter = first.first; iter != first.second; ++iter)
+            tokens_.emplace_back(table.tu(), table.raw(iter));
+        for (auto iter = second.first; iter != second.second; ++iter)
+            tokens_.emplace_back(table.tu(), table.raw(iter));
+
+        begin_ = tokens_.begin();
+        end_   = tokens_.end();
     }
 }
 
@@ -795,6 +869,15 @@ cpp_token_string detail::to_string(cxtoken_stream& stream, cxtoken_iterator end,
     return builder.finish();
 }
 
+void detail::append_to(cpp_token_buffer& buffer, cxtoken_stream& stream, cxtoken_iterator end)
+{
+    while (stream.cur() != end)
+    {
+        auto& token = stream.get();
+        buffer.add_token(get_kind(token), token.c_str(), token.value().length());
+    }
+}
+
 bool detail::append_scope(detail::cxtoken_stream& stream, std::string& scope)
 {
     // add identifiers and "::" to current scope name,
@@ -5,8 +5,11 @@
 #define CPPAST_CXTOKENIZER_HPP_INCLUDED
 
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <type_safe/optional.hpp>
+
 #include <cppast/cpp_attribute.hpp>
 #include <cppast/cpp_token.hpp>
 
@@ -63,23 +66,80 @@ namespace detail
 
     using cxtoken_iterator = std::vector<cxtoken>::const_iterator;
 
+    // all tokens of the main file, sorted by offset
+    // the file is tokenized once, entities then look up their tokens
+    class cxtoken_table
+    {
+    public:
+        explicit cxtoken_table(const CXTranslationUnit& tu, const CXFile& file);
+
+        cxtoken_table(const cxtoken_table&)            = delete;
+        cxtoken_table& operator=(const cxtoken_table&) = delete;
+
+        ~cxtoken_table() noexcept;
+
+        const CXTranslationUnit& tu() const noexcept
+        {
+            return tu_;
+        }
+
+        const CXFile& file() const noexcept
+        {
+            return file_;
+        }
+
+        // returns the tokens clang_tokenize() would return for the range
+        std::pair<cxtoken_iterator, cxtoken_iterator> lookup(const CXSourceRange& range) const;
+
+        // returns the spelling of the tokens clang_tokenize() would return for [begin, end),
+        // concatenated until it has at least length characters
+        std::string get_spelling(unsigned begin, unsigned end, std::size_t length) const;
+
+        // returns the end of the last token starting before the offset,
+        // or the offset itself if it is inside that token
+        type_safe::optional<unsigned> get_prev_token_end(unsigned offset) const noexcept;
+
+        unsigned get_offset(const CXSourceLocation& loc) const noexcept;
+
+        CXSourceLocation get_location(unsigned offset) const noexcept;
+
+        // returns the libclang token of the given token
+        const CXToken& raw(cxtoken_iterator iter) const noexcept
+        {
+            return raw_tokens_[iter - tokens_.begin()];
+        }
+
+    private:
+        CXTranslationUnit     tu_;
+        CXFile                file_;
+        CXToken*              raw_tokens_;
+        unsigned              no_raw_tokens_;
+        std::vector<cxtoken>  tokens_;
+        std::vector<unsigned> begin_offsets_, end_offsets_;
+    };
+
     class cxtokenizer
     {
     public:
-        explicit cxtokenizer(const CXTranslationUnit& tu, const CXFile& file, const CXCursor& cur);
+        explicit cxtokenizer(const cxtoken_table& table, const CXCursor& cur);
+
+        cxtokenizer(const cxtokenizer&)            = delete;
+        cxtokenizer& operator=(const cxtokenizer&) = delete;
 
         cxtoken_iterator begin() const noexcept
         {
-            return tokens_.begin();
+            return begin_;
         }
 
         cxtoken_iterator end() const noexcept
         {
-            return tokens_.end();
+            return end_;
         }
 
     private:
+        // only used if the tokens aren't contiguous in the table
         std::vector<cxtoken> tokens_;
+        cxtoken_iterator     begin_, end_;
     };
 
     class cxtoken_stream
@@ -189,6 +249,9 @@ namespace detail
     // converts a token range to a string
     cpp_token_string to_string(cxtoken_stream& stream, cxtoken_iterator end, bool unmunch);
 
+    // appends a token range to the buffer
+    void append_to(cpp_token_buffer& buffer, cxtoken_stream& stream, cxtoken_iterator end);
+
     // appends token to scope, if it is still valid
     // else clears it
     // note: does not consume the token if it is not valid,
@@ -49,7 +49,8 @@ void detail::print_tokens(const CXTranslationUnit& tu, const CXFile& file,
                           const CXCursor& cur) noexcept
 {
     std::lock_guard<std::mutex> lock(mtx);
-    detail::cxtokenizer         tokenizer(tu, file, cur);
+    detail::cxtoken_table       tokens(tu, file);
+    detail::cxtokenizer         tokenizer(tokens, cur);
     for (auto& token : tokenizer)
         std::fprintf(stderr, "%s ", token.c_str());
     std::fputs("\n", stderr);
@@ -19,7 +19,7 @@ std::unique_ptr<cpp_enum_value> parse_enum_value(const detail::parse_context& co
     DEBUG_ASSERT(cur.kind == CXCursor_EnumConstantDecl, detail::parse_error_handler{}, cur,
                  "unexpected child cursor of enum");
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     // <identifier> [<attribute>],
@@ -48,7 +48,7 @@ cpp_enum::builder make_enum_builder(const detail::parse_context& context, const
                                     type_safe::optional<cpp_entity_ref>& semantic_parent)
 {
     auto                   name = detail::get_cursor_name(cur);
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     // enum [class/struct] [<attribute>] name [: type] {
@@ -7,18 +7,37 @@
 
 using namespace cppast;
 
+namespace
+{
+std::unique_ptr<cpp_expression> build_unexposed(const detail::parse_context& context,
+                                                detail::cxtoken_stream&      stream,
+                                                detail::cxtoken_iterator     end,
+                                                std::unique_ptr<cpp_type>    type)
+{
+    if (!context.expressions)
+        return cpp_unexposed_expression::build(std::move(type),
+                                               detail::to_string(stream, end, false));
+
+    // only store the tokens, the string is created on first access
+    auto begin = context.expressions->size();
+    detail::append_to(*context.expressions, stream, end);
+    return cpp_unexposed_expression::build(std::move(type), context.expressions, begin,
+                                           context.expressions->size());
+}
+} // namespace
+
 std::unique_ptr<cpp_expression> detail::parse_expression(const detail::parse_context& context,
                                                          const CXCursor&              cur)
 {
     auto kind = clang_getCursorKind(cur);
     DEBUG_ASSERT(clang_isExpression(kind), detail::assert_handler{});
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     auto type = parse_type(context, cur, clang_getCursorType(cur));
-    auto expr = to_string(stream, stream.end(), false);
-    if (kind == CXCursor_CallExpr && (expr.empty() || expr.back().spelling != ")"))
+    if (kind == CXCursor_CallExpr
+        && (stream.cur() == stream.end() || std::prev(stream.end())->value() != ")"))
     {
         // we have a call expression that doesn't end in a closing parentheses
         // this means default constructor, don't parse it at all
@@ -29,12 +48,13 @@ std::unique_ptr<cpp_expression> detail::parse_expression(const detail::parse_con
              || kind == CXCursor_FloatingLiteral || kind == CXCursor_ImaginaryLiteral
              || kind == CXCursor_IntegerLiteral || kind == CXCursor_StringLiteral
              || kind == CXCursor_CXXBoolLiteralExpr || kind == CXCursor_CXXNullPtrLiteralExpr)
-        return cpp_literal_expression::build(std::move(type), expr.as_string());
+        return cpp_literal_expression::build(std::move(type),
+                                             to_string(stream, stream.end(), false).as_string());
     else
-        return cpp_unexposed_expression::build(std::move(type), std::move(expr));
+        return build_unexposed(context, stream, stream.end(), std::move(type));
 }
 
-std::unique_ptr<cpp_expression> detail::parse_raw_expression(const parse_context&,
+std::unique_ptr<cpp_expression> detail::parse_raw_expression(const parse_context&      context,
                                                              cxtoken_stream&           stream,
                                                              cxtoken_iterator          end,
                                                              std::unique_ptr<cpp_type> type)
@@ -42,6 +62,6 @@ std::unique_ptr<cpp_expression> detail::parse_raw_expression(const parse_context
     if (stream.done())
         return nullptr;
 
-    auto expr = to_string(stream, std::prev(end)->value() == ";" ? std::prev(end) : end, false);
-    return cpp_unexposed_expression::build(std::move(type), std::move(expr));
+    return build_unexposed(context, stream, std::prev(end)->value() == ";" ? std::prev(end) : end,
+                           std::move(type));
 }
@@ -0,0 +1,288 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#include "file_metadata.hpp"
+
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+using namespace cppast;
+namespace ts = type_safe;
+
+namespace
+{
+//=== include guard ===//
+// the source is null-terminated, so *ptr is always valid until ptr is past the terminator
+
+void bump_until(const char*& ptr, const char* str)
+{
+    auto len = std::strlen(str);
+    while (*ptr && std::strncmp(ptr, str, len) != 0)
+        ++ptr;
+    if (*ptr)
+        ptr += len;
+}
+
+template <typename Iter>
+void skip_whitespace(Iter& begin, Iter end)
+{
+    while (begin != end && (*begin == ' ' || *begin == '\t' || *begin == '\r'))
+        ++begin;
+}
+
+std::string get_line(const char*& ptr)
+{
+    auto begin = ptr;
+    while (*ptr && *ptr != '\n')
+        ++ptr;
+    std::string line(begin, ptr);
+    if (*ptr)
+        ++ptr; // newline
+    return line;
+}
+
+bool is_identifier_char(char c)
+{
+    return c == '_' || std::isalnum(static_cast<unsigned char>(c));
+}
+
+// whether the line is a #pragma once directive
+bool is_pragma_once(const char* begin, const char* end)
+{
+    auto match = [&](const char* str) {
+        auto len = std::strlen(str);
+        if (std::size_t(end - begin) < len || std::strncmp(begin, str, len) != 0)
+            return false;
+        begin += len;
+        return true;
+    };
+
+    skip_whitespace(begin, end);
+    if (!match("#"))
+        return false;
+    skip_whitespace(begin, end);
+    if (!match("pragma") || begin == end || is_identifier_char(*begin))
+        return false;
+    skip_whitespace(begin, end);
+    if (!match("once"))
+        return false;
+    skip_whitespace(begin, end);
+    return begin == end;
+}
+
+bool has_pragma_once(const std::string& source)
+{
+    for (auto ptr = source.c_str(); *ptr;)
+    {
+        auto end = std::strchr(ptr, '\n');
+        if (!end)
+            end = ptr + std::strlen(ptr);
+
+        if (is_pragma_once(ptr, end))
+            return true;
+
+        ptr = *end ? end + 1 : end;
+    }
+    return false;
+}
+
+//=== metadata ===//
+// timestamps of some file systems have a granularity of two seconds
+const long long mtime_granularity = 2 * 1000 * 1000 * 1000ll;
+
+bool get_file_info(const std::string& path, detail::file_metadata& result)
+{
+#ifdef _WIN32
+    struct _stat info;
+    if (_stat(path.c_str(), &info) != 0 || (info.st_mode & _S_IFREG) == 0)
+        return false;
+    auto mtime_nsec = 0ll;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+        return false;
+#    ifdef __APPLE__
+    auto mtime_nsec = static_cast<long long>(info.st_mtimespec.tv_nsec);
+#    else
+    auto mtime_nsec = static_cast<long long>(info.st_mtim.tv_nsec);
+#    endif
+#endif
+    result.size  = static_cast<unsigned long long>(info.st_size);
+    result.inode = static_cast<unsigned long long>(info.st_ino);
+    result.mtime = static_cast<long long>(info.st_mtime) * 1000 * 1000 * 1000ll + mtime_nsec;
+    return true;
+}
+
+long long get_current_time()
+{
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch());
+    return static_cast<long long>(now.count());
+}
+
+std::shared_ptr<const detail::file_metadata> compute_metadata(const std::string& path)
+{
+    auto result = std::make_shared<detail::file_metadata>();
+    if (!get_file_info(path, *result))
+        return result;
+
+    std::ifstream file(path, std::ios_base::binary);
+    if (!file)
+        return result;
+    std::string content(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>{});
+
+    result->exists = true;
+    // a later change might not change the modification time
+    result->racy = get_current_time() < result->mtime + mtime_granularity;
+    // the size of the content, the file could have been changed in the mean time
+    result->size          = content.size();
+    result->include_guard = detail::get_include_guard_macro(content);
+    result->pragma_once   = has_pragma_once(content);
+
+    result->hash = detail::fnv_basis;
+    for (auto c : content)
+        result->hash = (result->hash ^ static_cast<unsigned char>(c)) * detail::fnv_prime;
+
+    return result;
+}
+
+class metadata_cache
+{
+public:
+    static metadata_cache& get()
+    {
+        static metadata_cache cache;
+        return cache;
+    }
+
+    std::shared_ptr<const detail::file_metadata> lookup(const std::string& path, bool revalidate)
+    {
+        auto cached = find(path);
+        if (cached && !revalidate)
+            return cached;
+        else if (cached && !cached->racy)
+        {
+            detail::file_metadata info;
+            auto                  exists = get_file_info(path, info);
+            if (exists == cached->exists
+                && (!exists
+                    || (info.size == cached->size && info.inode == cached->inode
+                        && info.mtime == cached->mtime)))
+                return cached;
+        }
+
+        // compute without holding the lock, the file is read in the mean time
+        auto result = compute_metadata(path);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_[path] = result;
+        return result;
+    }
+
+private:
+    metadata_cache() = default;
+
+    std::shared_ptr<const detail::file_metadata> find(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto                        iter = entries_.find(path);
+        return iter == entries_.end() ? nullptr : iter->second;
+    }
+
+    std::mutex                                                                    mutex_;
+    std::unordered_map<std::string, std::shared_ptr<const detail::file_metadata>> entries_;
+};
+} // namespace
+
+std::shared_ptr<const detail::file_metadata> detail::get_file_metadata(const std::string& path,
+                                                                       bool revalidate)
+{
+    return metadata_cache::get().lookup(path, revalidate);
+}
+
+std::string detail::get_canonical_path(const std::string& path)
+{
+#ifdef _WIN32
+    auto full_path = _fullpath(nullptr, path.c_str(), 0);
+#else
+    auto full_path = realpath(path.c_str(), nullptr);
+#endif
+    if (!full_path)
+        return "";
+
+    std::string result(full_path);
+    std::free(full_path);
+    return result;
+}
+
+ts::optional<std::string> detail::get_include_guard_macro(const std::string& source)
+{
+    auto ptr = source.c_str();
+    while (*ptr)
+    {
+        if (*ptr == '/')
+        {
+            ++ptr;
+            if (*ptr == '/')
+                // C++ style comment, bump until \n
+                bump_until(ptr, "\n");
+            else if (*ptr == '*')
+                // C style comment
+                bump_until(ptr, "*/");
+            else
+                break;
+        }
+        else if (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n')
+            ++ptr; // empty
+        else if (*ptr == '#')
+        {
+            // preprocessor line
+            auto if_line = get_line(ptr);
+            if (if_line.compare(0, 3, "#if") != 0)
+                // not something starting with #if
+                break;
+
+            skip_whitespace(ptr, source.c_str() + source.size());
+
+            auto macro_line = get_line(ptr);
+            if (macro_line.compare(0, 7, "#define") != 0)
+                // not a corresponding define
+                break;
+
+            auto macro_name_begin = std::next(macro_line.begin(), 7);
+            // skip whitespace after define
+            skip_whitespace(macro_name_begin, macro_line.end());
+
+            auto macro_name_end = macro_name_begin;
+            // skip over identifier
+            while (macro_name_end != macro_line.end() && is_identifier_char(*macro_name_end))
+                ++macro_name_end;
+
+            auto trailing_ws = macro_line.rbegin();
+            skip_whitespace(trailing_ws, macro_line.rend());
+            if (macro_name_end != trailing_ws.base())
+                // anything else after macro
+                break;
+
+            std::string macro_name(macro_name_begin, macro_name_end);
+            if (macro_name.empty() || if_line.find(macro_name) == std::string::npos)
+                // macro name doesn't occur in if line
+                break;
+            else
+                return macro_name;
+        }
+        else
+            // line is neither empty, comment, nor preprocessor
+            break;
+    }
+
+    return ts::nullopt;
+}
@@ -0,0 +1,51 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#ifndef CPPAST_FILE_METADATA_HPP_INCLUDED
+#define CPPAST_FILE_METADATA_HPP_INCLUDED
+
+#include <memory>
+#include <string>
+
+#include <type_safe/optional.hpp>
+
+#include <cppast/cpp_entity_index.hpp>
+
+namespace cppast
+{
+namespace detail
+{
+    // information about a file that is needed repeatedly while preprocessing,
+    // as headers are included by many files
+    struct file_metadata
+    {
+        bool                             exists      = false;
+        bool                             racy        = false; // modified shortly before it was read
+        bool                             pragma_once = false; // contains #pragma once
+        unsigned long long               size        = 0u;
+        unsigned long long               inode       = 0u;
+        long long                        mtime       = 0; // in nanoseconds
+        type_safe::optional<std::string> include_guard; // macro of the include guard, if any
+        hash_type                        hash = 0u;     // FNV-1a hash of the content
+    };
+
+    // returns the metadata of the file
+    // the results are cached for the lifetime of the process, identified by the path as given,
+    // if revalidate is true, an entry is recomputed when the modification time, inode or size
+    // changed, or when the file was racy, as a change within the timestamp granularity
+    // doesn't change the modification time,
+    // otherwise the file is only accessed the first time
+    // notes: thread-safe
+    std::shared_ptr<const file_metadata> get_file_metadata(const std::string& path,
+                                                           bool               revalidate);
+
+    // returns the absolute path of the file with all symbolic links resolved,
+    // or an empty string if it doesn't exist
+    std::string get_canonical_path(const std::string& path);
+
+    // returns the macro of the include guard of the source, if it has one
+    type_safe::optional<std::string> get_include_guard_macro(const std::string& source);
+} // namespace detail
+} // namespace cppast
+
+#endif // CPPAST_FILE_METADATA_HPP_INCLUDED
@@ -458,7 +458,7 @@ std::unique_ptr<cpp_entity> parse_cpp_function_impl(const detail::parse_context&
 {
     auto name = detail::get_cursor_name(cur);
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     auto prefix = parse_prefix_info(stream, name.c_str(), false);
@@ -676,7 +676,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_member_function(const detail::pars
                  detail::assert_handler{});
     auto name = detail::get_cursor_name(cur);
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     auto prefix = parse_prefix_info(stream, name.c_str(), false);
@@ -709,7 +709,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_conversion_op(const detail::parse_
                      || clang_getTemplateCursorKind(cur) == CXCursor_ConversionFunction,
                  detail::assert_handler{});
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     auto prefix = parse_prefix_info(stream, "operator", false);
@@ -778,7 +778,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_constructor(const detail::parse_co
     if (pos != std::string::npos)
         name.erase(pos);
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     auto prefix = parse_prefix_info(stream, name.c_str(), true);
@@ -819,7 +819,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_destructor(const detail::parse_con
 {
     DEBUG_ASSERT(clang_getCursorKind(cur) == CXCursor_Destructor, detail::assert_handler{});
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     auto prefix_info = parse_prefix_info(stream, "~", true);
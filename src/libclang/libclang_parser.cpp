@@ -3,14 +3,23 @@
 
 #include <cppast/libclang_parser.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <exception>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <clang-c/CXCompilationDatabase.h>
-#include <process.hpp>
 
+#include "clang_probe.hpp"
 #include "cxtokenizer.hpp"
+#include "file_metadata.hpp"
 #include "libclang_visitor.hpp"
 #include "parse_error.hpp"
 #include "parse_functions.hpp"
@@ -18,7 +27,6 @@
 #include "raii_wrapper.hpp"
 
 using namespace cppast;
-namespace tpl = TinyProcessLib;
 
 const std::string& detail::libclang_compile_config_access::clang_binary(
     const libclang_compile_config& config)
@@ -50,6 +58,60 @@ bool detail::libclang_compile_config_access::remove_comments_in_macro(
     return config.remove_comments_in_macro_;
 }
 
+bool detail::libclang_compile_config_access::in_process_preprocessing(
+    const libclang_compile_config& config)
+{
+    return config.in_process_preprocessing_;
+}
+
+std::size_t detail::libclang_compile_config_access::preprocessor_workers(
+    const libclang_compile_config& config)
+{
+    return config.preprocessor_workers_;
+}
+
+const std::string& detail::libclang_compile_config_access::preprocessor_cache_directory(
+    const libclang_compile_config& config)
+{
+    return config.preprocessor_cache_directory_;
+}
+
+std::size_t detail::libclang_compile_config_access::preprocessor_cache_size(
+    const libclang_compile_config& config)
+{
+    return config.preprocessor_cache_size_;
+}
+
+bool detail::libclang_compile_config_access::revalidate_file_metadata(
+    const libclang_compile_config& config)
+{
+    return config.revalidate_file_metadata_;
+}
+
+bool detail::libclang_compile_config_access::precompiled_preamble(
+    const libclang_compile_config& config)
+{
+    return config.precompiled_preamble_;
+}
+
+bool detail::libclang_compile_config_access::skip_function_bodies(
+    const libclang_compile_config& config)
+{
+    return config.skip_function_bodies_;
+}
+
+bool detail::libclang_compile_config_access::lazy_expressions(
+    const libclang_compile_config& config)
+{
+    return config.lazy_expressions_;
+}
+
+const libclang_parse_filter& detail::libclang_compile_config_access::parse_filter(
+    const libclang_compile_config& config)
+{
+    return config.parse_filter_;
+}
+
 libclang_compilation_database::libclang_compilation_database(const std::string& build_directory)
 {
     static_assert(std::is_same<database, CXCompilationDatabase>::value, "forgot to update type");
@@ -81,8 +143,10 @@ namespace
 libclang_compile_config::libclang_compile_config() : libclang_compile_config(CPPAST_CLANG_BINARY) {}
 
 libclang_compile_config::libclang_compile_config(std::string clang_binary)
-: compile_config({}), write_preprocessed_(false), fast_preprocessing_(false),
-  remove_comments_in_macro_(false), use_c_(false)
+: compile_config({}), preprocessor_cache_size_(0u), preprocessor_workers_(0u),
+  write_preprocessed_(false), fast_preprocessing_(false), remove_comments_in_macro_(false),
+  in_process_preprocessing_(false), revalidate_file_metadata_(true), precompiled_preamble_(false),
+  skip_function_bodies_(false), lazy_expressions_(false), use_c_(false)
 {
     // set given clang binary
     set_clang_binary(clang_binary);
@@ -271,76 +335,22 @@ cppast::libclang_compile_config::libclang_compile_config(
 
 namespace
 {
-bool is_valid_binary(const std::string& binary)
+void add_default_include_dirs(libclang_compile_config& config)
 {
-    tpl::Process process(
-        binary + " -v", "", [](const char*, std::size_t) {}, [](const char*, std::size_t) {});
-    return process.get_exit_status() == 0;
+    auto& binary = detail::libclang_compile_config_access::clang_binary(config);
+    for (auto& dir : detail::get_default_include_dirs(binary, config.use_c()))
+        config.add_include_dir(dir);
 }
+} // namespace
 
-#if (defined(WIN32) || defined(_WIN32) || defined(__WIN32)) && !defined(__CYGWIN__)
-#    define CPPAST_DETAIL_WINDOWS 1
-#else
-#    define CPPAST_DETAIL_WINDOWS 0
-#endif
-
-void add_default_include_dirs(libclang_compile_config& config)
+void libclang_compile_config::clang_probe_cache(std::string file)
 {
-    std::string  verbose_output;
-    std::string  language = config.use_c() ? "-xc" : "-xc++";
-    tpl::Process process(
-        detail::libclang_compile_config_access::clang_binary(config) + " " + language + " -v -", "",
-        [](const char*, std::size_t) {},
-        [&](const char* str, std::size_t n) { verbose_output.append(str, n); }, true);
-    process.write("", 1);
-    process.close_stdin();
-    process.get_exit_status();
-
-    auto pos = verbose_output.find("#include <...>");
-    DEBUG_ASSERT(pos != std::string::npos, detail::assert_handler{});
-    while (verbose_output[pos] != '\n')
-        ++pos;
-    ++pos;
-
-    // now every line is an include path, starting with a space
-    while (verbose_output[pos] == ' ')
-    {
-        auto start = pos + 1;
-        while (verbose_output[pos] != '\r' && verbose_output[pos] != '\n')
-            ++pos;
-        auto end = pos;
-        ++pos;
-
-        auto        line = verbose_output.substr(start, end - start);
-        std::string path;
-        for (auto c : line)
-        {
-            if (c == ' ')
-            { // escape spaces
-#if CPPAST_DETAIL_WINDOWS
-                path += "^ ";
-#else
-                path += "\\ ";
-#endif
-            }
-            // clang under MacOS adds comments to paths using '(' at the end, so they have to be
-            // ignored however, Windows uses '(' in paths, so they don't have to be ignored
-#if !CPPAST_DETAIL_WINDOWS
-            else if (c == '(')
-                break;
-#endif
-            else
-                path += c;
-        }
-
-        config.add_include_dir(std::move(path));
-    }
+    detail::set_probe_cache_file(std::move(file));
 }
-} // namespace
 
 bool libclang_compile_config::set_clang_binary(std::string binary)
 {
-    if (is_valid_binary(binary))
+    if (detail::is_valid_binary(binary))
     {
         clang_binary_ = binary;
         add_default_include_dirs(*this);
@@ -355,7 +365,7 @@ bool libclang_compile_config::set_clang_binary(std::string binary)
                "./clang-8",   "clang-8",       "./clang-9",     "clang-9",     "./clang-10",
                "clang-10",    "./clang-11",    "clang-11"};
         for (auto& p : paths)
-            if (is_valid_binary(p))
+            if (detail::is_valid_binary(p))
             {
                 clang_binary_ = p;
                 add_default_include_dirs(*this);
@@ -567,12 +577,122 @@ int cppast::libclang_parser::libclang_minor_version()
     return CINDEX_VERSION_MINOR;
 }
 
+namespace
+{
+// everything a translation unit was parsed with besides the source,
+// a cached unit is only reparsed if they are still the same
+struct unit_options
+{
+    std::vector<std::string> arguments;
+    unsigned                 flags            = 0u; // CXTranslationUnit_Flags
+    bool                     use_c            = false;
+    bool                     in_process       = false;
+    bool                     lazy_expressions = false;
+    const std::type_info*    parse_filter     = nullptr; // target type of the filter, if any
+
+    bool operator==(const unit_options& other) const noexcept
+    {
+        auto same_filter = parse_filter == other.parse_filter
+                           || (parse_filter && other.parse_filter
+                               && *parse_filter == *other.parse_filter);
+        return arguments == other.arguments && flags == other.flags && use_c == other.use_c
+               && in_process == other.in_process && lazy_expressions == other.lazy_expressions
+               && same_filter;
+    }
+
+    bool operator!=(const unit_options& other) const noexcept
+    {
+        return !(*this == other);
+    }
+};
+
+// a translation unit that is kept alive to be reparsed
+// it has its own index, as a pooled index is destroyed if libclang crashes while using it,
+// which must not happen while the unit is alive
+struct cached_unit
+{
+    std::mutex                                       mutex;
+    unit_options                                     options;
+    detail::cxindex                                  index; // destroyed after the unit
+    type_safe::optional<detail::cxtranslation_unit> tu;
+};
+} // namespace
+
 struct libclang_parser::impl
 {
-    detail::cxindex index;
+    // every thread parsing at the same time uses its own index,
+    // so they don't share the state of libclang
+    std::mutex                   indices_mutex;
+    std::vector<detail::cxindex> indices;
+    std::atomic<unsigned>        index_options;
 
-    impl() : index(clang_createIndex(0, 0)) // no diagnostic, other one is irrelevant
-    {}
+    std::mutex                                                    units_mutex;
+    std::unordered_map<std::string, std::shared_ptr<cached_unit>> units;
+
+    // the threads running the asynchronous parses
+    detail::parse_executor async;
+
+    impl() : index_options(CXGlobalOpt_None) {}
+
+    detail::cxindex acquire_index()
+    {
+        detail::cxindex result;
+        {
+            std::lock_guard<std::mutex> lock(indices_mutex);
+            if (!indices.empty())
+            {
+                result = std::move(indices.back());
+                indices.pop_back();
+            }
+        }
+        if (!result)
+            // no diagnostic, other one is irrelevant
+            result = detail::cxindex(clang_createIndex(0, 0));
+
+        clang_CXIndex_setGlobalOptions(result.get(), index_options);
+        return result;
+    }
+
+    void release_index(detail::cxindex index)
+    {
+        std::lock_guard<std::mutex> lock(indices_mutex);
+        indices.push_back(std::move(index));
+    }
+
+    std::shared_ptr<cached_unit> get_unit(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(units_mutex);
+        auto&                       unit = units[path];
+        if (!unit)
+            unit = std::make_shared<cached_unit>();
+        return unit;
+    }
+
+    // returns the index to the pool on destruction
+    class index_lease
+    {
+    public:
+        explicit index_lease(impl& pool) : pool_(pool), index_(pool.acquire_index()) {}
+
+        index_lease(const index_lease&)            = delete;
+        index_lease& operator=(const index_lease&) = delete;
+
+        ~index_lease() noexcept
+        {
+            // the index is empty if libclang crashed
+            if (index_)
+                pool_.release_index(std::move(index_));
+        }
+
+        detail::cxindex& get() noexcept
+        {
+            return index_;
+        }
+
+    private:
+        impl&           pool_;
+        detail::cxindex index_;
+    };
 };
 
 libclang_parser::libclang_parser() : libclang_parser(default_logger()) {}
@@ -581,20 +701,79 @@ libclang_parser::libclang_parser(type_safe::object_ref<const diagnostic_logger>
 : parser(logger), pimpl_(new impl)
 {}
 
-libclang_parser::~libclang_parser() noexcept {}
+libclang_parser::~libclang_parser() noexcept
+{
+    // the asynchronous parses use the parser
+    pimpl_->async.stop();
+}
+
+parse_future libclang_parser::parse_async(const cpp_entity_index& idx, std::string path,
+                                          libclang_compile_config config) const
+{
+    auto         state = std::make_shared<detail::async_parse_state>();
+    parse_future result(state);
+    pimpl_->async.submit(
+        [this, &idx, path, config, state]() mutable {
+            state->run([&] { return parse(idx, std::move(path), config); });
+        },
+        [state] { state->cancel(); });
+    return result;
+}
+
+void libclang_parser::background_priority(bool b) noexcept
+{
+    pimpl_->index_options = b ? CXGlobalOpt_ThreadBackgroundPriorityForAll : CXGlobalOpt_None;
+}
+
+void libclang_parser::release_translation_units() noexcept
+{
+    std::lock_guard<std::mutex> lock(pimpl_->units_mutex);
+    // units currently in use are destroyed once the parse has finished
+    pimpl_->units.clear();
+}
 
 namespace
 {
-std::vector<const char*> get_arguments(const libclang_compile_config& config)
+std::vector<std::string> get_arguments(const libclang_compile_config& config, const char* path)
 {
-    std::vector<const char*> args
+    std::vector<std::string> args
         // TODO: Why?
         = {"-I."}; // enable current directory for include search
     for (auto& flag : detail::libclang_compile_config_access::flags(config))
-        args.push_back(flag.c_str());
+        args.push_back(flag);
+    if (detail::libclang_compile_config_access::in_process_preprocessing(config)
+        && detail::get_file_metadata(
+               path, detail::libclang_compile_config_access::revalidate_file_metadata(config))
+               ->pragma_once)
+        // like an include guard, #pragma once must prevent the file from being included again,
+        // but clang ignores it in the main file unless that is a header
+        args.push_back(config.use_c() ? "-xc-header" : "-xc++-header");
     return args;
 }
 
+unit_options get_unit_options(const libclang_compile_config& config, const char* path)
+{
+    unit_options result;
+    result.arguments = get_arguments(config, path);
+
+    result.flags = CXTranslationUnit_Incomplete | CXTranslationUnit_KeepGoing
+                   | CXTranslationUnit_DetailedPreprocessingRecord;
+    if (detail::libclang_compile_config_access::precompiled_preamble(config))
+        result.flags |= CXTranslationUnit_PrecompiledPreamble
+                        | CXTranslationUnit_CreatePreambleOnFirstParse;
+    if (detail::libclang_compile_config_access::skip_function_bodies(config))
+        result.flags |= CXTranslationUnit_SkipFunctionBodies;
+
+    result.use_c      = config.use_c();
+    result.in_process = detail::libclang_compile_config_access::in_process_preprocessing(config);
+    result.lazy_expressions = detail::libclang_compile_config_access::lazy_expressions(config);
+
+    auto& filter        = detail::libclang_compile_config_access::parse_filter(config);
+    result.parse_filter = filter ? &filter.target_type() : nullptr;
+
+    return result;
+}
+
 type_safe::optional<severity> get_severity(const CXDiagnostic& diag)
 {
     switch (clang_getDiagnosticSeverity(diag))
@@ -637,24 +816,34 @@ void print_diagnostics(const diagnostic_logger& logger, const CXTranslationUnit&
     }
 }
 
-detail::cxtranslation_unit get_cxunit(const diagnostic_logger& logger, const detail::cxindex& idx,
-                                      const libclang_compile_config& config, const char* path,
+// thrown if libclang crashed while parsing the file
+// it has recovered from it, so only the current file is affected
+class crash_error : public detail::parse_error
+{
+public:
+    explicit crash_error(const char* function)
+    : detail::parse_error(source_location(), std::string(function) + ": libclang crashed :(")
+    {}
+};
+
+// if libclang crashes, idx is destroyed as it must not be used anymore
+detail::cxtranslation_unit get_cxunit(const diagnostic_logger& logger, detail::cxindex& idx,
+                                      const unit_options& options, const char* path,
                                       const std::string& source)
 {
     CXUnsavedFile file{path, source.c_str(), static_cast<unsigned long>(source.length())};
 
-    auto args = get_arguments(config);
+    std::vector<const char*> args;
+    for (auto& arg : options.arguments)
+        args.push_back(arg.c_str());
 
     CXTranslationUnit tu;
-    auto              flags = CXTranslationUnit_Incomplete | CXTranslationUnit_KeepGoing
-                 | CXTranslationUnit_DetailedPreprocessingRecord;
-
-    auto error
+    auto              error
         = clang_parseTranslationUnit2(idx.get(), path, // index and path
                                       args.data(),
                                       static_cast<int>(args.size()), // arguments (ptr + size)
                                       &file, 1,                      // unsaved files (ptr + size)
-                                      unsigned(flags), &tu);
+                                      options.flags, &tu);
     if (error != CXError_Success)
     {
         switch (error)
@@ -666,7 +855,11 @@ detail::cxtranslation_unit get_cxunit(const diagnostic_logger& logger, const det
         case CXError_Failure:
             throw libclang_error("clang_parseTranslationUnit: generic error");
         case CXError_Crashed:
-            throw libclang_error("clang_parseTranslationUnit: libclang crashed :(");
+        {
+            detail::cxindex crashed;
+            swap(crashed, idx);
+            throw crash_error("clang_parseTranslationUnit");
+        }
         case CXError_InvalidArguments:
             throw libclang_error("clang_parseTranslationUnit: you shouldn't see this message");
         case CXError_ASTReadError:
@@ -678,6 +871,21 @@ detail::cxtranslation_unit get_cxunit(const diagnostic_logger& logger, const det
     return detail::cxtranslation_unit(tu);
 }
 
+// reparses the unit with the new source, reusing the precompiled preamble
+void reparse_cxunit(const diagnostic_logger& logger, const detail::cxtranslation_unit& tu,
+                    const char* path, const std::string& source)
+{
+    CXUnsavedFile file{path, source.c_str(), static_cast<unsigned long>(source.length())};
+
+    auto error = clang_reparseTranslationUnit(tu.get(), 1, &file,
+                                              clang_defaultReparseOptions(tu.get()));
+    if (error == CXError_Crashed)
+        throw crash_error("clang_reparseTranslationUnit");
+    else if (error != 0)
+        throw libclang_error("clang_reparseTranslationUnit: error " + std::to_string(error));
+    print_diagnostics(logger, tu.get());
+}
+
 unsigned get_line_no(const CXCursor& cursor)
 {
     auto loc = clang_getCursorLocation(cursor);
@@ -686,6 +894,43 @@ unsigned get_line_no(const CXCursor& cursor)
     clang_getPresumedLocation(loc, nullptr, &line, nullptr);
     return line;
 }
+
+void add_include(cpp_file::builder& builder, detail::comment_context& comments,
+                 const detail::pp_include& include)
+{
+    auto& full_path = include.full_path.empty() ? include.file_name : include.full_path;
+
+    // if we got an absolute file path for the current file,
+    // also use an absolute file path for the id
+    // otherwise just use the file name as written in the source file
+    // note: this is a hack around lack of `fs::canonical()`
+    cpp_entity_id id("");
+    if (is_absolute(builder.get().name()))
+        id = cpp_entity_id(full_path.c_str());
+    else
+        id = cpp_entity_id(include.file_name.c_str());
+
+    auto entity = cpp_include_directive::build(cpp_file_ref(id, include.file_name.str()),
+                                               include.kind, full_path.str());
+    comments.match(*entity, include.line,
+                   false); // must not skip comments,
+                           // includes are not reported in order
+    builder.add_child(std::move(entity));
+}
+
+// adds the remaining macros and the comments that haven't been matched
+void add_remaining(cpp_file::builder& builder, const detail::preprocessor_output& preprocessed,
+                   std::vector<detail::pp_macro>::const_iterator macro_iter)
+{
+    for (; macro_iter != preprocessed.macros.end(); ++macro_iter)
+        builder.add_child(macro_iter->build());
+
+    for (auto& cur : preprocessed.comments)
+    {
+        if (!cur.comment.empty())
+            builder.add_unmatched_comment(cpp_doc_comment(cur.comment.str(), cur.line));
+    }
+}
 } // namespace
 std::unique_ptr<cpp_file> libclang_parser::do_parse(const cpp_entity_index& idx, std::string path,
                                                     const compile_config& c) const
@@ -696,7 +941,9 @@ try
     auto& config = static_cast<const libclang_compile_config&>(c);
 
     // preprocess
-    auto preprocessed = detail::preprocess(config, path.c_str(), logger());
+    auto in_process   = detail::libclang_compile_config_access::in_process_preprocessing(config);
+    auto preprocessed = in_process ? detail::read_source(path.c_str())
+                                   : detail::preprocess(config, path.c_str(), logger());
     if (detail::libclang_compile_config_access::write_preprocessed(config))
     {
         std::ofstream file(path + ".pp");
@@ -704,21 +951,76 @@ try
     }
 
     // parse
-    auto tu   = get_cxunit(logger(), pimpl_->index, config, path.c_str(), preprocessed.source);
-    auto file = clang_getFile(tu.get(), path.c_str());
+    type_safe::optional<impl::index_lease> index; // only used if the unit isn't cached
+    std::shared_ptr<cached_unit>           cached;
+    std::unique_lock<std::mutex>           cached_lock;
+    detail::cxtranslation_unit             uncached;
+    auto                                   options = get_unit_options(config, path.c_str());
+    if (detail::libclang_compile_config_access::precompiled_preamble(config))
+    {
+        cached      = pimpl_->get_unit(path);
+        cached_lock = std::unique_lock<std::mutex>(cached->mutex);
+
+        if (cached->tu && cached->options == options)
+        {
+            try
+            {
+                reparse_cxunit(logger(), cached->tu.value(), path.c_str(), preprocessed.source);
+            }
+            catch (...)
+            {
+                // the unit must not be used anymore,
+                // and neither must the index if libclang crashed
+                cached->tu.reset();
+                detail::cxindex crashed;
+                swap(crashed, cached->index);
+                throw;
+            }
+        }
+        else
+        {
+            cached->tu.reset();
+            if (!cached->index)
+                cached->index = detail::cxindex(clang_createIndex(0, 0));
+            clang_CXIndex_setGlobalOptions(cached->index.get(), pimpl_->index_options);
+
+            cached->tu.emplace(get_cxunit(logger(), cached->index, options, path.c_str(),
+                                          preprocessed.source));
+            cached->options = std::move(options);
+        }
+    }
+    else
+    {
+        index.emplace(*pimpl_);
+        uncached = get_cxunit(logger(), index.value().get(), options, path.c_str(),
+                              preprocessed.source);
+    }
+    auto& tu   = cached ? cached->tu.value() : uncached;
+    auto  file = clang_getFile(tu.get(), path.c_str());
+    if (in_process)
+        // get preprocessor information from the translation unit
+        detail::preprocess(preprocessed, tu, file, path.c_str(), logger());
 
     cpp_file::builder builder(detail::cxstring(clang_getFileName(file)).std_str());
-    auto              macro_iter   = preprocessed.macros.begin();
+    auto              macro_iter   = preprocessed.macros.cbegin();
     auto              include_iter = preprocessed.includes.begin();
 
     // convert entity hierarchies
+    detail::cxtoken_table tokens(tu.get(), file);
+    detail::type_cache    types;
     detail::parse_context context{tu.get(),
                                   file,
+                                  tokens,
                                   type_safe::ref(logger()),
                                   type_safe::ref(idx),
                                   detail::comment_context(preprocessed.comments),
+                                  detail::libclang_compile_config_access::parse_filter(config),
+                                  nullptr,
+                                  types,
                                   false};
-    detail::visit_tu(tu, path.c_str(), [&](const CXCursor& cur) {
+    if (detail::libclang_compile_config_access::lazy_expressions(config))
+        context.expressions = std::make_shared<cpp_token_buffer>();
+    detail::visit_tu(tu, file, preprocessed.source, path.c_str(), [&](const CXCursor& cur) {
         if (clang_getCursorKind(cur) == CXCursor_InclusionDirective)
         {
             if (!preprocessed.includes.empty())
@@ -726,29 +1028,7 @@ try
                 DEBUG_ASSERT(include_iter != preprocessed.includes.end()
                                  && get_line_no(cur) >= include_iter->line,
                              detail::assert_handler{});
-
-                auto full_path = include_iter->full_path.empty() ? include_iter->file_name
-                                                                 : include_iter->full_path;
-
-                // if we got an absolute file path for the current file,
-                // also use an absolute file path for the id
-                // otherwise just use the file name as written in the source file
-                // note: this is a hack around lack of `fs::canonical()`
-                cpp_entity_id id("");
-                if (is_absolute(builder.get().name()))
-                    id = cpp_entity_id(full_path.c_str());
-                else
-                    id = cpp_entity_id(include_iter->file_name.c_str());
-
-                auto include
-                    = cpp_include_directive::build(cpp_file_ref(id,
-                                                                std::move(include_iter->file_name)),
-                                                   include_iter->kind, std::move(full_path));
-                context.comments.match(*include, include_iter->line,
-                                       false); // must not skip comments,
-                                               // includes are not reported in order
-                builder.add_child(std::move(include));
-
+                add_include(builder, context.comments, *include_iter);
                 ++include_iter;
             }
         }
@@ -758,26 +1038,57 @@ try
             // add macro if needed
             for (auto line = get_line_no(cur);
                  macro_iter != preprocessed.macros.end() && macro_iter->line <= line; ++macro_iter)
-                builder.add_child(std::move(macro_iter->macro));
+                builder.add_child(macro_iter->build());
 
             auto entity = detail::parse_entity(context, &builder.get(), cur);
             if (entity)
                 builder.add_child(std::move(entity));
         }
     });
+    add_remaining(builder, preprocessed, macro_iter);
 
-    for (; macro_iter != preprocessed.macros.end(); ++macro_iter)
-        builder.add_child(std::move(macro_iter->macro));
+    if (context.error)
+        set_error();
 
-    for (auto& cur : preprocessed.comments)
+    return builder.finish(idx);
+}
+catch (crash_error& ex)
+{
+    // don't throw, so the other files can still be parsed
+    auto diagnostic     = ex.get_diagnostic(path);
+    diagnostic.severity = severity::critical;
+    logger().log("libclang parser", diagnostic);
+    set_error();
+    return nullptr;
+}
+catch (detail::parse_error& ex)
+{
+    logger().log("libclang parser", ex.get_diagnostic(path));
+    set_error();
+    return nullptr;
+}
+
+std::unique_ptr<cpp_file> libclang_parser::preprocess(const cpp_entity_index& idx, std::string path,
+                                                      const libclang_compile_config& config) const
+try
+{
+    auto preprocessed = detail::preprocess(config, path.c_str(), logger());
+
+    cpp_file::builder       builder(path);
+    detail::comment_context comments(preprocessed.comments);
+
+    // includes and macros are both sorted by line, merge them
+    auto macro_iter = preprocessed.macros.cbegin();
+    for (auto& include : preprocessed.includes)
     {
-        if (!cur.comment.empty())
-            builder.add_unmatched_comment(cpp_doc_comment(std::move(cur.comment), cur.line));
+        for (; macro_iter != preprocessed.macros.end() && macro_iter->line < include.line;
+             ++macro_iter)
+            builder.add_child(macro_iter->build());
+        add_include(builder, comments, include);
     }
+    add_remaining(builder, preprocessed, macro_iter);
 
-    if (context.error)
-        set_error();
-
+    // registered like a parsed file, so includes between preprocessed files can be resolved
     return builder.finish(idx);
 }
 catch (detail::parse_error& ex)
@@ -786,3 +1097,132 @@ catch (detail::parse_error& ex)
     set_error();
     return nullptr;
 }
+
+namespace
+{
+struct preprocess_job
+{
+    std::string             file;
+    libclang_compile_config config;
+};
+
+// the configurations are created up front, reading the database isn't thread safe
+std::vector<preprocess_job> get_preprocess_jobs(const libclang_compilation_database& database)
+{
+    struct data_t
+    {
+        const libclang_compilation_database& database;
+        std::vector<preprocess_job>          jobs;
+    } data{database, {}};
+    detail::for_each_file(database, &data, [](void* ptr, std::string file) {
+        auto& data = *static_cast<data_t*>(ptr);
+
+        libclang_compile_config config(data.database, file);
+        data.jobs.push_back(preprocess_job{std::move(file), std::move(config)});
+    });
+    return std::move(data.jobs);
+}
+
+// preprocesses the files in parallel, the result is in the same order as the jobs
+std::vector<std::unique_ptr<cpp_file>> preprocess_files(const libclang_parser&              parser,
+                                                        const cpp_entity_index&            idx,
+                                                        const std::vector<preprocess_job>& jobs,
+                                                        unsigned no_threads)
+{
+    std::vector<std::unique_ptr<cpp_file>> result(jobs.size());
+
+    std::atomic<std::size_t> next(0u);
+    std::mutex               error_mutex;
+    std::exception_ptr       error;
+
+    auto work = [&] {
+        for (auto i = next++; i < jobs.size(); i = next++)
+        {
+            try
+            {
+                result[i] = parser.preprocess(idx, jobs[i].file, jobs[i].config);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+    };
+
+    if (no_threads == 0u)
+        no_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    no_threads = unsigned(std::min(std::size_t(no_threads), jobs.size()));
+
+    // the current thread is one of the threads
+    std::vector<std::thread> threads;
+    for (auto i = 1u; i < no_threads; ++i)
+        threads.emplace_back(work);
+    work();
+    for (auto& thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+    return result;
+}
+} // namespace
+
+std::vector<std::unique_ptr<cpp_file>> cppast::preprocess_database(
+    const libclang_parser& parser, const cpp_entity_index& idx,
+    const libclang_compilation_database& database, unsigned no_threads)
+{
+    return preprocess_files(parser, idx, get_preprocess_jobs(database), no_threads);
+}
+
+std::vector<libclang_database_header> cppast::find_database_headers(
+    const libclang_parser& parser, const libclang_compilation_database& database,
+    const libclang_include_filter& filter, unsigned no_threads)
+{
+    // the preprocessed files are only needed for their includes
+    cpp_entity_index idx;
+
+    // a file can be reached through different paths, so they are normalized
+    auto get_key = [](const std::string& path) {
+        auto canonical = detail::get_canonical_path(path);
+        return canonical.empty() ? path : canonical;
+    };
+
+    auto                            jobs = get_preprocess_jobs(database);
+    std::unordered_set<std::string> known;
+    for (auto& job : jobs)
+        known.insert(get_key(job.file));
+
+    std::vector<libclang_database_header> result;
+    // every round preprocesses the headers found in the previous one
+    while (!jobs.empty())
+    {
+        auto files = preprocess_files(parser, idx, jobs, no_threads);
+
+        std::vector<preprocess_job> next;
+        for (auto i = 0u; i != files.size(); ++i)
+        {
+            if (!files[i])
+                continue;
+
+            for (auto& entity : *files[i])
+            {
+                if (entity.kind() != cpp_include_directive::kind())
+                    continue;
+
+                auto& include = static_cast<const cpp_include_directive&>(entity);
+                if (!include.full_path().empty() && filter(include)
+                    && known.insert(get_key(include.full_path())).second)
+                    // use the configuration of the first file including it
+                    next.push_back(preprocess_job{include.full_path(), jobs[i].config});
+            }
+        }
+
+        for (auto& job : next)
+            result.push_back(libclang_database_header{job.file, job.config});
+        jobs = std::move(next);
+    }
+
+    return result;
+}
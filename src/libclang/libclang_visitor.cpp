@@ -0,0 +1,120 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#include "libclang_visitor.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <cppast/detail/assert.hpp>
+
+using namespace cppast;
+
+namespace
+{
+bool is_whitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+bool is_identifier_char(char c)
+{
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+// returns the offset after the end of the logical line starting at begin
+std::size_t get_line_end(const std::string& source, std::size_t begin)
+{
+    auto end = begin;
+    while (true)
+    {
+        end = source.find('\n', end);
+        if (end == std::string::npos)
+            return source.size();
+
+        auto last = end;
+        if (last > begin && source[last - 1u] == '\r')
+            --last;
+        ++end;
+        if (last == begin || source[last - 1u] != '\\')
+            // not a line continuation
+            return end;
+    }
+}
+
+// whether the line is a directive that might change the presumed file,
+// i.e. a #line directive or a linemarker that doesn't consist only of a line number
+// notes: it doesn't matter if it isn't actually a directive (e.g. in a raw string literal),
+// as it merely results in an additional region
+bool is_file_changing_directive(const char* begin, const char* end)
+{
+    auto skip_whitespace = [&] {
+        while (begin != end && (is_whitespace(*begin) || *begin == '\\' || *begin == '\n'))
+            ++begin;
+    };
+
+    skip_whitespace();
+    if (begin == end || *begin != '#')
+        return false;
+    ++begin;
+    skip_whitespace();
+
+    if (std::size_t(end - begin) > 4u && std::strncmp(begin, "line", 4u) == 0
+        && !is_identifier_char(begin[4u]))
+        begin += 4u;
+    else if (begin == end || *begin < '0' || *begin > '9')
+        return false;
+
+    // a line number alone keeps the current file,
+    // everything else (a file name, macro, comment, ...) might change it
+    skip_whitespace();
+    while (begin != end && *begin >= '0' && *begin <= '9')
+        ++begin;
+    skip_whitespace();
+    return begin != end;
+}
+
+bool has_presumed_file(CXSourceLocation location, const char* path)
+{
+    CXString cx_file_name;
+    clang_getPresumedLocation(location, &cx_file_name, nullptr, nullptr);
+    detail::cxstring file_name(cx_file_name);
+
+    return file_name == path;
+}
+} // namespace
+
+detail::main_file_filter::main_file_filter(const cxtranslation_unit& tu, CXFile file,
+                                           const std::string& source, const char* path)
+: file_(file)
+{
+    auto add_region = [&](std::size_t offset) {
+        auto location = clang_getLocationForOffset(tu.get(), file, unsigned(offset));
+        begins_.push_back(unsigned(offset));
+        matches_.push_back(has_presumed_file(location, path));
+    };
+
+    add_region(0u);
+    for (std::size_t begin = 0u; begin < source.size();)
+    {
+        auto end = get_line_end(source, begin);
+        if (end < source.size()
+            && is_file_changing_directive(source.c_str() + begin, source.c_str() + end))
+            add_region(end);
+        begin = end;
+    }
+}
+
+bool detail::main_file_filter::operator()(const CXCursor& cur) const noexcept
+{
+    CXFile   file;
+    unsigned offset;
+    clang_getExpansionLocation(clang_getCursorLocation(cur), &file, nullptr, nullptr, &offset);
+    if (!clang_File_isEqual(file, file_))
+        // included from another file
+        return false;
+
+    auto iter = std::upper_bound(begins_.begin(), begins_.end(), offset);
+    DEBUG_ASSERT(iter != begins_.begin(), detail::assert_handler{});
+    return matches_[std::size_t(iter - begins_.begin()) - 1u];
+}
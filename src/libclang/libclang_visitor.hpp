@@ -4,6 +4,9 @@
 #ifndef CPPAST_LIBCLANG_VISITOR_HPP_INCLUDED
 #define CPPAST_LIBCLANG_VISITOR_HPP_INCLUDED
 
+#include <string>
+#include <vector>
+
 #include <clang-c/Index.h>
 
 #include "raii_wrapper.hpp"
@@ -33,21 +36,34 @@ namespace detail
             clang_visitChildren(parent, continue_lambda, &f);
     }
 
-    // visits a translation unit
-    // notes: only visits if directly defined in file, not included
-    template <typename Func>
-    void visit_tu(const cxtranslation_unit& tu, const char* path, Func f)
+    // determines whether a cursor is directly defined in the main file,
+    // i.e. its presumed location (which takes #line directives into account) is the file
+    // notes: the presumed file can only change after a line directive,
+    // so it is computed once per directive instead of once per cursor
+    class main_file_filter
     {
-        auto in_tu = [&](const CXCursor& cur) {
-            auto location = clang_getCursorLocation(cur);
+    public:
+        // source is the content of the main file the translation unit was created from
+        main_file_filter(const cxtranslation_unit& tu, CXFile file, const std::string& source,
+                         const char* path);
 
-            CXString cx_file_name;
-            clang_getPresumedLocation(location, &cx_file_name, nullptr, nullptr);
-            cxstring file_name(cx_file_name);
+        bool operator()(const CXCursor& cur) const noexcept;
 
-            return file_name == path;
-        };
+    private:
+        CXFile file_;
+        // region i starts at offset begins_[i],
+        // and it is in the file if matches_[i] is true
+        std::vector<unsigned> begins_;
+        std::vector<bool>     matches_;
+    };
 
+    // visits a translation unit
+    // notes: only visits if directly defined in file, not included
+    template <typename Func>
+    void visit_tu(const cxtranslation_unit& tu, CXFile file, const std::string& source,
+                  const char* path, Func f)
+    {
+        main_file_filter in_tu(tu, file, source, path);
         visit_children(clang_getTranslationUnitCursor(tu.get()), [&](const CXCursor& cur) {
             if (in_tu(cur))
                 f(cur);
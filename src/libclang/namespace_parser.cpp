@@ -14,7 +14,7 @@ namespace
 {
 cpp_namespace::builder make_ns_builder(const detail::parse_context& context, const CXCursor& cur)
 {
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
     // [inline] namespace|:: [<attribute>] <identifier> [{]
 
@@ -109,7 +109,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_namespace_alias(const detail::pars
 {
     DEBUG_ASSERT(cur.kind == CXCursor_NamespaceAlias, detail::assert_handler{});
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     // namespace <identifier> = <nested identifier>;
@@ -134,7 +134,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_using_directive(const detail::pars
 {
     DEBUG_ASSERT(cur.kind == CXCursor_UsingDirective, detail::assert_handler{});
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     // using namespace <nested identifier>;
@@ -206,7 +206,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_using_declaration(
 {
     DEBUG_ASSERT(cur.kind == CXCursor_UsingDeclaration, detail::assert_handler{});
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     // using <nested identifier>;
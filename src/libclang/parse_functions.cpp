@@ -14,6 +14,9 @@ cpp_entity_id detail::get_entity_id(const CXCursor& cur)
 {
     cxstring usr(clang_getCursorUSR(cur));
     DEBUG_ASSERT(!usr.empty(), detail::parse_error_handler{}, cur, "cannot create id for entity");
+
+    detail::id_hasher hasher;
+    hasher.append(usr.c_str());
     if (clang_getCursorKind(cur) == CXCursor_FunctionTemplate
         || clang_getCursorKind(cur) == CXCursor_ConversionFunction)
     {
@@ -23,7 +26,7 @@ cpp_entity_id detail::get_entity_id(const CXCursor& cur)
         // same workaround also applies to conversion functions,
         // there template arguments in the result are ignored
         cxstring type_spelling(clang_getTypeSpelling(clang_getCursorResultType(cur)));
-        return cpp_entity_id(std::string(usr.c_str()) + type_spelling.c_str());
+        hasher.append(type_spelling.c_str());
     }
     else if (clang_getCursorKind(cur) == CXCursor_ClassTemplatePartialSpecialization)
     {
@@ -32,10 +35,11 @@ cpp_entity_id detail::get_entity_id(const CXCursor& cur)
         // same workaround: combine display name with usr
         // (and hope this prevents all collisions...)
         cxstring display_name(clang_getCursorDisplayName(cur));
-        return cpp_entity_id(std::string(usr.c_str()) + display_name.c_str());
+        hasher.append(display_name.c_str());
     }
-    else
-        return cpp_entity_id(usr.c_str());
+
+    // same as the id of the concatenated strings, but without creating it
+    return cpp_entity_id(hasher);
 }
 
 detail::cxstring detail::get_cursor_name(const CXCursor& cur)
@@ -90,19 +94,147 @@ void detail::comment_context::match(cpp_entity& e, unsigned line, bool skip_comm
     auto save = cur_;
     while (cur_ != end_ && cur_->line + 1 < line)
         ++cur_;
-    if (cur_ != end_ && cur_->matches(e, line))
-        e.set_comment(std::move(cur_++->comment));
+    if (cur_ != end_ && cur_->matches(line))
+    {
+        e.set_comment(cur_->comment.str());
+        // mark as matched
+        cur_++->comment = pp_string();
+    }
 
     if (!skip_comments)
         cur_ = save;
 }
 
+void detail::comment_context::skip(const CXCursor& cur) const
+{
+    auto     extent = clang_getCursorExtent(cur);
+    unsigned begin_line, end_line;
+    clang_getPresumedLocation(clang_getRangeStart(extent), nullptr, &begin_line, nullptr);
+    clang_getPresumedLocation(clang_getRangeEnd(extent), nullptr, &end_line, nullptr);
+
+    // comment of the entity itself
+    while (cur_ != end_ && cur_->line + 1 < begin_line)
+        ++cur_;
+    if (cur_ != end_ && cur_->matches(begin_line))
+        cur_++->comment = pp_string();
+
+    // comments of the children
+    while (cur_ != end_ && cur_->line <= end_line)
+        cur_++->comment = pp_string();
+}
+
 namespace
 {
 bool is_friend(const CXCursor& parent_cur)
 {
     return clang_getCursorKind(parent_cur) == CXCursor_FriendDecl;
 }
+
+bool is_specialization(const CXCursor& cur)
+{
+    return !clang_Cursor_isNull(clang_getSpecializedCursorTemplate(cur));
+}
+
+// returns the kind of entity parse_entity() creates for the cursor
+cpp_entity_kind get_entity_kind(const CXCursor& cur)
+{
+    switch (int(clang_getCursorKind(cur)))
+    {
+    case CXCursor_Namespace:
+        return cpp_entity_kind::namespace_t;
+    case CXCursor_NamespaceAlias:
+        return cpp_entity_kind::namespace_alias_t;
+    case CXCursor_UsingDirective:
+        return cpp_entity_kind::using_directive_t;
+    case CXCursor_UsingDeclaration:
+        return cpp_entity_kind::using_declaration_t;
+
+    case CXCursor_TypeAliasDecl:
+    case CXCursor_TypedefDecl:
+        return cpp_entity_kind::type_alias_t;
+    case CXCursor_EnumDecl:
+        return cpp_entity_kind::enum_t;
+    case CXCursor_ClassDecl:
+    case CXCursor_StructDecl:
+    case CXCursor_UnionDecl:
+        return is_specialization(cur) ? cpp_entity_kind::class_template_specialization_t
+                                      : cpp_entity_kind::class_t;
+
+    case CXCursor_VarDecl:
+        return cpp_entity_kind::variable_t;
+    case CXCursor_FieldDecl:
+        return cpp_entity_kind::member_variable_t;
+
+    case CXCursor_FunctionDecl:
+        return is_specialization(cur) ? cpp_entity_kind::function_template_specialization_t
+                                      : cpp_entity_kind::function_t;
+    case CXCursor_CXXMethod:
+        if (is_specialization(cur))
+            return cpp_entity_kind::function_template_specialization_t;
+        else if (clang_CXXMethod_isStatic(cur))
+            return cpp_entity_kind::function_t;
+        return cpp_entity_kind::member_function_t;
+    case CXCursor_ConversionFunction:
+        return is_specialization(cur) ? cpp_entity_kind::function_template_specialization_t
+                                      : cpp_entity_kind::conversion_op_t;
+    case CXCursor_Constructor:
+        return is_specialization(cur) ? cpp_entity_kind::function_template_specialization_t
+                                      : cpp_entity_kind::constructor_t;
+    case CXCursor_Destructor:
+        return cpp_entity_kind::destructor_t;
+
+    case CXCursor_FriendDecl:
+        return cpp_entity_kind::friend_t;
+
+    case CXCursor_TypeAliasTemplateDecl:
+        return cpp_entity_kind::alias_template_t;
+    case CXCursor_FunctionTemplate:
+        return cpp_entity_kind::function_template_t;
+    case CXCursor_ClassTemplate:
+        return cpp_entity_kind::class_template_t;
+    case CXCursor_ClassTemplatePartialSpecialization:
+        return cpp_entity_kind::class_template_specialization_t;
+
+    case CXCursor_StaticAssert:
+        return cpp_entity_kind::static_assert_t;
+    case detail::CXCursor_ConceptDecl:
+        return cpp_entity_kind::concept_t;
+
+    default:
+        return cpp_entity_kind::unexposed_t;
+    }
+}
+
+// returns the names of the semantic parents separated by ::
+std::string get_scope(const CXCursor& cur)
+{
+    std::string result;
+    for (auto parent = clang_getCursorSemanticParent(cur);
+         !clang_Cursor_isNull(parent) && !clang_isTranslationUnit(clang_getCursorKind(parent));
+         parent = clang_getCursorSemanticParent(parent))
+    {
+        auto name = detail::get_cursor_name(parent);
+        if (name.empty() || name[0] == '(')
+            // unnamed scope, libclang might use a description like "(anonymous namespace)"
+            continue;
+
+        result = result.empty() ? name.std_str() : name.std_str() + "::" + result;
+    }
+    return result;
+}
+
+bool is_filtered(const detail::parse_context& context, const CXCursor& cur)
+{
+    auto kind = clang_getCursorKind(cur);
+    if (!context.filter || kind == CXCursor_UnexposedDecl || clang_isAttribute(kind))
+        // unexposed declarations include language linkage specifications,
+        // which are transparent
+        return false;
+
+    libclang_parse_filter_info info{get_entity_kind(cur), detail::get_cursor_name(cur).std_str(),
+                                    get_scope(cur)};
+    return !context.filter(info);
+}
 } // namespace
 
 std::unique_ptr<cpp_entity> detail::parse_entity(const detail::parse_context& context,
@@ -110,6 +242,12 @@ std::unique_ptr<cpp_entity> detail::parse_entity(const detail::parse_context& co
                                                  const CXCursor& parent_cur)
 try
 {
+    if (clang_Cursor_isNull(parent_cur) && is_filtered(context, cur))
+    {
+        context.comments.skip(cur);
+        return nullptr;
+    }
+
     if (context.logger->is_verbose())
     {
         context.logger->log("libclang parser",
@@ -210,7 +348,7 @@ try
     if (!clang_isAttribute(clang_getCursorKind(cur)))
     {
         // build unexposed entity
-        detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+        detail::cxtokenizer    tokenizer(context.tokens, cur);
         detail::cxtoken_stream stream(tokenizer, cur);
         auto                   spelling = detail::to_string(stream, stream.end(), false);
         if (spelling.begin() + 1 == spelling.end() && spelling.front().spelling == ";")
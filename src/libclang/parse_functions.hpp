@@ -4,7 +4,11 @@
 #ifndef CPPAST_PARSE_FUNCTIONS_HPP_INCLUDED
 #define CPPAST_PARSE_FUNCTIONS_HPP_INCLUDED
 
+#include <unordered_map>
+
 #include <cppast/cpp_entity.hpp>
+#include <cppast/cpp_type.hpp>
+#include <cppast/libclang_parser.hpp>
 #include <cppast/parser.hpp>
 
 #include "cxtokenizer.hpp" // for convenience
@@ -42,19 +46,63 @@ namespace detail
         void match(cpp_entity& e, const CXCursor& cur) const;
         void match(cpp_entity& e, unsigned line, bool skip_comments = true) const;
 
+        // must be called for entities that are skipped,
+        // drops their comment and the comments of their children
+        void skip(const CXCursor& cur) const;
+
     private:
         mutable pp_doc_comment* cur_;
         pp_doc_comment*         end_;
     };
 
+    // memoizes the analysis of types in a translation unit,
+    // so types used repeatedly like `const std::string&` are only looked at once
+    class type_cache
+    {
+    public:
+        // a type without any further structure, like a builtin or user-defined type
+        struct leave_type
+        {
+            std::string spelling; // without cv qualifiers and elaborated type specifier
+            cpp_cv      cv;
+            // the reference to the declaration, if it is a user-defined type
+            type_safe::optional<cpp_type_ref> user_defined;
+        };
+
+        // returns the leave type information of the type used by the cursor
+        // the result is valid until the cache is destroyed
+        leave_type& get_leave_type(const CXCursor& cur, const CXType& type) const;
+
+    private:
+        struct key
+        {
+            CXType type;
+            bool   remove_scope;
+
+            bool operator==(const key& other) const noexcept;
+        };
+
+        struct key_hash
+        {
+            std::size_t operator()(const key& k) const noexcept;
+        };
+
+        mutable std::unordered_map<key, leave_type, key_hash> leave_types_;
+    };
+
     struct parse_context
     {
         CXTranslationUnit                              tu;
         CXFile                                         file;
+        const cxtoken_table&                           tokens;
         type_safe::object_ref<const diagnostic_logger> logger;
         type_safe::object_ref<const cpp_entity_index>  idx;
         comment_context                                comments;
-        mutable bool                                   error;
+        const libclang_parse_filter&                   filter;
+        // stores the tokens of lazily created expressions, nullptr if they are created eagerly
+        std::shared_ptr<cpp_token_buffer> expressions;
+        const type_cache&                 types;
+        mutable bool                      error;
     };
 
     // parse default value of variable, function parameter...
@@ -170,6 +218,7 @@ namespace detail
 
     // parent: used for nested namespace, doesn't matter otherwise
     // parent_cur: used when parsing templates or friends
+    // returns nullptr if the filter rejects the entity, unless a parent_cur is given
     std::unique_ptr<cpp_entity> parse_entity(const parse_context& context, cpp_entity* parent,
                                              const CXCursor& cur,
                                              const CXCursor& parent_cur = clang_getNullCursor());
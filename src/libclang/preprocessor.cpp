@@ -6,22 +6,120 @@
 #include <algorithm>
 #include <atomic>
 #include <cctype>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
 #include <fstream>
+#include <list>
+#include <mutex>
+#include <random>
+#include <thread>
 #include <unordered_map>
 
-#include <process.hpp>
+#ifdef _WIN32
+#    include <direct.h>
+#    include <process.h>
+#else
+#    include <unistd.h>
+#endif
 
 #include <cppast/diagnostic.hpp>
 
+#include "char_search.hpp"
+#include "file_metadata.hpp"
+#include "libclang_visitor.hpp"
 #include "parse_error.hpp"
+#include "preprocessor_cache.hpp"
+#include "process_pool.hpp"
 
 using namespace cppast;
-namespace tpl = TinyProcessLib;
 namespace ts  = type_safe;
 
-bool detail::pp_doc_comment::matches(const cpp_entity&, unsigned e_line)
+detail::pp_string detail::pp_arena::store(const char* str, std::size_t size)
+{
+    const auto block_size = std::size_t(16 * 1024u);
+
+    // every block has one unused byte at the end,
+    // so strings in different blocks are never next to each other, see join()
+    char* result;
+    if (size + 1u > block_size / 4u)
+    {
+        // big strings get their own block, so the rest of the current one isn't wasted
+        blocks_.emplace_back(new char[size + 2u]);
+        result = blocks_.back().get();
+    }
+    else
+    {
+        if (size + 1u > remaining_)
+        {
+            blocks_.emplace_back(new char[block_size + 1u]);
+            cur_       = blocks_.back().get();
+            remaining_ = block_size;
+        }
+
+        result = cur_;
+        cur_ += size + 1u;
+        remaining_ -= size + 1u;
+    }
+
+    std::memcpy(result, str, size);
+    result[size] = '\0';
+    return pp_string(result, size);
+}
+
+detail::pp_string detail::pp_arena::join(const pp_string& lhs, char sep, const pp_string& rhs)
+{
+    if (lhs.end() + 1 == rhs.begin())
+    {
+        // stored next to each other, replace the null terminator in between
+        const_cast<char*>(lhs.end())[0] = sep;
+        return pp_string(lhs.begin(), lhs.size() + 1u + rhs.size());
+    }
+
+    auto& buffer = this->buffer();
+    buffer.append(lhs.begin(), lhs.end());
+    buffer += sep;
+    buffer.append(rhs.begin(), rhs.end());
+    return store(buffer);
+}
+
+std::unique_ptr<cpp_macro_definition> detail::pp_macro::build() const
+{
+    std::unique_ptr<cpp_macro_definition> result;
+    if (!parameters)
+        result = cpp_macro_definition::build_object_like(name.str(), replacement.str());
+    else
+    {
+        cpp_macro_definition::function_like_builder builder{name.str()};
+        builder.replacement(replacement.str());
+
+        auto cur_ptr   = parameters.value().c_str();
+        auto cur_param = cur_ptr;
+        while (*cur_ptr)
+        {
+            while (*cur_ptr && *cur_ptr != ',')
+                ++cur_ptr;
+
+            if (*cur_param == '.')
+                builder.is_variadic();
+            else
+                builder.parameter(std::string(cur_param, cur_ptr));
+
+            if (*cur_ptr)
+                cur_param = ++cur_ptr;
+        }
+
+        result = builder.finish();
+    }
+
+    if (comment)
+        result->set_comment(comment.value().str());
+    return result;
+}
+
+bool detail::pp_doc_comment::matches(unsigned e_line) const noexcept
 {
     if (kind == detail::pp_doc_comment::end_of_line)
         return line == e_line;
@@ -172,16 +270,41 @@ std::string diagnostics_flags()
 }
 
 // get the command that returns all macros defined in the TU
-std::string get_macro_command(const libclang_compile_config& c, const char* full_path)
+// the TU is the directive skeleton of the file at full_path, see get_directive_skeleton(),
+// or the file itself if header is true
+// dependency_file_path == nullptr <=> don't write dependencies
+std::string get_macro_command(const libclang_compile_config& c, const char* full_path,
+                              const char* input_path, bool header,
+                              const char* dependency_file_path)
 {
     // -xc/-xc++: force C or C++ as input language
+    // -xc-header/-xc++-header: same, but as a header, so #pragma once applies to the input
+    // -iquote <dir>: "" includes are relative to the file, not the skeleton
     // -I.: add current working directory to include search path
     // -E: print preprocessor output
     // -dM: print macro definitions instead of preprocessed file
     std::string language = c.use_c() ? "-xc" : "-xc++";
-    auto        flags    = language + " -I. -E -dM";
+    auto        flags    = header ? language + "-header" : language;
+
+    std::string dir(full_path);
+    auto        last_sep = dir.find_last_of("/\\");
+    if (last_sep == std::string::npos)
+        dir = ".";
+    else
+        // keep the separator for the root, but never end with a backslash before the quote
+        dir.erase(last_sep == 0u ? 1u : last_sep);
+    flags += " -iquote " + quote(dir);
+
+    flags += " -I. -E -dM";
     flags += diagnostics_flags();
 
+    if (dependency_file_path)
+    {
+        // -MD -MF: write all included files
+        flags += " -MD -MF ";
+        flags += quote(dependency_file_path);
+    }
+
     std::string cmd(detail::libclang_compile_config_access::clang_binary(c) + " " + std::move(flags)
                     + " ");
     // other flags
@@ -191,19 +314,23 @@ std::string get_macro_command(const libclang_compile_config& c, const char* full
         cmd += ' ';
     }
 
-    return cmd + quote(full_path);
+    return cmd + quote(input_path);
 }
 
 // get the command that preprocess a translation unit given the macros
 // macro_file_path == nullptr <=> don't do fast preprocessing
+// dependency_file_path == nullptr <=> don't write dependencies
 std::string get_preprocess_command(const libclang_compile_config& c, const char* full_path,
-                                   const char* macro_file_path)
+                                   const char* macro_file_path, const char* dependency_file_path)
 {
     // -xc/-xc++: force C or C++ as input language
+    // -xc-header/-xc++-header: same, but as a header, so #pragma once applies to the file
     // -E: print preprocessor output
     // -dD: keep macros
-    std::string language = c.use_c() ? "-xc" : "-xc++";
-    auto        flags    = language + " -E -dD";
+    auto        revalidate = detail::libclang_compile_config_access::revalidate_file_metadata(c);
+    auto        header     = detail::get_file_metadata(full_path, revalidate)->pragma_once;
+    std::string language   = c.use_c() ? "-xc" : "-xc++";
+    auto        flags      = (header ? language + "-header" : language) + " -E -dD";
 
     // -CC: keep comments, even in macro
     // -C: keep comments, but not in macro
@@ -225,7 +352,14 @@ std::string get_preprocess_command(const libclang_compile_config& c, const char*
     {
         // include file that defines all macros
         flags += " -include ";
-        flags += macro_file_path;
+        flags += quote(macro_file_path);
+    }
+
+    if (dependency_file_path)
+    {
+        // -MD -MF: write all included files
+        flags += " -MD -MF ";
+        flags += quote(dependency_file_path);
     }
 
     std::string cmd(detail::libclang_compile_config_access::clang_binary(c) + " " + std::move(flags)
@@ -247,122 +381,316 @@ std::string get_preprocess_command(const libclang_compile_config& c, const char*
     return cmd + quote(full_path);
 }
 
+// the temporary files are created in a directory private to the process,
+// so concurrent processes never use the same names
+class temporary_directory
+{
+public:
+    static temporary_directory& get()
+    {
+        static temporary_directory dir;
+        return dir;
+    }
+
+    ~temporary_directory()
+    {
+        // only succeeds if all files have been removed
+        if (created_)
+#ifdef _WIN32
+            _rmdir(prefix_.c_str());
+#else
+            rmdir(prefix_.c_str());
+#endif
+    }
+
+    std::string get_file_name(const char* name)
+    {
+        return prefix_ + name + "-" + std::to_string(++counter_) + ".delete-me";
+    }
+
+private:
+    temporary_directory() : created_(false), counter_(0u)
+    {
+#ifdef _WIN32
+        auto        tmp  = std::getenv("TEMP");
+        auto        pid  = _getpid();
+        std::string base = tmp && *tmp ? tmp : ".";
+#else
+        auto        tmp  = std::getenv("TMPDIR");
+        auto        pid  = getpid();
+        std::string base = tmp && *tmp ? tmp : "/tmp";
+#endif
+        if (base.back() != '/' && base.back() != '\\')
+            base += '/';
+
+#ifdef _WIN32
+        std::random_device random;
+        for (auto i = 0; i != 16 && !created_; ++i)
+        {
+            prefix_  = base + "cppast-" + std::to_string(pid) + "-" + std::to_string(random());
+            created_ = _mkdir(prefix_.c_str()) == 0;
+        }
+#else
+        // creates a unique directory only accessible by the user
+        prefix_  = base + "cppast-XXXXXX";
+        created_ = mkdtemp(&prefix_[0]) != nullptr;
+#endif
+
+        if (created_)
+            prefix_ += '/';
+        else
+            // fallback to the working directory, the process id and a random number make the names
+            // unique
+            prefix_ = "standardese-" + std::to_string(pid) + "-"
+                      + std::to_string(std::random_device{}()) + "-";
+    }
+
+    std::string           prefix_; // the directory including the separator
+    bool                  created_;
+    std::atomic<unsigned> counter_;
+};
+
 std::string get_macro_file_name()
 {
-    static std::atomic<unsigned> counter(0u);
-    return "standardese-macro-file-" + std::to_string(++counter) + ".delete-me";
+    return temporary_directory::get().get_file_name("macro-file");
 }
 
-template <std::size_t N>
-void bump_until(std::istreambuf_iterator<char>& iter, const char (&str)[N])
+std::string get_dependency_file_name()
 {
-    auto ptr = &str[0];
-    while (ptr != &str[N - 1])
-    {
-        if (iter == std::istreambuf_iterator<char>{})
-            // end of file
-            break;
-        else if (*iter != *ptr)
+    return temporary_directory::get().get_file_name("dependency-file");
+}
+
+// returns the preprocessor directives of the source, one per line
+// the macros defined after preprocessing only depend on them,
+// so files with the same skeleton share the same macro prelude
+std::string get_directive_skeleton(const std::string& source)
+{
+    std::string result;
+
+    auto ptr = source.c_str();
+    auto end = ptr + source.size();
+
+    // skips the rest of a comment or literal starting at ptr,
+    // returns false if there is none
+    auto skip_comment_or_literal = [&](bool in_directive) {
+        if (ptr[0] == '/' && ptr[1] == '*')
+        {
+            auto comment_end = std::strstr(ptr + 2, "*/");
+            ptr              = comment_end ? comment_end + 2 : end;
+            if (in_directive)
+                // comments are whitespace
+                result += ' ';
+            return true;
+        }
+        else if (ptr[0] == '/' && ptr[1] == '/')
         {
-            // try again
-            ptr = &str[0];
-            if (*iter == *ptr)
-                ++ptr; // it was the first character again
+            while (ptr != end && *ptr != '\n')
+                ++ptr;
+            return true;
+        }
+        else if (*ptr == '"' && !in_directive && ptr != source.c_str() && ptr[-1] == 'R')
+        {
+            // raw string literal: R"delim( ... )delim"
+            auto delim_end = ptr + 1;
+            while (delim_end != end && *delim_end != '(' && *delim_end != '\n')
+                ++delim_end;
+            auto terminator = ")" + std::string(ptr + 1, delim_end) + "\"";
+            auto str_end    = std::strstr(delim_end, terminator.c_str());
+            ptr             = str_end ? str_end + terminator.size() : end;
+            return true;
+        }
+        else if (*ptr == '"'
+                 || (*ptr == '\''
+                     && (ptr == source.c_str()
+                         || !std::isalnum(static_cast<unsigned char>(ptr[-1])))))
+        {
+            // string or character literal, but not a digit separator
+            auto begin = ptr;
+            for (++ptr; ptr != end && *ptr != *begin && *ptr != '\n'; ++ptr)
+                if (*ptr == '\\' && ptr + 1 != end)
+                    ++ptr;
+            if (ptr != end && *ptr == *begin)
+                ++ptr;
+            if (in_directive)
+                result.append(begin, ptr);
+            return true;
         }
         else
-            // okay, move forward
-            ++ptr;
+            return false;
+    };
 
-        ++iter;
+    // whether there was a token on the current line
+    auto had_token = false;
+    while (ptr != end)
+    {
+        if (*ptr == '\n')
+        {
+            had_token = false;
+            ++ptr;
+        }
+        else if (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\f' || *ptr == '\v')
+            ++ptr;
+        else if (*ptr == '\\' && ptr[1] == '\n')
+            ptr += 2;
+        else if (*ptr == '#' && !had_token)
+        {
+            // directive until the end of the logical line
+            while (ptr != end && *ptr != '\n')
+            {
+                if (*ptr == '\\' && (ptr[1] == '\n' || (ptr[1] == '\r' && ptr[2] == '\n')))
+                {
+                    // line continuation
+                    ptr += ptr[1] == '\n' ? 2 : 3;
+                    result += ' ';
+                }
+                else if (!skip_comment_or_literal(true))
+                {
+                    if (*ptr != '\r')
+                        result += *ptr;
+                    ++ptr;
+                }
+            }
+            result += '\n';
+        }
+        else if (!skip_comment_or_literal(false))
+        {
+            had_token = true;
+            ++ptr;
+        }
     }
+
+    return result;
 }
 
-template <typename Iter>
-void skip_whitespace(Iter& begin, Iter end)
+// returns the hash of the file, or nullopt if it doesn't exist
+ts::optional<detail::hash_type> hash_dependency(const std::string& path, bool revalidate)
 {
-    while (begin != end && (*begin == ' ' || *begin == '\t'))
-        ++begin;
+    auto metadata = detail::get_file_metadata(path, revalidate);
+    if (!metadata->exists)
+        return ts::nullopt;
+    return metadata->hash;
 }
 
-template <typename Iter>
-std::string get_line(Iter& begin, Iter end)
+// defines all macros of a file before preprocessing it without includes
+// it is shared by all files with the same skeleton and configuration
+// the file is removed once the prelude isn't used anymore
+struct macro_prelude
 {
-    std::string line;
-    while (begin != end && *begin != '\n')
-        line += *begin++;
-    ++begin; // newline
-    return line;
-}
+    std::mutex                                   mutex; // locked while computing
+    bool                                         ready = false;
+    std::string                                  file;
+    std::vector<std::string>                     dependencies; // excluding the file itself
+    std::vector<ts::optional<detail::hash_type>> hashes; // of the dependencies when computed
+
+    macro_prelude() = default;
+
+    macro_prelude(const macro_prelude&)            = delete;
+    macro_prelude& operator=(const macro_prelude&) = delete;
+
+    ~macro_prelude()
+    {
+        if (ready)
+            std::remove(file.c_str());
+    }
+
+    // returns whether none of the dependencies changed since it was computed
+    bool is_current(bool revalidate) const
+    {
+        for (auto i = 0u; i != dependencies.size(); ++i)
+            if (hash_dependency(dependencies[i], revalidate) != hashes[i])
+                return false;
+        return true;
+    }
+};
 
-type_safe::optional<std::string> get_include_guard_macro(const std::string& full_path)
+// keeps the most recently used preludes
+class macro_prelude_cache
 {
-    std::ifstream file(full_path);
+public:
+    static macro_prelude_cache& get()
+    {
+        static macro_prelude_cache cache;
+        return cache;
+    }
 
-    auto iter = std::istreambuf_iterator<char>(file);
-    while (iter != std::istreambuf_iterator<char>{})
+    std::shared_ptr<macro_prelude> lookup(const std::string& key)
     {
-        if (*iter == '/')
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto iter = preludes_.find(key);
+        if (iter != preludes_.end())
         {
-            ++iter;
-            if (*iter == '/')
-                // C++ style comment, bump until \n
-                bump_until(iter, "\n");
-            else if (*iter == '*')
-                // C style comment
-                bump_until(iter, "*/");
+            lru_.splice(lru_.begin(), lru_, iter->second.lru);
+            return iter->second.prelude;
         }
-        else if (*iter == ' ' || *iter == '\t' || *iter == '\n')
-            ++iter; // empty
-        else if (*iter == '#')
+
+        if (preludes_.size() >= max_size)
         {
-            // preprocessor line
-            auto if_line = get_line(iter, {});
-            if (if_line.compare(0, 3, "#if") != 0)
-                // not something starting with #if
-                break;
+            // files currently preprocessed with it keep it alive
+            preludes_.erase(*lru_.back());
+            lru_.pop_back();
+        }
 
-            skip_whitespace(iter, {});
+        iter = preludes_.emplace(key, entry{std::make_shared<macro_prelude>(), lru_.end()}).first;
+        lru_.push_front(&iter->first);
+        iter->second.lru = lru_.begin();
+        return iter->second.prelude;
+    }
 
-            auto macro_line = get_line(iter, {});
-            if (macro_line.compare(0, 7, "#define") != 0)
-                // not a corresponding define
-                break;
+    // removes the prelude, unless it has already been replaced
+    void remove(const std::string& key, const std::shared_ptr<macro_prelude>& prelude)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
 
-            auto macro_name_begin = std::next(macro_line.begin(), 7);
-            // skip whitespace after define
-            skip_whitespace(macro_name_begin, macro_line.end());
+        auto iter = preludes_.find(key);
+        if (iter != preludes_.end() && iter->second.prelude == prelude)
+        {
+            lru_.erase(iter->second.lru);
+            preludes_.erase(iter);
+        }
+    }
 
-            auto macro_name_end = macro_name_begin;
-            // skip over identifier
-            while (macro_name_end != macro_line.end()
-                   && (*macro_name_end == '_' || std::isalnum(*macro_name_end)))
-                ++macro_name_end;
+private:
+    static constexpr std::size_t max_size = 64u;
 
-            auto trailing_ws = macro_line.rbegin();
-            skip_whitespace(trailing_ws, macro_line.rend());
-            if (macro_name_end != trailing_ws.base())
-                // anything else after macro
-                break;
+    struct entry
+    {
+        std::shared_ptr<macro_prelude>          prelude;
+        std::list<const std::string*>::iterator lru;
+    };
 
-            std::string macro_name(macro_name_begin, macro_name_end);
-            if (if_line.find(macro_name) == std::string::npos)
-                // macro name doesn't occur in if line
-                break;
-            else
-                return macro_name;
-        }
-        else
-            // line is neither empty, comment, nor preprocessor
-            break;
+    macro_prelude_cache()
+    {
+        // constructed first, so it is destroyed after the files in it have been removed
+        temporary_directory::get();
     }
 
-    // assume no include guard followed a bad line
-    return type_safe::nullopt;
+    std::mutex                             mutex_;
+    std::unordered_map<std::string, entry> preludes_;
+    std::list<const std::string*>          lru_; // keys of preludes_, most recently used first
+};
+
+std::string read_file(const std::string& path)
+{
+    std::ifstream file(path, std::ios_base::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>{});
 }
 
-std::string write_macro_file(const libclang_compile_config& c, const std::string& full_path,
-                             const diagnostic_logger& logger)
+void compute_macro_prelude(macro_prelude& prelude, const libclang_compile_config& c,
+                           const std::string& full_path, const std::string& skeleton,
+                           const detail::file_metadata& metadata,
+                           const diagnostic_logger&     logger)
 {
+    auto& include_guard = metadata.include_guard;
+
+    // the include guard of the skeleton prevents the file from being included again,
+    // but clang ignores #pragma once in the main file and the skeleton is a different file,
+    // so preprocess the file itself as a header instead
+    auto use_skeleton  = include_guard || !metadata.pragma_once;
+    auto skeleton_file = use_skeleton ? get_macro_file_name() : full_path;
+    if (use_skeleton)
+        std::ofstream(skeleton_file) << skeleton;
+
     std::string diagnostic;
     auto        diagnostic_logger = [&](const char* str, std::size_t n) {
         diagnostic.reserve(diagnostic.size() + n);
@@ -371,7 +699,9 @@ std::string write_macro_file(const libclang_compile_config& c, const std::string
                 continue;
             else if (*str == '\n')
             {
-                // consume current diagnostic
+                // consume current diagnostic, but report it for the actual file
+                if (diagnostic.compare(0, skeleton_file.size(), skeleton_file) == 0)
+                    diagnostic.replace(0, skeleton_file.size(), full_path);
                 log_diagnostic(logger, diagnostic);
                 diagnostic.clear();
             }
@@ -379,36 +709,190 @@ std::string write_macro_file(const libclang_compile_config& c, const std::string
                 diagnostic.push_back(*str);
     };
 
-    auto          file = get_macro_file_name();
-    std::ofstream stream(file);
+    // always write the dependencies, as the prelude might be used with the preprocessor cache
+    auto dependency_file = get_dependency_file_name();
 
-    auto         cmd = get_macro_command(c, full_path.c_str());
-    tpl::Process process(
-        cmd, "", [&](const char* str, std::size_t n) { stream.write(str, std::streamsize(n)); },
-        diagnostic_logger);
+    std::string macros;
+    auto        cmd = get_macro_command(c, full_path.c_str(), skeleton_file.c_str(),
+                                        !use_skeleton, dependency_file.c_str());
+    int         exit_code;
+    try
+    {
+        exit_code = detail::run_process(
+            cmd, detail::libclang_compile_config_access::preprocessor_workers(c),
+            [&](const char* str, std::size_t n) { macros.append(str, n); }, diagnostic_logger);
+    }
+    catch (...)
+    {
+        if (use_skeleton)
+            std::remove(skeleton_file.c_str());
+        std::remove(dependency_file.c_str());
+        throw;
+    }
+    if (use_skeleton)
+        std::remove(skeleton_file.c_str());
 
-    if (auto include_guard = get_include_guard_macro(full_path))
-        // undefine include guard
-        stream << "#undef " << include_guard.value();
+    auto dependencies = detail::parse_dependency_file(dependency_file);
+    std::remove(dependency_file.c_str());
 
-    auto exit_code = process.get_exit_status();
     DEBUG_ASSERT(diagnostic.empty(), detail::assert_handler{});
     if (exit_code != 0)
         throw libclang_error("preprocessor (macro): command '" + cmd
                              + "' exited with non-zero exit code (" + std::to_string(exit_code)
                              + ")");
-    return file;
+
+    if (include_guard)
+        // undefine include guard
+        macros += "#undef " + include_guard.value() + "\n";
+
+    auto          file = get_macro_file_name();
+    std::ofstream stream(file);
+    stream << macros;
+    if (!stream)
+        throw libclang_error("preprocessor (macro): unable to write file '" + file + "'");
+
+    auto revalidate = detail::libclang_compile_config_access::revalidate_file_metadata(c);
+    prelude.file    = std::move(file);
+    for (auto& dependency : dependencies)
+        if (dependency != skeleton_file)
+        {
+            prelude.hashes.push_back(hash_dependency(dependency, revalidate));
+            prelude.dependencies.push_back(std::move(dependency));
+        }
+    prelude.ready = true;
+}
+
+// returns the prelude for the file, computing it if necessary
+std::shared_ptr<macro_prelude> get_macro_prelude(const libclang_compile_config& c,
+                                                 const std::string&             full_path,
+                                                 const diagnostic_logger&       logger)
+{
+    auto  revalidate    = detail::libclang_compile_config_access::revalidate_file_metadata(c);
+    auto  metadata      = detail::get_file_metadata(full_path, revalidate);
+    auto& include_guard = metadata->include_guard;
+    auto  skeleton      = get_directive_skeleton(read_file(full_path));
+
+    auto key = detail::libclang_compile_config_access::clang_binary(c);
+    key += '\n';
+    key += c.use_c() ? "c" : "c++";
+    key += '\n';
+    std::string dir(full_path);
+    auto        last_sep = dir.find_last_of("/\\");
+    key += last_sep == std::string::npos ? "" : dir.substr(0, last_sep);
+    key += '\n';
+    key += include_guard.value_or("");
+    key += '\n';
+    for (auto& flag : detail::libclang_compile_config_access::flags(c))
+    {
+        key += flag;
+        key += '\n';
+    }
+    key += skeleton;
+
+    auto& cache = macro_prelude_cache::get();
+    while (true)
+    {
+        auto prelude = cache.lookup(key);
+
+        std::lock_guard<std::mutex> lock(prelude->mutex);
+        if (!prelude->ready)
+            compute_macro_prelude(*prelude, c, full_path, skeleton, *metadata, logger);
+        else if (!prelude->is_current(revalidate))
+        {
+            // an included file changed, so the macros might be different
+            cache.remove(key, prelude);
+            continue;
+        }
+        else if (logger.is_verbose())
+            logger.log("preprocessor", format_diagnostic(severity::debug,
+                                                         source_location::make_file(full_path),
+                                                         "using shared macro prelude"));
+        return prelude;
+    }
 }
 
+// output of the preprocessor, written while it is running and read by the scanner
+class preprocessor_stream
+{
+public:
+    preprocessor_stream() : done_(false), aborted_(false) {}
+
+    // called by the thread running the preprocessor
+    void write(const char* str, std::size_t n)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // wait until the scanner has caught up to keep the memory bounded
+        cv_.wait(lock, [&] { return pending_.size() < max_pending() || aborted_; });
+        if (aborted_)
+            return;
+
+        for (auto ptr = str; ptr != str + n; ++ptr)
+            if (*ptr == '\t')
+                pending_ += ' '; // convert to single spaces
+            else if (*ptr != '\r')
+                pending_ += *ptr;
+        cv_.notify_all();
+    }
+
+    void finish(std::exception_ptr error = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_  = true;
+        error_ = std::move(error);
+        cv_.notify_all();
+    }
+
+    // called by the scanner if it stops early
+    void abort()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        aborted_ = true;
+        cv_.notify_all();
+    }
+
+    // appends the available output to the buffer, waits if there is none
+    // returns false at the end of the output, rethrows errors of the preprocessor
+    bool read(std::string& buffer)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return !pending_.empty() || done_; });
+        if (!pending_.empty())
+        {
+            buffer += pending_;
+            pending_.clear();
+            cv_.notify_all();
+            return true;
+        }
+        else if (error_)
+            std::rethrow_exception(error_);
+        else
+            return false;
+    }
+
+private:
+    static std::size_t max_pending() noexcept
+    {
+        return 4 * 1024 * 1024u;
+    }
+
+    std::mutex              mutex_;
+    std::condition_variable cv_;
+    std::string             pending_;
+    std::exception_ptr      error_;
+    bool                    done_, aborted_;
+};
+
 struct clang_preprocess_result
 {
-    std::string              file;
     std::vector<std::string> included_files; // needed for pre-clang 4.0.0
+    std::vector<std::string> dependencies;   // only if requested
 };
 
 clang_preprocess_result clang_preprocess_impl(const libclang_compile_config& c,
                                               const diagnostic_logger&       logger,
-                                              const std::string& full_path, const char* macro_path)
+                                              const std::string& full_path, const char* macro_path,
+                                              const char*          dependency_path,
+                                              preprocessor_stream& output)
 {
     clang_preprocess_result result;
 
@@ -442,19 +926,10 @@ clang_preprocess_result clang_preprocess_impl(const libclang_compile_config& c,
                 diagnostic.push_back(*str);
     };
 
-    auto         cmd = get_preprocess_command(c, full_path.c_str(), macro_path);
-    tpl::Process process(
-        cmd, "",
-        [&](const char* str, std::size_t n) {
-            for (auto ptr = str; ptr != str + n; ++ptr)
-                if (*ptr == '\t')
-                    result.file += ' '; // convert to single spaces
-                else if (*ptr != '\r')
-                    result.file += *ptr;
-        },
-        diagnostic_handler);
-    // wait for process end
-    auto exit_code = process.get_exit_status();
+    auto cmd       = get_preprocess_command(c, full_path.c_str(), macro_path, dependency_path);
+    auto exit_code = detail::run_process(
+        cmd, detail::libclang_compile_config_access::preprocessor_workers(c),
+        [&](const char* str, std::size_t n) { output.write(str, n); }, diagnostic_handler);
     DEBUG_ASSERT(diagnostic.empty(), detail::assert_handler{});
     if (exit_code != 0 && !expect_bad_exit_code)
         throw libclang_error("preprocessor: command '" + cmd + "' exited with non-zero exit code ("
@@ -464,45 +939,161 @@ clang_preprocess_result clang_preprocess_impl(const libclang_compile_config& c,
 }
 
 clang_preprocess_result clang_preprocess(const libclang_compile_config& c, const char* full_path,
-                                         const diagnostic_logger& logger)
+                                         const diagnostic_logger& logger, bool dependencies,
+                                         preprocessor_stream& output)
 {
-    if (!std::ifstream(full_path))
+    auto metadata = detail::get_file_metadata(
+        full_path, detail::libclang_compile_config_access::revalidate_file_metadata(c));
+    if (!metadata->exists)
         throw libclang_error("preprocessor: file '" + std::string(full_path) + "' doesn't exist");
 
     // if we're fast preprocessing we only preprocess the main file, not includes
     // this is done by disabling all include search paths when doing the preprocessing
     // to allow macros a separate preprocessing with the -dM flag is done that extracts all macros
-    // they are then manually defined before
-    auto fast_preprocessing = detail::libclang_compile_config_access::fast_preprocessing(c);
+    // they are then manually defined before, the result is shared with other files
+    if (detail::libclang_compile_config_access::fast_preprocessing(c))
+    {
+        auto prelude = get_macro_prelude(c, full_path, logger);
+        auto result  = clang_preprocess_impl(c, logger, full_path, prelude->file.c_str(), nullptr,
+                                             output);
+        if (dependencies)
+        {
+            result.dependencies.push_back(full_path);
+            result.dependencies.insert(result.dependencies.end(), prelude->dependencies.begin(),
+                                       prelude->dependencies.end());
+        }
+        return result;
+    }
 
-    auto macro_file = fast_preprocessing ? write_macro_file(c, full_path, logger) : "";
+    // the dependencies are written by the invocation that sees all includes
+    auto dependency_file = dependencies ? get_dependency_file_name() : "";
+    auto dependency_path = dependencies ? dependency_file.c_str() : nullptr;
 
     clang_preprocess_result result;
     try
     {
-        result = clang_preprocess_impl(c, logger, full_path,
-                                       fast_preprocessing ? macro_file.c_str() : nullptr);
+        result = clang_preprocess_impl(c, logger, full_path, nullptr, dependency_path, output);
+        if (dependencies)
+            result.dependencies = detail::parse_dependency_file(dependency_file);
     }
     catch (...)
     {
-        if (fast_preprocessing)
-        {
-            auto err = std::remove(macro_file.c_str());
-            DEBUG_ASSERT(err == 0, detail::assert_handler{});
-        }
+        if (dependencies)
+            // might not have been written
+            std::remove(dependency_file.c_str());
         throw;
     }
 
-    if (fast_preprocessing)
-    {
-        auto err = std::remove(macro_file.c_str());
-        DEBUG_ASSERT(err == 0, detail::assert_handler{});
-    }
+    if (dependencies)
+        std::remove(dependency_file.c_str());
 
     return result;
 }
 
 //==== parsing ===//
+// the part of the preprocessor output that is currently scanned
+class input_window
+{
+public:
+    explicit input_window(preprocessor_stream& stream)
+    : stream_(stream), complete_(0u), last_newl_(std::string::npos), eof_(false)
+    {}
+
+    const char* begin() const noexcept
+    {
+        return buffer_.c_str();
+    }
+
+    const char* end() const noexcept
+    {
+        return buffer_.c_str() + buffer_.size();
+    }
+
+    // ensures that str occurs after ptr + offset, unless the output ends before
+    // returns the new location of ptr
+    const char* ensure(const char* ptr, std::size_t offset, const char* str)
+    {
+        auto pos = std::size_t(ptr - begin());
+        while (!eof_ && !contains(pos + offset, str))
+            pos = refill(pos);
+        return begin() + pos;
+    }
+
+    // ensures that the line starting at ptr + offset is complete,
+    // including the end of C comments spanning multiple lines
+    // returns the new location of ptr
+    const char* ensure_line(const char* ptr, std::size_t offset)
+    {
+        auto pos = std::size_t(ptr - begin());
+        if (pos + offset < complete_)
+            return ptr;
+
+        // offsets are relative to pos, as it changes when reading more
+        auto line_begin = offset;
+        while (true)
+        {
+            while (!eof_ && !contains(pos + line_begin, "\n"))
+                pos = refill(pos);
+
+            auto line_end = buffer_.find('\n', pos + line_begin);
+            auto comment  = buffer_.find("/*", pos + line_begin);
+            if (comment == std::string::npos || comment > line_end)
+            {
+                complete_ = line_end == std::string::npos ? buffer_.size() : line_end;
+                break;
+            }
+
+            auto comment_begin = comment + 2u - pos;
+            while (!eof_ && !contains(pos + comment_begin, "*/"))
+                pos = refill(pos);
+
+            auto comment_end = buffer_.find("*/", pos + comment_begin);
+            if (comment_end == std::string::npos)
+            {
+                complete_ = buffer_.size();
+                break;
+            }
+            line_begin = comment_end + 2u - pos;
+        }
+
+        return begin() + pos;
+    }
+
+private:
+    bool contains(std::size_t pos, const char* str) const noexcept
+    {
+        if (str[0] == '\n' && str[1] == '\0')
+            return last_newl_ != std::string::npos && last_newl_ >= pos;
+        else
+            return pos <= buffer_.size() && std::strstr(begin() + pos, str) != nullptr;
+    }
+
+    // reads more output, returns the new location of pos
+    std::size_t refill(std::size_t pos)
+    {
+        // remove everything before pos, except one character for lookbehind
+        auto removed = pos == 0u ? 0u : pos - 1u;
+        buffer_.erase(0u, removed);
+        complete_ = complete_ > removed ? complete_ - removed : 0u;
+        if (last_newl_ != std::string::npos)
+            last_newl_ = last_newl_ >= removed ? last_newl_ - removed : std::string::npos;
+
+        auto old_size = buffer_.size();
+        eof_          = !stream_.read(buffer_);
+
+        auto newl = buffer_.rfind('\n');
+        if (newl != std::string::npos && newl >= old_size)
+            last_newl_ = newl;
+
+        return pos - removed;
+    }
+
+    preprocessor_stream& stream_;
+    std::string          buffer_;
+    std::size_t          complete_, last_newl_;
+    bool                 eof_;
+};
+
 class position
 {
 public:
@@ -566,8 +1157,17 @@ public:
     {
         if (write_enabled())
         {
-            for (std::size_t i = 0u; i != offset; ++i)
-                bump();
+            result_->append(ptr_, offset);
+
+            auto end = ptr_ + offset;
+            while (auto newl = std::memchr(ptr_, '\n', std::size_t(end - ptr_)))
+            {
+                ++cur_line_;
+                cur_column_ = 0;
+                ptr_        = static_cast<const char*>(newl) + 1;
+            }
+            cur_column_ += unsigned(end - ptr_);
+            ptr_ = end;
         }
         else
         {
@@ -623,6 +1223,12 @@ public:
         return ptr_;
     }
 
+    // the input has been moved in memory
+    void rebase(const char* ptr) noexcept
+    {
+        ptr_ = ptr;
+    }
+
     unsigned cur_line() const noexcept
     {
         return cur_line_;
@@ -662,6 +1268,17 @@ void skip(position& p, const char* str)
     p.skip(std::strlen(str));
 }
 
+const char* find_next(const position& p, bool in_string, bool in_char)
+{
+    if (in_string)
+        // only escapes and the end of the literal matter
+        return detail::find_first_of(p.ptr(), R"(\")"); // look for \ or "
+    else if (in_char)
+        return detail::find_first_of(p.ptr(), R"(\')"); // look for \ or '
+    else
+        return detail::find_first_of(p.ptr(), R"(\"'#/)"); // look for \, ", ', # or /
+}
+
 void bump_spaces(position& p, bool bump = false)
 {
     while (starts_with(p, " "))
@@ -671,9 +1288,10 @@ void bump_spaces(position& p, bool bump = false)
             p.skip();
 }
 
-detail::pp_doc_comment parse_c_doc_comment(position& p)
+detail::pp_doc_comment parse_c_doc_comment(position& p, detail::pp_arena& arena)
 {
     detail::pp_doc_comment result;
+    auto&                  comment = arena.buffer();
     result.kind = detail::pp_doc_comment::c;
 
     auto indent = p.cur_column() + 3;
@@ -690,14 +1308,14 @@ detail::pp_doc_comment parse_c_doc_comment(position& p)
         if (starts_with(p, "\n"))
         {
             // remove trailing spaces
-            while (!result.comment.empty() && result.comment.back() == ' ')
-                result.comment.pop_back();
+            while (!comment.empty() && comment.back() == ' ')
+                comment.pop_back();
 
             // skip newline(s)
             while (starts_with(p, "\n"))
             {
                 p.skip_with_linecount();
-                result.comment += '\n';
+                comment += '\n';
             }
 
             // skip indentation
@@ -726,27 +1344,28 @@ detail::pp_doc_comment parse_c_doc_comment(position& p)
             else
             {
                 // insert extra indent again
-                result.comment += std::string(extra_indent, ' ');
+                comment += std::string(extra_indent, ' ');
                 // use minimum indent in the future
                 indent = std::min(actual_indent, indent);
             }
         }
         else
         {
-            result.comment += *p.ptr();
+            comment += *p.ptr();
             p.skip();
         }
     }
     p.skip(2u);
 
     // remove trailing star
-    if (!result.comment.empty() && result.comment.back() == '*')
-        result.comment.pop_back();
+    if (!comment.empty() && comment.back() == '*')
+        comment.pop_back();
     // remove trailing spaces
-    while (!result.comment.empty() && result.comment.back() == ' ')
-        result.comment.pop_back();
+    while (!comment.empty() && comment.back() == ' ')
+        comment.pop_back();
 
-    result.line = p.cur_line();
+    result.comment = arena.store(comment);
+    result.line    = p.cur_line();
     return result;
 }
 
@@ -763,7 +1382,7 @@ bool skip_c_comment(position& p, detail::preprocessor_output& output)
     {
         // doc comment
         p.skip();
-        output.comments.push_back(parse_c_doc_comment(p));
+        output.comments.push_back(parse_c_doc_comment(p, output.arena));
     }
     else
     {
@@ -775,9 +1394,11 @@ bool skip_c_comment(position& p, detail::preprocessor_output& output)
     return true;
 }
 
-detail::pp_doc_comment parse_cpp_doc_comment(position& p, bool end_of_line)
+detail::pp_doc_comment parse_cpp_doc_comment(position& p, bool end_of_line,
+                                             detail::pp_arena& arena)
 {
     detail::pp_doc_comment result;
+    auto&                  comment = arena.buffer();
     result.kind = end_of_line ? detail::pp_doc_comment::end_of_line : detail::pp_doc_comment::cpp;
     if (starts_with(p, " "))
         // skip one whitespace at most
@@ -785,15 +1406,16 @@ detail::pp_doc_comment parse_cpp_doc_comment(position& p, bool end_of_line)
 
     while (!starts_with(p, "\n"))
     {
-        result.comment += *p.ptr();
+        comment += *p.ptr();
         p.skip();
     }
     // don't skip newline
 
     // remove trailing spaces
-    while (!result.comment.empty() && result.comment.back() == ' ')
-        result.comment.pop_back();
-    result.line = p.cur_line();
+    while (!comment.empty() && comment.back() == ' ')
+        comment.pop_back();
+    result.comment = arena.store(comment);
+    result.line    = p.cur_line();
     return result;
 }
 
@@ -810,8 +1432,8 @@ void merge_or_add(detail::preprocessor_output& output, detail::pp_doc_comment co
         output.comments.push_back(std::move(comment));
     else
     {
-        auto& result = output.comments.back();
-        result.comment += "\n" + std::move(comment.comment);
+        auto& result   = output.comments.back();
+        result.comment = output.arena.join(result.comment, '\n', comment.comment);
         if (result.kind != detail::pp_doc_comment::end_of_line)
             result.line = comment.line;
     }
@@ -827,14 +1449,14 @@ bool skip_cpp_comment(position& p, detail::preprocessor_output& output)
     {
         // C++ style doc comment
         p.skip();
-        auto comment = parse_cpp_doc_comment(p, false);
+        auto comment = parse_cpp_doc_comment(p, false, output.arena);
         merge_or_add(output, std::move(comment));
     }
     else if (p.write_enabled() && starts_with(p, "<"))
     {
         // end of line doc comment
         p.skip();
-        auto comment = parse_cpp_doc_comment(p, true);
+        auto comment = parse_cpp_doc_comment(p, true, output.arena);
         output.comments.push_back(std::move(comment));
     }
     else
@@ -846,85 +1468,62 @@ bool skip_cpp_comment(position& p, detail::preprocessor_output& output)
     return true;
 }
 
-std::unique_ptr<cpp_macro_definition> build(std::string name, ts::optional<std::string> args,
-                                            std::string rep)
-{
-    if (!args)
-        return cpp_macro_definition::build_object_like(std::move(name), std::move(rep));
-
-    cpp_macro_definition::function_like_builder builder{std::move(name)};
-    builder.replacement(std::move(rep));
-
-    auto cur_ptr   = args.value().c_str();
-    auto cur_param = cur_ptr;
-    while (*cur_ptr)
-    {
-        while (*cur_ptr && *cur_ptr != ',')
-            ++cur_ptr;
-
-        if (*cur_param == '.')
-            builder.is_variadic();
-        else
-            builder.parameter(std::string(cur_param, cur_ptr));
-
-        if (*cur_ptr)
-            cur_param = ++cur_ptr;
-    }
-
-    return builder.finish();
-}
-
-std::unique_ptr<cpp_macro_definition> parse_macro(position& p, detail::preprocessor_output& output)
+ts::optional<detail::pp_macro> parse_macro(position& p, detail::preprocessor_output& output)
 {
     // format (at new line): #define <name> [replacement]
     // or: #define <name>(<args>) [replacement]
     // note: keep macro definition in file
     if (!p.was_newl() || !starts_with(p, "#define"))
-        return nullptr;
+        return ts::nullopt;
     // read line here for comment matching
     auto cur_line = p.cur_line();
     p.bump(std::strlen("#define"));
     bump_spaces(p, true);
 
-    std::string name;
+    // the line is complete, so the strings can be stored afterwards
+    auto name_begin = p.ptr();
     while (!starts_with(p, "(") && !starts_with(p, " ") && !starts_with(p, "\n"))
-    {
-        name += *p.ptr();
         p.bump();
-    }
+    auto name_end = p.ptr();
 
-    ts::optional<std::string> args;
+    const char *args_begin = nullptr, *args_end = nullptr;
     if (starts_with(p, "("))
     {
-        std::string str;
-        for (p.bump(); !starts_with(p, ")"); p.bump())
-            str += *p.ptr();
         p.bump();
-        args = std::move(str);
+        for (args_begin = p.ptr(); !starts_with(p, ")"); p.bump())
+            ;
+        args_end = p.ptr();
+        p.bump();
     }
 
-    std::string rep;
-    auto        in_c_comment = false;
-    for (bump_spaces(p, true); in_c_comment || !starts_with(p, "\n"); p.bump())
+    bump_spaces(p, true);
+    auto rep_begin    = p.ptr();
+    auto in_c_comment = false;
+    for (; in_c_comment || !starts_with(p, "\n"); p.bump())
     {
         if (starts_with(p, "/*"))
             in_c_comment = true;
         else if (in_c_comment && starts_with(p, "*/"))
             in_c_comment = false;
-        rep += *p.ptr();
     }
+    auto rep_end = p.ptr();
     // don't skip newline
 
     if (!p.write_enabled())
-        return nullptr;
+        return ts::nullopt;
 
-    auto result = build(std::move(name), std::move(args), std::move(rep));
+    detail::pp_macro result;
+    result.name = output.arena.store(name_begin, std::size_t(name_end - name_begin));
+    if (args_begin)
+        result.parameters = output.arena.store(args_begin, std::size_t(args_end - args_begin));
+    result.replacement = output.arena.store(rep_begin, std::size_t(rep_end - rep_begin));
     // match comment directly
-    if (!output.comments.empty() && output.comments.back().matches(*result, cur_line))
+    if (!output.comments.empty() && output.comments.back().matches(cur_line))
     {
-        result->set_comment(std::move(output.comments.back().comment));
+        result.comment = output.comments.back().comment;
         output.comments.pop_back();
     }
+    result.line = p.cur_line();
     return result;
 }
 
@@ -945,7 +1544,7 @@ ts::optional<std::string> parse_undef(position& p)
     return result;
 }
 
-type_safe::optional<detail::pp_include> parse_include(position& p)
+type_safe::optional<detail::pp_include> parse_include(position& p, detail::pp_arena& arena)
 {
     // format (at new line, literal <>): #include <filename>
     // or: #include "filename"
@@ -973,9 +1572,10 @@ type_safe::optional<detail::pp_include> parse_include(position& p)
         DEBUG_UNREACHABLE(detail::assert_handler{});
     p.bump();
 
-    std::string filename;
-    for (; !starts_with(p, "\"") && !starts_with(p, ">"); p.bump())
-        filename += *p.ptr();
+    auto filename_begin = p.ptr();
+    while (!starts_with(p, "\"") && !starts_with(p, ">"))
+        p.bump();
+    auto filename_end = p.ptr();
     DEBUG_ASSERT(starts_with(p, end_str, std::strlen(end_str)), detail::assert_handler{},
                  "bad termination");
     p.bump();
@@ -986,10 +1586,12 @@ type_safe::optional<detail::pp_include> parse_include(position& p)
     if (!p.write_enabled())
         return type_safe::nullopt;
 
-    if (filename.size() > 2u && filename[0] == '.' && (filename[1] == '/' || filename[1] == '\\'))
-        filename = filename.substr(2);
+    if (filename_end - filename_begin > 2 && filename_begin[0] == '.'
+        && (filename_begin[1] == '/' || filename_begin[1] == '\\'))
+        filename_begin += 2;
 
-    return detail::pp_include{std::move(filename), "", include_kind, p.cur_line()};
+    auto filename = arena.store(filename_begin, std::size_t(filename_end - filename_begin));
+    return detail::pp_include{filename, {}, include_kind, p.cur_line()};
 }
 
 bool bump_pragma(position& p)
@@ -1091,10 +1693,47 @@ ts::optional<linemarker> parse_linemarker(position& p)
 detail::preprocessor_output detail::preprocess(const libclang_compile_config& config,
                                                const char* path, const diagnostic_logger& logger)
 {
+    detail::preprocessor_cache cache(config, path);
+    if (auto cached = cache.load())
+    {
+        if (logger.is_verbose())
+            logger.log("preprocessor",
+                       format_diagnostic(severity::debug, source_location::make_file(path),
+                                         "using cached preprocessor output"));
+        return std::move(cached.value());
+    }
+
     detail::preprocessor_output                  result;
     std::unordered_map<std::string, std::string> indirect_includes;
 
-    auto preprocessed = clang_preprocess(config, path, logger);
+    // scan the output while the preprocessor is still running
+    preprocessor_stream     stream;
+    clang_preprocess_result preprocessed;
+    std::thread             producer([&] {
+        try
+        {
+            preprocessed = clang_preprocess(config, path, logger, bool(cache), stream);
+            stream.finish();
+        }
+        catch (...)
+        {
+            stream.finish(std::current_exception());
+        }
+    });
+    struct producer_guard
+    {
+        preprocessor_stream& stream;
+        std::thread&         producer;
+
+        ~producer_guard()
+        {
+            if (producer.joinable())
+            {
+                stream.abort();
+                producer.join();
+            }
+        }
+    } guard{stream, producer};
 
     std::string xpath;
     for (const char* cpath = path; *cpath; cpath++)
@@ -1103,13 +1742,26 @@ detail::preprocessor_output detail::preprocess(const libclang_compile_config& co
         else
             xpath += *cpath;
 
-    position p(ts::ref(result.source), preprocessed.file.c_str());
-    ts::flag in_string(false), in_char(false), first_line(true);
-    while (p)
+    input_window window(stream);
+    position     p(ts::ref(result.source), window.begin());
+    ts::flag     in_string(false), in_char(false), first_line(true);
+    while (true)
     {
-        auto next = std::strpbrk(p.ptr(), R"(\"'#/)"); // look for \, ", ', # or /
-        if (next && next > p.ptr())
+        p.rebase(window.ensure_line(p.ptr(), 0u));
+        if (!p)
+            break;
+
+        auto next = find_next(p, in_string == true, in_char == true);
+        if (!next)
+        {
+            // nothing interesting in the rest of the window
+            p.bump(std::size_t(window.end() - p.ptr()));
+            continue;
+        }
+        else if (next > p.ptr())
             p.bump(std::size_t(next - p.ptr() - 1)); // subtract one to get before that character
+        // the candidate must be fully available
+        p.rebase(window.ensure_line(p.ptr(), std::size_t(next - p.ptr())));
 
         if (starts_with(p, R"(\\)")) // starts with two backslashes
             p.bump(2u);
@@ -1126,7 +1778,7 @@ detail::preprocessor_output detail::preprocess(const libclang_compile_config& co
         }
         else if (in_string == false && starts_with(p, "'"))
         {
-            if (in_char == false && p.ptr() != preprocessed.file.c_str()
+            if (in_char == false && p.ptr() != window.begin()
                 && std::isdigit(p.ptr()[-1]))
             {
                 // It's a digit separator, not a char literal.
@@ -1146,9 +1798,9 @@ detail::preprocessor_output detail::preprocess(const libclang_compile_config& co
                 logger.log("preprocessor",
                            format_diagnostic(severity::debug,
                                              source_location::make_file(path, p.cur_line()),
-                                             "parsing macro '", macro->name(), "'"));
+                                             "parsing macro '", macro.value().name.c_str(), "'"));
 
-            result.macros.push_back({std::move(macro), p.cur_line()});
+            result.macros.push_back(std::move(macro.value()));
         }
         else if (auto undef = parse_undef(p))
         {
@@ -1162,12 +1814,12 @@ detail::preprocessor_output detail::preprocess(const libclang_compile_config& co
 
                 result.macros.erase(std::remove_if(result.macros.begin(), result.macros.end(),
                                                    [&](const pp_macro& e) {
-                                                       return e.macro->name() == undef.value();
+                                                       return e.name == undef.value();
                                                    }),
                                     result.macros.end());
             }
         }
-        else if (auto include = parse_include(p))
+        else if (auto include = parse_include(p, result.arena))
         {
             if (p.write_enabled())
             {
@@ -1175,8 +1827,8 @@ detail::preprocessor_output detail::preprocess(const libclang_compile_config& co
                     logger.log("preprocessor",
                                format_diagnostic(severity::debug,
                                                  source_location::make_file(path, p.cur_line()),
-                                                 "parsing include '", include.value().file_name,
-                                                 "'"));
+                                                 "parsing include '",
+                                                 include.value().file_name.c_str(), "'"));
 
                 result.includes.push_back(std::move(include.value()));
             }
@@ -1195,10 +1847,11 @@ detail::preprocessor_output detail::preprocess(const libclang_compile_config& co
                     if (!result.includes.empty())
                     {
                         DEBUG_ASSERT(result.includes.back().full_path.empty()
-                                         && lm.value().file.find(result.includes.back().file_name)
+                                         && lm.value().file.find(
+                                                result.includes.back().file_name.c_str())
                                                 != std::string::npos,
                                      detail::assert_handler{});
-                        result.includes.back().full_path = lm.value().file;
+                        result.includes.back().full_path = result.arena.store(lm.value().file);
                     }
                 }
                 else
@@ -1230,6 +1883,7 @@ detail::preprocessor_output detail::preprocess(const libclang_compile_config& co
                     // just skip all builtin macro stuff until we reach the file again
                     auto closing_line_marker = std::string("# 1 \"") + xpath + "\" 2\n";
 
+                    p.rebase(window.ensure(p.ptr(), 0u, closing_line_marker.c_str()));
                     auto ptr = std::strstr(p.ptr(), closing_line_marker.c_str());
                     DEBUG_ASSERT(ptr, detail::assert_handler{});
                     p.skip(std::size_t(ptr - p.ptr()));
@@ -1263,22 +1917,467 @@ detail::preprocessor_output detail::preprocess(const libclang_compile_config& co
         for (auto& include : result.includes)
             if (include.full_path.empty())
             {
-                auto last_sep = include.file_name.find_last_of("/\\");
+                auto file_name = include.file_name.str();
+                auto last_sep  = file_name.find_last_of("/\\");
 
                 auto iter = indirect_includes.find(last_sep == std::string::npos
-                                                       ? include.file_name
-                                                       : include.file_name.substr(last_sep + 1u));
+                                                       ? file_name
+                                                       : file_name.substr(last_sep + 1u));
                 if (iter != indirect_includes.end())
-                    include.full_path = iter->second;
+                    include.full_path = result.arena.store(iter->second);
                 else
                     logger.log("preprocessor",
                                format_diagnostic(severity::warning,
                                                  source_location::make_file(path, include.line),
                                                  "unable to retrieve full path for include '",
-                                                 include.file_name,
+                                                 file_name,
                                                  "' (please file a bug report)"));
             }
     }
 
+    producer.join();
+    cache.store(result, preprocessed.dependencies);
+    return result;
+}
+
+namespace
+{
+//=== in-process preprocessing ===//
+struct line_range
+{
+    unsigned begin, end;
+};
+
+std::vector<line_range> get_skipped_lines(const detail::cxtranslation_unit& tu, CXFile file)
+{
+    std::vector<line_range> result;
+
+    auto ranges = clang_getSkippedRanges(tu.get(), file);
+    for (auto i = 0u; i != ranges->count; ++i)
+    {
+        line_range range;
+        clang_getSpellingLocation(clang_getRangeStart(ranges->ranges[i]), nullptr, &range.begin,
+                                  nullptr, nullptr);
+        clang_getSpellingLocation(clang_getRangeEnd(ranges->ranges[i]), nullptr, &range.end,
+                                  nullptr, nullptr);
+        result.push_back(range);
+    }
+    clang_disposeSourceRangeList(ranges);
+
+    return result;
+}
+
+bool is_skipped(const std::vector<line_range>& skipped, unsigned line)
+{
+    return std::any_of(skipped.begin(), skipped.end(), [&](const line_range& range) {
+        return range.begin <= line && line <= range.end;
+    });
+}
+
+bool at_directive(const position& p, const char* begin)
+{
+    // format: <spaces> # <directive>
+    if (!starts_with(p, "#"))
+        return false;
+
+    auto ptr = p.ptr();
+    while (ptr != begin && ptr[-1] == ' ')
+        --ptr;
+    return ptr == begin || ptr[-1] == '\n';
+}
+
+std::string bump_directive(position& p)
+{
+    // format: # <directive> <stuff..>\n, lines can be continued with a backslash
+    p.bump();
+    bump_spaces(p, true);
+
+    std::string result;
+    while (p && !starts_with(p, "\n"))
+    {
+        if (starts_with(p, "\\\n"))
+        {
+            p.bump(2u);
+            result += ' ';
+        }
+        else if (starts_with(p, "/*"))
+        {
+            // C comments can span multiple lines
+            while (p && !starts_with(p, "*/"))
+                p.bump();
+            if (p)
+                p.bump(2u);
+            result += ' ';
+        }
+        else if (starts_with(p, "//"))
+        {
+            while (p && !starts_with(p, "\n"))
+                p.bump();
+        }
+        else
+        {
+            result += *p.ptr();
+            p.bump();
+        }
+    }
+    // don't skip newline
+
+    return result;
+}
+
+struct pp_undef
+{
+    std::string name;
+    unsigned    line;
+};
+
+// collects doc comments and undefs, as those are not part of the preprocessing record
+std::vector<pp_undef> scan_source(detail::preprocessor_output& output)
+{
+    std::vector<pp_undef> result;
+
+    std::string scratch;
+    position    p(ts::ref(scratch), output.source.c_str());
+    ts::flag    in_string(false), in_char(false);
+    while (p)
+    {
+        auto next = find_next(p, in_string == true, in_char == true);
+        if (next && next > p.ptr())
+            p.bump(std::size_t(next - p.ptr() - 1)); // subtract one to get before that character
+
+        if (starts_with(p, R"(\\)") || starts_with(p, R"(\")") || starts_with(p, R"(\')"))
+            p.bump(2u);
+        else if (in_char == false && starts_with(p, R"(")"))
+        {
+            p.bump();
+            in_string.toggle();
+        }
+        else if (in_string == false && starts_with(p, "'"))
+        {
+            if (in_char == true || p.ptr() == output.source.c_str() || !std::isdigit(p.ptr()[-1]))
+                // not a digit separator
+                in_char.toggle();
+            p.bump();
+        }
+        else if (in_string == true || in_char == true)
+            p.bump();
+        else if (at_directive(p, output.source.c_str()))
+        {
+            auto line      = p.cur_line();
+            auto directive = bump_directive(p);
+            if (directive.compare(0, 6, "undef ") == 0)
+            {
+                auto name_begin = directive.find_first_not_of(' ', 6u);
+                auto name_end   = directive.find(' ', name_begin);
+                if (name_begin != std::string::npos)
+                    result.push_back({directive.substr(name_begin, name_end - name_begin), line});
+            }
+        }
+        else if (skip_c_comment(p, output))
+            continue;
+        else if (skip_cpp_comment(p, output))
+            continue;
+        else
+            p.bump();
+    }
+
     return result;
 }
+
+unsigned get_offset(const CXSourceLocation& loc)
+{
+    unsigned offset;
+    clang_getSpellingLocation(loc, nullptr, nullptr, nullptr, &offset);
+    return offset;
+}
+
+unsigned get_line(const CXCursor& cur)
+{
+    unsigned line;
+    clang_getPresumedLocation(clang_getCursorLocation(cur), nullptr, &line, nullptr);
+    return line;
+}
+
+bool is_identifier_char(char c)
+{
+    return c == '_' || std::isalnum(static_cast<unsigned char>(c));
+}
+
+// returns the replacement of the object-like macro expanded at the offset
+type_safe::optional<std::string> get_expanded_macro(const detail::cxtranslation_unit& tu,
+                                                    CXFile file, unsigned offset)
+{
+    auto cur = clang_getCursor(tu.get(), clang_getLocationForOffset(tu.get(), file, offset));
+    if (clang_getCursorKind(cur) != CXCursor_MacroExpansion)
+        return type_safe::nullopt;
+    auto definition = clang_getCursorReferenced(cur);
+    if (clang_Cursor_isNull(definition) || clang_Cursor_isMacroFunctionLike(definition))
+        return type_safe::nullopt;
+
+    CXToken* tokens;
+    unsigned no_tokens;
+    clang_tokenize(tu.get(), clang_getCursorExtent(definition), &tokens, &no_tokens);
+    // the first token is the name
+    std::string result;
+    for (auto i = 1u; i < no_tokens; ++i)
+        result += detail::cxstring(clang_getTokenSpelling(tu.get(), tokens[i])).c_str();
+    clang_disposeTokens(tu.get(), tokens, no_tokens);
+    return result;
+}
+
+// returns the replacement of the object-like macro defined in the file before the line
+type_safe::optional<std::string> get_defined_macro(const detail::preprocessor_output& output,
+                                                   const std::string& name, unsigned line)
+{
+    for (auto iter = output.macros.rbegin(); iter != output.macros.rend(); ++iter)
+        if (iter->line < line && iter->name == name.c_str())
+        {
+            if (iter->parameters)
+                return type_safe::nullopt;
+            return std::string(iter->replacement.c_str());
+        }
+    return type_safe::nullopt;
+}
+
+// returns the kind of the include directive starting at the offset,
+// the macros of a computed include are expanded to find it
+type_safe::optional<cpp_include_kind> get_include_kind(const detail::preprocessor_output& output,
+                                                       const detail::cxtranslation_unit& tu,
+                                                       CXFile file, unsigned offset,
+                                                       unsigned line)
+{
+    auto begin = output.source.c_str() + offset;
+    auto ptr   = begin;
+    // skip the #, the directive name and the whitespace after it
+    ptr += std::strspn(ptr, "# ");
+    while (is_identifier_char(*ptr))
+        ++ptr;
+    ptr += std::strspn(ptr, " ");
+
+    std::string text(ptr, std::strcspn(ptr, "\n"));
+    // limit the depth to guard against recursive macros
+    for (auto depth = 0; depth != 16; ++depth)
+    {
+        auto first = text.find_first_not_of(' ');
+        if (first == std::string::npos)
+            break;
+        else if (text[first] == '<')
+            return cpp_include_kind::system;
+        else if (text[first] == '"')
+            return cpp_include_kind::local;
+
+        auto last = first;
+        while (last < text.size() && is_identifier_char(text[last]))
+            ++last;
+        auto name = text.substr(first, last - first);
+        if (name.empty())
+            break;
+
+        // the macro of the directive itself can be looked up in the translation unit
+        auto name_offset = offset + unsigned(ptr - begin) + unsigned(first);
+        auto replacement
+            = depth == 0 ? get_expanded_macro(tu, file, name_offset) : type_safe::nullopt;
+        if (!replacement)
+            replacement = get_defined_macro(output, name, line);
+        if (!replacement)
+            break;
+        text = replacement.value();
+    }
+
+    return type_safe::nullopt;
+}
+
+type_safe::optional<detail::pp_include> get_include(detail::preprocessor_output&     output,
+                                                    const detail::cxtranslation_unit& tu,
+                                                    CXFile file, const CXCursor& cur)
+{
+    detail::cxstring spelling(clang_getCursorSpelling(cur));
+    auto             filename = spelling.c_str();
+    auto             size     = spelling.length();
+    if (size > 2u && filename[0] == '.' && (filename[1] == '/' || filename[1] == '\\'))
+    {
+        filename += 2;
+        size -= 2u;
+    }
+
+    detail::pp_string full_path;
+    if (auto file = clang_getIncludedFile(cur))
+    {
+        detail::cxstring file_name(clang_getFileName(file));
+        full_path = output.arena.store(file_name.c_str(), file_name.length());
+    }
+
+    auto line = get_line(cur);
+    auto kind = get_include_kind(output, tu, file,
+                                 get_offset(clang_getRangeStart(clang_getCursorExtent(cur))), line);
+    if (!kind)
+        return type_safe::nullopt;
+
+    return detail::pp_include{output.arena.store(filename, size), full_path, kind.value(), line};
+}
+
+detail::pp_macro get_macro(const detail::cxtranslation_unit& tu, const CXCursor& cur,
+                           unsigned line, detail::pp_arena& arena)
+{
+    // format: <name> [replacement]
+    // or: <name>(<args>) [replacement]
+    auto extent = clang_getCursorExtent(cur);
+    auto end    = get_offset(clang_getRangeEnd(extent));
+
+    CXToken* tokens;
+    unsigned no_tokens;
+    clang_tokenize(tu.get(), extent, &tokens, &no_tokens);
+
+    auto spelling = [&](unsigned i) {
+        return detail::cxstring(clang_getTokenSpelling(tu.get(), tokens[i]));
+    };
+    auto begin_of = [&](unsigned i) {
+        return get_offset(clang_getRangeStart(clang_getTokenExtent(tu.get(), tokens[i])));
+    };
+    auto end_of = [&](unsigned i) {
+        return get_offset(clang_getRangeEnd(clang_getTokenExtent(tu.get(), tokens[i])));
+    };
+
+    // might include tokens after the definition
+    while (no_tokens > 0u && begin_of(no_tokens - 1u) >= end)
+        --no_tokens;
+    DEBUG_ASSERT(no_tokens > 0u, detail::assert_handler{});
+
+    detail::pp_macro result;
+    result.line = line;
+
+    auto name   = spelling(0u);
+    result.name = arena.store(name.c_str(), name.length());
+    auto i      = 1u;
+
+    if (clang_Cursor_isMacroFunctionLike(cur))
+    {
+        DEBUG_ASSERT(i < no_tokens && spelling(i) == "(", detail::assert_handler{});
+        auto& args = arena.buffer();
+        for (++i; i < no_tokens; ++i)
+        {
+            auto token = spelling(i);
+            if (token == ")")
+                break;
+            args += token.c_str();
+        }
+        ++i;
+        result.parameters = arena.store(args);
+    }
+
+    // single space between tokens separated by whitespace, like clang -E
+    auto& rep = arena.buffer();
+    for (auto first = i; i < no_tokens; ++i)
+    {
+        if (i != first && begin_of(i) != end_of(i - 1u))
+            rep += ' ';
+        rep += spelling(i).c_str();
+    }
+    result.replacement = arena.store(rep);
+
+    clang_disposeTokens(tu.get(), tokens, no_tokens);
+    return result;
+}
+} // namespace
+
+detail::preprocessor_output detail::read_source(const char* path)
+{
+    std::ifstream file(path, std::ios_base::binary);
+    if (!file)
+        throw libclang_error("preprocessor: file '" + std::string(path) + "' doesn't exist");
+
+    detail::preprocessor_output result;
+    for (auto iter = std::istreambuf_iterator<char>(file);
+         iter != std::istreambuf_iterator<char>{}; ++iter)
+        if (*iter == '\t')
+            result.source += ' '; // convert to single spaces
+        else if (*iter != '\r')
+            result.source += *iter;
+    if (result.source.empty() || result.source.back() != '\n')
+        // comment parsing requires a newline at the end
+        result.source += '\n';
+
+    return result;
+}
+
+void detail::preprocess(preprocessor_output& output, const cxtranslation_unit& tu, CXFile file,
+                        const char* path, const diagnostic_logger& logger)
+{
+    auto undefs  = scan_source(output);
+    auto skipped = get_skipped_lines(tu, file);
+
+    // remove comments in conditionally skipped code
+    output.comments.erase(std::remove_if(output.comments.begin(), output.comments.end(),
+                                         [&](const pp_doc_comment& comment) {
+                                             return is_skipped(skipped, comment.line);
+                                         }),
+                          output.comments.end());
+
+    detail::visit_tu(tu, file, output.source, path, [&](const CXCursor& cur) {
+        auto kind = clang_getCursorKind(cur);
+        if (kind == CXCursor_InclusionDirective)
+        {
+            auto include = get_include(output, tu, file, cur);
+            if (!include)
+            {
+                logger.log("preprocessor",
+                           format_diagnostic(severity::warning,
+                                             source_location::make_file(path, get_line(cur)),
+                                             "unable to expand computed include, ignoring it"));
+                return;
+            }
+            if (logger.is_verbose())
+                logger.log("preprocessor",
+                           format_diagnostic(severity::debug,
+                                             source_location::make_file(path,
+                                                                        include.value().line),
+                                             "parsing include '",
+                                             include.value().file_name.c_str(), "'"));
+
+            output.includes.push_back(std::move(include.value()));
+        }
+        else if (kind == CXCursor_MacroDefinition)
+        {
+            auto line  = get_line(cur);
+            auto macro = get_macro(tu, cur, line, output.arena);
+            if (logger.is_verbose())
+                logger.log("preprocessor",
+                           format_diagnostic(severity::debug,
+                                             source_location::make_file(path, line),
+                                             "parsing macro '", macro.name.c_str(), "'"));
+
+            // match comment directly
+            auto comment = std::find_if(output.comments.begin(), output.comments.end(),
+                                        [&](pp_doc_comment& c) {
+                                            return c.kind != pp_doc_comment::end_of_line
+                                                   && c.matches(line);
+                                        });
+            if (comment != output.comments.end())
+            {
+                macro.comment = comment->comment;
+                output.comments.erase(comment);
+            }
+
+            output.macros.push_back(std::move(macro));
+        }
+    });
+
+    for (auto& undef : undefs)
+    {
+        if (is_skipped(skipped, undef.line))
+            continue;
+
+        if (logger.is_verbose())
+            logger.log("preprocessor",
+                       format_diagnostic(severity::debug,
+                                         source_location::make_file(path, undef.line),
+                                         "undefining macro '", undef.name, "'"));
+
+        output.macros.erase(std::remove_if(output.macros.begin(), output.macros.end(),
+                                           [&](const pp_macro& e) {
+                                               return e.line < undef.line
+                                                      && e.name == undef.name;
+                                           }),
+                            output.macros.end());
+    }
+}
@@ -4,30 +4,155 @@
 #ifndef CPPAST_PREPROCESSOR_HPP_INCLUDED
 #define CPPAST_PREPROCESSOR_HPP_INCLUDED
 
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <type_safe/optional.hpp>
+
 #include <cppast/cpp_preprocessor.hpp>
 #include <cppast/libclang_parser.hpp>
 
+#include "raii_wrapper.hpp"
+
 namespace cppast
 {
 namespace detail
 {
+    // a string stored in a pp_arena, it is always null-terminated
+    class pp_string
+    {
+    public:
+        pp_string() noexcept : data_(""), size_(0u) {}
+
+        pp_string(const char* data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+        const char* c_str() const noexcept
+        {
+            return data_;
+        }
+
+        std::size_t size() const noexcept
+        {
+            return size_;
+        }
+
+        bool empty() const noexcept
+        {
+            return size_ == 0u;
+        }
+
+        const char* begin() const noexcept
+        {
+            return data_;
+        }
+
+        const char* end() const noexcept
+        {
+            return data_ + size_;
+        }
+
+        // copies the string, e.g. when it becomes part of the AST
+        std::string str() const
+        {
+            return std::string(data_, size_);
+        }
+
+    private:
+        const char* data_;
+        std::size_t size_;
+    };
+
+    inline bool operator==(const pp_string& lhs, const pp_string& rhs) noexcept
+    {
+        return lhs.size() == rhs.size() && std::memcmp(lhs.c_str(), rhs.c_str(), lhs.size()) == 0;
+    }
+
+    inline bool operator==(const pp_string& lhs, const char* rhs) noexcept
+    {
+        return std::strlen(rhs) == lhs.size() && std::memcmp(lhs.c_str(), rhs, lhs.size()) == 0;
+    }
+
+    inline bool operator==(const pp_string& lhs, const std::string& rhs) noexcept
+    {
+        return rhs.size() == lhs.size() && std::memcmp(lhs.c_str(), rhs.data(), lhs.size()) == 0;
+    }
+
+    // owns all strings of a preprocessor output
+    // they are allocated in big blocks which are never moved or freed before the arena is
+    class pp_arena
+    {
+    public:
+        pp_arena() noexcept : cur_(nullptr), remaining_(0u) {}
+
+        pp_arena(pp_arena&& other) noexcept
+        : blocks_(std::move(other.blocks_)), cur_(other.cur_), remaining_(other.remaining_)
+        {
+            other.cur_       = nullptr;
+            other.remaining_ = 0u;
+        }
+
+        pp_arena& operator=(pp_arena&& other) noexcept
+        {
+            blocks_          = std::move(other.blocks_);
+            cur_             = other.cur_;
+            remaining_       = other.remaining_;
+            other.cur_       = nullptr;
+            other.remaining_ = 0u;
+            return *this;
+        }
+
+        // returns a copy of the string that lives as long as the arena
+        pp_string store(const char* str, std::size_t size);
+
+        pp_string store(const std::string& str)
+        {
+            return store(str.data(), str.size());
+        }
+
+        // returns the concatenation of the strings separated by sep,
+        // lhs and rhs must no longer be used afterwards
+        pp_string join(const pp_string& lhs, char sep, const pp_string& rhs);
+
+        // returns an empty buffer to build a string before storing it,
+        // the buffer is reused by the next call, so the allocation is amortized
+        std::string& buffer() noexcept
+        {
+            buffer_.clear();
+            return buffer_;
+        }
+
+    private:
+        std::vector<std::unique_ptr<char[]>> blocks_;
+        char*                                cur_;
+        std::size_t                          remaining_;
+        std::string                          buffer_;
+    };
+
     struct pp_macro
     {
-        std::unique_ptr<cpp_macro_definition> macro;
-        unsigned                              line;
+        pp_string                      name;
+        type_safe::optional<pp_string> parameters; // comma separated, if function-like
+        pp_string                      replacement;
+        type_safe::optional<pp_string> comment;
+        unsigned                       line;
+
+        // creates the entity for the AST, copies the strings
+        std::unique_ptr<cpp_macro_definition> build() const;
     };
 
     struct pp_include
     {
-        std::string      file_name, full_path;
+        pp_string        file_name, full_path;
         cpp_include_kind kind;
         unsigned         line;
     };
 
     struct pp_doc_comment
     {
-        std::string comment;
-        unsigned    line;
+        pp_string comment;
+        unsigned  line;
         enum
         {
             c,
@@ -35,11 +160,13 @@ namespace detail
             end_of_line,
         } kind;
 
-        bool matches(const cpp_entity& e, unsigned line);
+        // whether the comment belongs to an entity starting at the given line
+        bool matches(unsigned line) const noexcept;
     };
 
     struct preprocessor_output
     {
+        pp_arena                    arena; // owns all strings except the source
         std::string                 source;
         std::vector<pp_include>     includes;
         std::vector<pp_macro>       macros;
@@ -48,6 +175,14 @@ namespace detail
 
     preprocessor_output preprocess(const libclang_compile_config& config, const char* path,
                                    const diagnostic_logger& logger);
+
+    // in-process preprocessing:
+    // first read the source as-is to create the translation unit from,
+    // then fill in includes, macros and comments using its preprocessing record
+    preprocessor_output read_source(const char* path);
+
+    void preprocess(preprocessor_output& output, const cxtranslation_unit& tu, CXFile file,
+                    const char* path, const diagnostic_logger& logger);
 } // namespace detail
 } // namespace cppast
 
@@ -0,0 +1,582 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#include "preprocessor_cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+
+#include <cppast/cpp_entity_index.hpp>
+
+#include "file_metadata.hpp"
+
+#ifdef _WIN32
+#    include <direct.h>
+#    include <process.h>
+#    include <sys/utime.h>
+#    include <windows.h>
+#else
+#    include <dirent.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#    include <utime.h>
+#endif
+
+using namespace cppast;
+namespace ts = type_safe;
+
+namespace
+{
+// must be changed whenever the format or the preprocessor output changes
+const char cache_magic[] = "cppast preprocessor cache 3\n";
+
+//=== hashing ===//
+class hasher
+{
+public:
+    hasher() noexcept : hash_(detail::fnv_basis) {}
+
+    void add(const char* data, std::size_t size) noexcept
+    {
+        for (auto end = data + size; data != end; ++data)
+            hash_ = (hash_ ^ static_cast<unsigned char>(*data)) * detail::fnv_prime;
+    }
+
+    void add(const std::string& str) noexcept
+    {
+        add(str.c_str(), str.size() + 1u); // include null terminator as separator
+    }
+
+    detail::hash_type get() const noexcept
+    {
+        return hash_;
+    }
+
+private:
+    detail::hash_type hash_;
+};
+
+bool read_file(const std::string& path, std::string& result)
+{
+    std::ifstream file(path, std::ios_base::binary);
+    if (!file)
+        return false;
+
+    result.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>{});
+    return true;
+}
+
+ts::optional<detail::hash_type> hash_file(const std::string& path, bool revalidate)
+{
+    auto metadata = detail::get_file_metadata(path, revalidate);
+    if (!metadata->exists)
+        return ts::nullopt;
+    return metadata->hash;
+}
+
+std::string to_hex(detail::hash_type hash)
+{
+    std::string result;
+    for (auto i = 0; i != 16; ++i, hash >>= 4)
+        result.insert(result.begin(), "0123456789abcdef"[hash & 0xF]);
+    return result;
+}
+
+//=== serialization ===//
+class entry_writer
+{
+public:
+    void write(std::uint64_t value)
+    {
+        for (auto i = 0; i != 8; ++i, value >>= 8)
+            buffer_ += char(value & 0xFF);
+    }
+
+    void write(const std::string& str)
+    {
+        write(str.size());
+        buffer_ += str;
+    }
+
+    void write(const detail::pp_string& str)
+    {
+        write(str.size());
+        buffer_.append(str.begin(), str.end());
+    }
+
+    void write_magic()
+    {
+        buffer_ += cache_magic;
+    }
+
+    const std::string& buffer() const noexcept
+    {
+        return buffer_;
+    }
+
+private:
+    std::string buffer_;
+};
+
+class entry_reader
+{
+public:
+    explicit entry_reader(const std::string& buffer)
+    : ptr_(buffer.data()), end_(buffer.data() + buffer.size()), valid_(true)
+    {}
+
+    std::uint64_t read_uint()
+    {
+        if (std::size_t(end_ - ptr_) < 8u)
+        {
+            valid_ = false;
+            return 0u;
+        }
+
+        std::uint64_t result = 0u;
+        for (auto i = 0; i != 8; ++i)
+            result |= std::uint64_t(static_cast<unsigned char>(*ptr_++)) << (8 * i);
+        return result;
+    }
+
+    unsigned read_unsigned()
+    {
+        return unsigned(read_uint());
+    }
+
+    // number of elements that need at least 8 bytes each
+    std::size_t read_count()
+    {
+        auto result = read_uint();
+        if (result > std::uint64_t(end_ - ptr_) / 8u)
+        {
+            valid_ = false;
+            return 0u;
+        }
+        return std::size_t(result);
+    }
+
+    std::string read_string()
+    {
+        auto size = read_uint();
+        if (size > std::uint64_t(end_ - ptr_))
+        {
+            valid_ = false;
+            return "";
+        }
+
+        std::string result(ptr_, std::size_t(size));
+        ptr_ += size;
+        return result;
+    }
+
+    detail::pp_string read_string(detail::pp_arena& arena)
+    {
+        auto size = read_uint();
+        if (size > std::uint64_t(end_ - ptr_))
+        {
+            valid_ = false;
+            return {};
+        }
+
+        auto result = arena.store(ptr_, std::size_t(size));
+        ptr_ += size;
+        return result;
+    }
+
+    void read_optional(detail::pp_arena& arena, ts::optional<detail::pp_string>& result)
+    {
+        if (read_uint() != 0u)
+            result = read_string(arena);
+    }
+
+    bool read_magic()
+    {
+        auto size = sizeof(cache_magic) - 1u;
+        if (std::size_t(end_ - ptr_) < size || std::string(ptr_, size) != cache_magic)
+            valid_ = false;
+        else
+            ptr_ += size;
+        return valid_;
+    }
+
+    bool valid() const noexcept
+    {
+        return valid_;
+    }
+
+private:
+    const char *ptr_, *end_;
+    bool        valid_;
+};
+
+void write_macro(entry_writer& writer, const detail::pp_macro& macro)
+{
+    writer.write(macro.name);
+    writer.write(macro.parameters.has_value());
+    if (macro.parameters)
+        writer.write(macro.parameters.value());
+    writer.write(macro.replacement);
+    writer.write(macro.comment.has_value());
+    if (macro.comment)
+        writer.write(macro.comment.value());
+    writer.write(macro.line);
+}
+
+detail::pp_macro read_macro(entry_reader& reader, detail::pp_arena& arena)
+{
+    detail::pp_macro result;
+    result.name = reader.read_string(arena);
+    reader.read_optional(arena, result.parameters);
+    result.replacement = reader.read_string(arena);
+    reader.read_optional(arena, result.comment);
+    result.line = reader.read_unsigned();
+    return result;
+}
+
+//=== file system ===//
+std::string get_temporary_suffix()
+{
+    static std::atomic<unsigned> counter(0u);
+#ifdef _WIN32
+    auto pid = _getpid();
+#else
+    auto pid = getpid();
+#endif
+    return "." + std::to_string(pid) + "-" + std::to_string(++counter) + ".tmp";
+}
+
+void create_directory(const std::string& directory)
+{
+    // fails if it already exists, which is fine
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0777);
+#endif
+}
+
+void touch(const std::string& file)
+{
+    // update modification time for LRU eviction
+#ifdef _WIN32
+    _utime(file.c_str(), nullptr);
+#else
+    utime(file.c_str(), nullptr);
+#endif
+}
+
+struct cache_entry
+{
+    std::string   path;
+    std::uint64_t size, time;
+};
+
+bool is_cache_entry(const std::string& file_name)
+{
+    const std::string extension = ".ppcache";
+    return file_name.size() > extension.size()
+           && file_name.compare(file_name.size() - extension.size(), extension.size(), extension)
+                  == 0;
+}
+
+std::vector<cache_entry> get_cache_entries(const std::string& directory)
+{
+    std::vector<cache_entry> result;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    auto             handle = FindFirstFileA((directory + "\\*.ppcache").c_str(), &data);
+    if (handle == INVALID_HANDLE_VALUE)
+        return result;
+
+    do
+    {
+        cache_entry entry;
+        entry.path = directory + "\\" + data.cFileName;
+        entry.size = (std::uint64_t(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+        entry.time = (std::uint64_t(data.ftLastWriteTime.dwHighDateTime) << 32)
+                     | data.ftLastWriteTime.dwLowDateTime;
+        result.push_back(std::move(entry));
+    } while (FindNextFileA(handle, &data));
+    FindClose(handle);
+#else
+    auto dir = opendir(directory.c_str());
+    if (!dir)
+        return result;
+
+    while (auto file = readdir(dir))
+    {
+        if (!is_cache_entry(file->d_name))
+            continue;
+
+        cache_entry entry;
+        entry.path = directory + "/" + file->d_name;
+
+        struct stat info;
+        if (stat(entry.path.c_str(), &info) != 0)
+            // removed in the meantime
+            continue;
+        entry.size = std::uint64_t(info.st_size);
+        entry.time = std::uint64_t(info.st_mtime);
+        result.push_back(std::move(entry));
+    }
+    closedir(dir);
+#endif
+    return result;
+}
+
+void evict(const std::string& directory, std::size_t max_size)
+{
+    auto entries = get_cache_entries(directory);
+
+    std::uint64_t size = 0u;
+    for (auto& entry : entries)
+        size += entry.size;
+    if (size <= max_size)
+        return;
+
+    // remove least recently used entries first
+    std::sort(entries.begin(), entries.end(),
+              [](const cache_entry& a, const cache_entry& b) { return a.time < b.time; });
+    for (auto& entry : entries)
+    {
+        if (size <= max_size)
+            break;
+
+        // might fail if another process removed it already
+        std::remove(entry.path.c_str());
+        size -= entry.size;
+    }
+}
+} // namespace
+
+detail::preprocessor_cache::preprocessor_cache(const libclang_compile_config& config,
+                                               const char*                   path)
+: directory_(libclang_compile_config_access::preprocessor_cache_directory(config)),
+  max_size_(libclang_compile_config_access::preprocessor_cache_size(config)),
+  revalidate_(libclang_compile_config_access::revalidate_file_metadata(config))
+{
+    if (directory_.empty())
+        return;
+    auto content_hash = hash_file(path, revalidate_);
+    if (!content_hash)
+        return;
+
+    hasher hash;
+    hash.add(cache_magic);
+    hash.add(libclang_compile_config_access::clang_binary(config));
+    for (auto& flag : libclang_compile_config_access::flags(config))
+        hash.add(flag);
+    hash.add(config.use_c() ? "c" : "c++");
+    hash.add(libclang_compile_config_access::fast_preprocessing(config) ? "fast" : "normal");
+    hash.add(libclang_compile_config_access::remove_comments_in_macro(config) ? "-C" : "-CC");
+    hash.add(path);
+    hash.add(to_hex(content_hash.value()));
+
+    file_ = directory_ + "/" + to_hex(hash.get()) + ".ppcache";
+}
+
+ts::optional<detail::preprocessor_output> detail::preprocessor_cache::load() const
+{
+    std::string buffer;
+    if (!*this || !read_file(file_, buffer))
+        return ts::nullopt;
+
+    entry_reader reader(buffer);
+    if (!reader.read_magic())
+        return ts::nullopt;
+
+    for (auto no_dependencies = reader.read_count(); no_dependencies != 0u; --no_dependencies)
+    {
+        auto path = reader.read_string();
+        auto hash = reader.read_uint();
+        if (!reader.valid())
+            return ts::nullopt;
+
+        auto cur_hash = hash_file(path, revalidate_);
+        if (!cur_hash || cur_hash.value() != hash)
+            // file has been changed or removed
+            return ts::nullopt;
+    }
+
+    preprocessor_output result;
+    result.source = reader.read_string();
+
+    for (auto no_includes = reader.read_count(); no_includes != 0u; --no_includes)
+    {
+        pp_include include;
+        include.file_name = reader.read_string(result.arena);
+        include.full_path = reader.read_string(result.arena);
+        include.kind = reader.read_uint() == 0u ? cpp_include_kind::system : cpp_include_kind::local;
+        include.line = reader.read_unsigned();
+        result.includes.push_back(std::move(include));
+    }
+
+    for (auto no_macros = reader.read_count(); no_macros != 0u && reader.valid(); --no_macros)
+        result.macros.push_back(read_macro(reader, result.arena));
+
+    for (auto no_comments = reader.read_count(); no_comments != 0u; --no_comments)
+    {
+        pp_doc_comment comment;
+        comment.comment = reader.read_string(result.arena);
+        comment.line    = reader.read_unsigned();
+        switch (reader.read_uint())
+        {
+        case 0u:
+            comment.kind = pp_doc_comment::c;
+            break;
+        case 1u:
+            comment.kind = pp_doc_comment::cpp;
+            break;
+        default:
+            comment.kind = pp_doc_comment::end_of_line;
+            break;
+        }
+        result.comments.push_back(std::move(comment));
+    }
+
+    if (!reader.valid())
+        return ts::nullopt;
+
+    touch(file_);
+    return result;
+}
+
+void detail::preprocessor_cache::store(const preprocessor_output&      output,
+                                       const std::vector<std::string>& dependencies) const
+{
+    if (!*this)
+        return;
+
+    entry_writer writer;
+    writer.write_magic();
+
+    writer.write(dependencies.size());
+    for (auto& dependency : dependencies)
+    {
+        auto hash = hash_file(dependency, revalidate_);
+        if (!hash)
+            // can't validate entry
+            return;
+
+        writer.write(dependency);
+        writer.write(hash.value());
+    }
+
+    writer.write(output.source);
+
+    writer.write(output.includes.size());
+    for (auto& include : output.includes)
+    {
+        writer.write(include.file_name);
+        writer.write(include.full_path);
+        writer.write(include.kind == cpp_include_kind::system ? 0u : 1u);
+        writer.write(include.line);
+    }
+
+    writer.write(output.macros.size());
+    for (auto& macro : output.macros)
+        write_macro(writer, macro);
+
+    writer.write(output.comments.size());
+    for (auto& comment : output.comments)
+    {
+        writer.write(comment.comment);
+        writer.write(comment.line);
+        switch (comment.kind)
+        {
+        case pp_doc_comment::c:
+            writer.write(0u);
+            break;
+        case pp_doc_comment::cpp:
+            writer.write(1u);
+            break;
+        case pp_doc_comment::end_of_line:
+            writer.write(2u);
+            break;
+        }
+    }
+
+    // write to a temporary file first and rename it,
+    // so concurrent processes never see partially written entries
+    create_directory(directory_);
+    auto temporary = file_ + get_temporary_suffix();
+    {
+        std::ofstream file(temporary, std::ios_base::binary);
+        file.write(writer.buffer().data(), std::streamsize(writer.buffer().size()));
+        if (!file)
+        {
+            file.close();
+            std::remove(temporary.c_str());
+            return;
+        }
+    }
+    if (std::rename(temporary.c_str(), file_.c_str()) != 0)
+    {
+        // rename() doesn't replace existing files on Windows
+        std::remove(file_.c_str());
+        if (std::rename(temporary.c_str(), file_.c_str()) != 0)
+            std::remove(temporary.c_str());
+    }
+
+    evict(directory_, max_size_);
+}
+
+std::vector<std::string> detail::parse_dependency_file(const std::string& file)
+{
+    // format: <target>: <dependency> <dependency>...
+    // where lines can be continued with a backslash
+    std::vector<std::string> result;
+
+    std::string content;
+    if (!read_file(file, content))
+        return result;
+
+    // skip target, ':' followed by whitespace ends it (':' alone might be a drive letter)
+    auto ptr = content.c_str();
+    auto is_space = [](char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; };
+    while (*ptr && !(ptr[0] == ':' && (is_space(ptr[1]) || ptr[1] == '\0')))
+        ++ptr;
+    if (*ptr)
+        ++ptr;
+
+    std::string cur;
+    while (*ptr)
+    {
+        if (ptr[0] == '\\' && ptr[1] == '\n')
+            // line continuation
+            ptr += 2;
+        else if (ptr[0] == '\\' && ptr[1] == '\r' && ptr[2] == '\n')
+            ptr += 3;
+        else if (ptr[0] == '\\' && (ptr[1] == ' ' || ptr[1] == '#'))
+        {
+            // escaped character
+            cur += ptr[1];
+            ptr += 2;
+        }
+        else if (ptr[0] == '$' && ptr[1] == '$')
+        {
+            cur += '$';
+            ptr += 2;
+        }
+        else if (is_space(*ptr))
+        {
+            if (!cur.empty())
+                result.push_back(std::move(cur));
+            cur.clear();
+            ++ptr;
+        }
+        else
+            cur += *ptr++;
+    }
+    if (!cur.empty())
+        result.push_back(std::move(cur));
+
+    return result;
+}
@@ -0,0 +1,48 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#ifndef CPPAST_PREPROCESSOR_CACHE_HPP_INCLUDED
+#define CPPAST_PREPROCESSOR_CACHE_HPP_INCLUDED
+
+#include <type_safe/optional.hpp>
+
+#include "preprocessor.hpp"
+
+namespace cppast
+{
+namespace detail
+{
+    // on-disk cache of the preprocessor output
+    // an entry is identified by a hash of the file, the clang binary and the flags,
+    // it is valid as long as all files it depends on have the same content
+    class preprocessor_cache
+    {
+    public:
+        // disabled if the config has no cache directory
+        preprocessor_cache(const libclang_compile_config& config, const char* path);
+
+        explicit operator bool() const noexcept
+        {
+            return !file_.empty();
+        }
+
+        // returns nullopt if there is no valid entry
+        type_safe::optional<preprocessor_output> load() const;
+
+        // dependencies are all files that were read by the preprocessor
+        void store(const preprocessor_output&      output,
+                   const std::vector<std::string>& dependencies) const;
+
+    private:
+        std::string directory_, file_;
+        std::size_t max_size_;
+        bool        revalidate_;
+    };
+
+    // returns the dependencies listed in a make-style dependency file,
+    // as written by clang -MD
+    std::vector<std::string> parse_dependency_file(const std::string& file);
+} // namespace detail
+} // namespace cppast
+
+#endif // CPPAST_PREPROCESSOR_CACHE_HPP_INCLUDED
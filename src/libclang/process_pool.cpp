@@ -0,0 +1,257 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#include "process_pool.hpp"
+
+#include <process.hpp>
+
+#include <cppast/libclang_parser.hpp>
+
+#ifndef _WIN32
+#    include <algorithm>
+#    include <chrono>
+#    include <condition_variable>
+#    include <cstdlib>
+#    include <memory>
+#    include <mutex>
+#    include <random>
+#    include <vector>
+#endif
+
+using namespace cppast;
+namespace tpl = TinyProcessLib;
+
+#ifndef _WIN32
+namespace
+{
+// a worker is a long-lived shell that reads one command per line from stdin
+// and runs it in a subshell, so only the small shell is forked for each command,
+// not the (possibly huge) parser process
+// after a command, it writes the marker followed by the exit code to stdout
+// and the marker to stderr, which ends the output of the command on both streams
+// the marker is passed as $0, the script must not contain single quotes
+const char worker_script[]
+    = "while IFS= read -r cmd; do"
+      " (eval \"$cmd\") </dev/null;"
+      " printf \"%s %d\\n\" \"$0\" $?;"
+      " printf \"%s\\n\" \"$0\" >&2;"
+      " done";
+
+std::string get_marker()
+{
+    static const char digits[] = "0123456789abcdef";
+
+    std::random_device                 device;
+    std::uniform_int_distribution<int> dist(0, 15);
+
+    std::string result = "cppast-";
+    for (auto i = 0; i != 32; ++i)
+        result += digits[dist(device)];
+    return result;
+}
+
+//=== pool ===//
+class worker
+{
+public:
+    worker()
+    : marker_(get_marker()), exit_code_(0),
+      process_("exec /bin/sh -c '" + std::string(worker_script) + "' " + marker_, "",
+               [this](const char* str, std::size_t n) { read(stdout_, str, n); },
+               [this](const char* str, std::size_t n) { read(stderr_, str, n); }, true)
+    {}
+
+    worker(const worker&) = delete;
+    worker& operator=(const worker&) = delete;
+
+    ~worker() noexcept
+    {
+        // worker exits once there are no more jobs
+        process_.close_stdin();
+        process_.get_exit_status();
+    }
+
+    bool valid() const noexcept
+    {
+        return process_.get_id() > 0;
+    }
+
+    // returns false if the worker died
+    // requires: cmd does not contain a newline
+    bool run(const std::string& cmd, const detail::process_output_callback& read_stdout,
+             const detail::process_output_callback& read_stderr, int& exit_code)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stdout_.start(read_stdout);
+            stderr_.start(read_stderr);
+        }
+
+        auto written = process_.write(cmd + '\n');
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto                         done = [&] { return stdout_.done && stderr_.done; };
+        while (written && !done())
+        {
+            if (cv_.wait_for(lock, std::chrono::milliseconds(100), done))
+                break;
+
+            // checking the exit status joins the threads calling read() once the worker died,
+            // so it must not be done while holding the lock
+            lock.unlock();
+            int  status;
+            auto exited = process_.try_get_exit_status(status);
+            lock.lock();
+            if (exited)
+                break;
+        }
+
+        // the callbacks must not be called after returning
+        stdout_.callback = nullptr;
+        stderr_.callback = nullptr;
+        if (!done())
+            return false;
+        exit_code = exit_code_;
+        return true;
+    }
+
+private:
+    struct stream
+    {
+        std::string                            buffer;
+        const detail::process_output_callback* callback = nullptr;
+        bool                                   done     = true;
+
+        void start(const detail::process_output_callback& cb)
+        {
+            callback = &cb;
+            done     = false;
+        }
+
+        // passes the first n characters of the buffer to the callback
+        void flush(std::size_t n)
+        {
+            if (n > 0u && callback && *callback)
+                (*callback)(buffer.data(), n);
+            buffer.erase(0, n);
+        }
+    };
+
+    // called by the threads reading stdout and stderr of the worker
+    void read(stream& s, const char* str, std::size_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        s.buffer.append(str, n);
+
+        auto marker = s.buffer.find(marker_);
+        if (marker == std::string::npos)
+        {
+            // keep everything that could be the beginning of the marker
+            s.flush(s.buffer.size() - std::min(s.buffer.size(), marker_.size() - 1u));
+            return;
+        }
+        s.flush(marker);
+
+        auto end = s.buffer.find('\n');
+        if (end == std::string::npos)
+            // wait for the exit code
+            return;
+        if (&s == &stdout_)
+            exit_code_ = std::atoi(s.buffer.c_str() + marker_.size());
+        s.buffer.erase(0, end + 1u);
+
+        s.done     = true;
+        s.callback = nullptr;
+        cv_.notify_all();
+    }
+
+    std::string             marker_;
+    std::mutex              mutex_;
+    std::condition_variable cv_;
+    stream                  stdout_, stderr_;
+    int                     exit_code_;
+    tpl::Process            process_;
+};
+
+class worker_pool
+{
+public:
+    static worker_pool& get()
+    {
+        static worker_pool pool;
+        return pool;
+    }
+
+    std::unique_ptr<worker> acquire(std::size_t max_size)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return !idle_.empty() || size_ < max_size; });
+
+        if (!idle_.empty())
+        {
+            auto result = std::move(idle_.back());
+            idle_.pop_back();
+            return result;
+        }
+
+        ++size_;
+        lock.unlock();
+        return std::unique_ptr<worker>(new worker());
+    }
+
+    // pass nullptr if the worker must not be reused
+    void release(std::unique_ptr<worker> w)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (w)
+            idle_.push_back(std::move(w));
+        else
+            --size_;
+        cv_.notify_one();
+    }
+
+private:
+    worker_pool() : size_(0u) {}
+
+    std::mutex                           mutex_;
+    std::condition_variable              cv_;
+    std::vector<std::unique_ptr<worker>> idle_;
+    std::size_t                          size_;
+};
+} // namespace
+#endif
+
+int detail::run_process(const std::string& cmd, std::size_t pool_size,
+                        const process_output_callback& read_stdout,
+                        const process_output_callback& read_stderr)
+{
+#ifndef _WIN32
+    if (pool_size > 0u && cmd.find('\n') == std::string::npos)
+    {
+        auto& pool = worker_pool::get();
+
+        auto w = pool.acquire(pool_size);
+        if (w->valid())
+        {
+            int exit_code;
+            if (w->run(cmd, read_stdout, read_stderr, exit_code))
+            {
+                pool.release(std::move(w));
+                return exit_code;
+            }
+
+            pool.release(nullptr);
+            throw libclang_error("preprocessor: worker process died while running command '" + cmd
+                                 + "'");
+        }
+
+        // unable to start worker, fallback to a new process
+        pool.release(nullptr);
+    }
+#else
+    (void)pool_size;
+#endif
+
+    tpl::Process process(cmd, "", read_stdout, read_stderr);
+    return process.get_exit_status();
+}
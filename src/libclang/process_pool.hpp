@@ -0,0 +1,28 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#ifndef CPPAST_PROCESS_POOL_HPP_INCLUDED
+#define CPPAST_PROCESS_POOL_HPP_INCLUDED
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace cppast
+{
+namespace detail
+{
+    using process_output_callback = std::function<void(const char*, std::size_t)>;
+
+    // runs the shell command and waits for it to finish, returns the exit code
+    // if pool_size is not zero, the command is started by one of at most pool_size long-lived
+    // worker shells, this saves forking the (possibly huge) parser process for each command,
+    // unless the command contains a newline
+    // notes: the callbacks can be called from a different thread
+    int run_process(const std::string& cmd, std::size_t pool_size,
+                    const process_output_callback& read_stdout,
+                    const process_output_callback& read_stderr);
+} // namespace detail
+} // namespace cppast
+
+#endif // CPPAST_PROCESS_POOL_HPP_INCLUDED
@@ -54,6 +54,11 @@ namespace detail
             std::swap(a.obj_, b.obj_);
         }
 
+        explicit operator bool() const noexcept
+        {
+            return obj_ != nullptr;
+        }
+
         T get() const noexcept
         {
             DEBUG_ASSERT(obj_, detail::assert_handler{});
@@ -48,7 +48,7 @@ cpp_token_string extract_parameter_constraint(const detail::parse_context& conte
                                               detail::cxtoken_iterator     target_range_end)
 {
     // search the parent context for the *exact* sequence in it's entirety
-    detail::cxtokenizer    tokenizer(context.tu, context.file, parent);
+    detail::cxtokenizer    tokenizer(context.tokens, parent);
     detail::cxtoken_stream stream(tokenizer, parent);
 
     detail::cxtoken_iterator found_start
@@ -80,7 +80,7 @@ std::unique_ptr<cpp_template_parameter> parse_type_parameter(const detail::parse
     DEBUG_ASSERT(clang_getCursorKind(cur) == CXCursor_TemplateTypeParameter,
                  detail::assert_handler{});
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
     auto                   name = detail::get_cursor_name(cur);
 
@@ -130,7 +130,7 @@ std::unique_ptr<cpp_template_parameter> parse_non_type_parameter(
     cpp_attribute_list attributes;
     auto               def = detail::parse_default_value(attributes, context, cur, name.c_str());
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     // see if it is variadic
@@ -165,7 +165,7 @@ std::unique_ptr<cpp_template_template_parameter> parse_template_parameter(
     DEBUG_ASSERT(clang_getCursorKind(cur) == CXCursor_TemplateTemplateParameter,
                  detail::assert_handler{});
 
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
     auto                   name = detail::get_cursor_name(cur);
 
@@ -308,7 +308,7 @@ namespace
 template <class Builder>
 void parse_arguments(Builder& b, const detail::parse_context& context, const CXCursor& cur)
 {
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
 
     while (!stream.done() && !detail::skip_if(stream, detail::get_cursor_name(cur).c_str(), true))
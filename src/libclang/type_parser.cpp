@@ -225,26 +225,57 @@ std::unique_ptr<cpp_type> make_cv_qualified(std::unique_ptr<cpp_type> entity, cp
     return cpp_cv_qualified_type::build(std::move(entity), cv);
 }
 
-template <typename Builder>
-std::unique_ptr<cpp_type> make_leave_type(const CXCursor& cur, const CXType& type, Builder b)
+// cv qualifiers of the type itself, not of the types it is composed of
+cpp_cv get_cv(const CXType& type)
 {
-    auto spelling = get_type_spelling(cur, type);
-
-    // check for cv qualifiers on the leave type
-    auto prefix = prefix_cv(spelling);
-    auto suffix = suffix_cv(spelling);
-    auto cv     = merge_cv(prefix, suffix);
+    auto is_const    = clang_isConstQualifiedType(type) != 0;
+    auto is_volatile = clang_isVolatileQualifiedType(type) != 0;
+    if (is_const && is_volatile)
+        return cpp_cv_const_volatile;
+    else if (is_const)
+        return cpp_cv_const;
+    else if (is_volatile)
+        return cpp_cv_volatile;
+    return cpp_cv_none;
+}
 
-    // remove struct/class/union prefix on inline type definition
-    // i.e. C's typedef struct idiom
-    remove_prefix(spelling, "struct", true);
-    remove_prefix(spelling, "class", true);
-    remove_prefix(spelling, "union", true);
+template <typename Builder>
+std::unique_ptr<cpp_type> make_leave_type(const detail::parse_context& context,
+                                          const CXCursor& cur, const CXType& type, Builder b)
+{
+    auto& leave = context.types.get_leave_type(cur, type);
 
-    auto entity = b(std::move(spelling));
+    auto entity = b(std::string(leave.spelling));
     if (!entity)
         return nullptr;
-    return make_cv_qualified(std::move(entity), cv);
+    return make_cv_qualified(std::move(entity), leave.cv);
+}
+
+std::unique_ptr<cpp_type> make_builtin_type(const CXType& type, cpp_builtin_type_kind kind)
+{
+    return make_cv_qualified(cpp_builtin_type::build(kind), get_cv(type));
+}
+
+std::unique_ptr<cpp_type> make_user_defined_type(const detail::parse_context& context,
+                                                 const CXCursor& cur, const CXType& type)
+{
+    auto& leave = context.types.get_leave_type(cur, type);
+    if (!leave.user_defined)
+    {
+        auto decl = clang_getTypeDeclaration(type);
+        if (clang_isInvalid(clang_getCursorKind(decl)))
+            // We can reach this point if we have an elaborated type referencing a using
+            // declaration. Give it an invalid id, since we have no way of retrieving it, but
+            // keep the spelling.
+            leave.user_defined = cpp_type_ref(cpp_entity_id(""), leave.spelling);
+        else if (detail::get_cursor_name(decl).empty())
+            // anonymous type
+            leave.user_defined = cpp_type_ref(detail::get_entity_id(decl), "");
+        else
+            leave.user_defined = cpp_type_ref(detail::get_entity_id(decl), leave.spelling);
+    }
+
+    return make_cv_qualified(cpp_user_defined_type::build(leave.user_defined.value()), leave.cv);
 }
 
 cpp_reference get_reference_kind(const CXType& type)
@@ -437,30 +468,30 @@ std::unique_ptr<cpp_type> try_parse_template_parameter_type(const detail::parse_
         return nullptr;
 
     // doesn't respect cv qualifiers properly
-    auto result
-        = make_leave_type(cur, type, [&](std::string&& type_spelling) -> std::unique_ptr<cpp_type> {
-              // look at the template parameters,
-              // see if we find a matching one
-              auto param = clang_getNullCursor();
-              detail::visit_children(templ, [&](const CXCursor& child) {
-                  if (clang_getCursorKind(child) == CXCursor_TemplateTypeParameter
-                      && get_type_spelling(child, clang_getCursorType(child)) == type_spelling)
-                  {
-                      // found one
-                      DEBUG_ASSERT(clang_Cursor_isNull(param), detail::assert_handler{});
-                      param = child;
-                  }
-              });
-
-              if (clang_Cursor_isNull(param))
-                  return nullptr;
-              else
-                  // found matching parameter
-                  return cpp_template_parameter_type::build(
-                      cpp_template_type_parameter_ref(detail::get_entity_id(param),
-                                                      std::move(type_spelling)));
-          });
+    auto parse_spelling = [&](std::string&& type_spelling) -> std::unique_ptr<cpp_type> {
+        // look at the template parameters,
+        // see if we find a matching one
+        auto param = clang_getNullCursor();
+        detail::visit_children(templ, [&](const CXCursor& child) {
+            if (clang_getCursorKind(child) == CXCursor_TemplateTypeParameter
+                && get_type_spelling(child, clang_getCursorType(child)) == type_spelling)
+            {
+                // found one
+                DEBUG_ASSERT(clang_Cursor_isNull(param), detail::assert_handler{});
+                param = child;
+            }
+        });
+
+        if (clang_Cursor_isNull(param))
+            return nullptr;
+        else
+            // found matching parameter
+            return cpp_template_parameter_type::build(
+                cpp_template_type_parameter_ref(detail::get_entity_id(param),
+                                                std::move(type_spelling)));
+    };
 
+    auto result = make_leave_type(context, cur, type, parse_spelling);
     if (result)
         return result;
     else
@@ -501,10 +532,10 @@ CXCursor get_instantiation_template(const CXCursor& cur, const CXType& type,
     }
 }
 
-std::unique_ptr<cpp_type> try_parse_instantiation_type(const detail::parse_context&,
+std::unique_ptr<cpp_type> try_parse_instantiation_type(const detail::parse_context& context,
                                                        const CXCursor& cur, const CXType& type)
 {
-    return make_leave_type(cur, type, [&](std::string&& spelling) -> std::unique_ptr<cpp_type> {
+    auto parse_spelling = [&](std::string&& spelling) -> std::unique_ptr<cpp_type> {
         auto ptr = spelling.c_str();
 
         std::string templ_name;
@@ -531,16 +562,17 @@ std::unique_ptr<cpp_type> try_parse_instantiation_type(const detail::parse_conte
         builder.add_unexposed_arguments(ptr);
 
         return builder.finish();
-    });
+    };
+    return make_leave_type(context, cur, type, parse_spelling);
 }
 
-std::unique_ptr<cpp_type> try_parse_decltype_type(const detail::parse_context&, const CXCursor& cur,
-                                                  const CXType& type)
+std::unique_ptr<cpp_type> try_parse_decltype_type(const detail::parse_context& context,
+                                                  const CXCursor& cur, const CXType& type)
 {
     if (clang_isExpression(clang_getCursorKind(cur)))
         return nullptr; // don't use decltype here
 
-    return make_leave_type(cur, type, [&](std::string&& spelling) -> std::unique_ptr<cpp_type> {
+    auto parse_spelling = [&](std::string&& spelling) -> std::unique_ptr<cpp_type> {
         if (!remove_prefix(spelling, "decltype(", false))
             return nullptr;
         remove_suffix(spelling, "...", false); // variadic decltype. fun
@@ -551,7 +583,8 @@ std::unique_ptr<cpp_type> try_parse_decltype_type(const detail::parse_context&,
         return cpp_decltype_type::build(
             cpp_unexposed_expression::build(cpp_unexposed_type::build("<decltype>"),
                                             cpp_token_string::tokenize(spelling)));
-    });
+    };
+    return make_leave_type(context, cur, type, parse_spelling);
 }
 
 std::unique_ptr<cpp_type> parse_type_impl(const detail::parse_context& context, const CXCursor& cur,
@@ -591,77 +624,52 @@ std::unique_ptr<cpp_type> parse_type_impl(const detail::parse_context& context,
         return cpp_unexposed_type::build(get_type_spelling(cur, type));
 
     case CXType_Void:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_void); });
+        return make_builtin_type(type, cpp_void);
     case CXType_Bool:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_bool); });
+        return make_builtin_type(type, cpp_bool);
     case CXType_UChar:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_uchar); });
+        return make_builtin_type(type, cpp_uchar);
     case CXType_UShort:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_ushort); });
+        return make_builtin_type(type, cpp_ushort);
     case CXType_UInt:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_uint); });
+        return make_builtin_type(type, cpp_uint);
     case CXType_ULong:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_ulong); });
+        return make_builtin_type(type, cpp_ulong);
     case CXType_ULongLong:
-        return make_leave_type(cur, type, [](std::string&&) {
-            return cpp_builtin_type::build(cpp_ulonglong);
-        });
+        return make_builtin_type(type, cpp_ulonglong);
     case CXType_UInt128:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_uint128); });
+        return make_builtin_type(type, cpp_uint128);
     case CXType_SChar:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_schar); });
+        return make_builtin_type(type, cpp_schar);
     case CXType_Short:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_short); });
+        return make_builtin_type(type, cpp_short);
     case CXType_Int:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_int); });
+        return make_builtin_type(type, cpp_int);
     case CXType_Long:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_long); });
+        return make_builtin_type(type, cpp_long);
     case CXType_LongLong:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_longlong); });
+        return make_builtin_type(type, cpp_longlong);
     case CXType_Int128:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_int128); });
+        return make_builtin_type(type, cpp_int128);
     case CXType_Float:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_float); });
+        return make_builtin_type(type, cpp_float);
     case CXType_Double:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_double); });
+        return make_builtin_type(type, cpp_double);
     case CXType_LongDouble:
-        return make_leave_type(cur, type, [](std::string&&) {
-            return cpp_builtin_type::build(cpp_longdouble);
-        });
+        return make_builtin_type(type, cpp_longdouble);
     case CXType_Float128:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_float128); });
+        return make_builtin_type(type, cpp_float128);
     case CXType_Char_U:
     case CXType_Char_S:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_char); });
+        return make_builtin_type(type, cpp_char);
     case CXType_Char16:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_char16); });
+        return make_builtin_type(type, cpp_char16);
     case CXType_Char32:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_char32); });
+        return make_builtin_type(type, cpp_char32);
     case CXType_WChar:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_wchar); });
+        return make_builtin_type(type, cpp_wchar);
     case CXType_NullPtr:
-        return make_leave_type(cur, type,
-                               [](std::string&&) { return cpp_builtin_type::build(cpp_nullptr); });
+        return make_builtin_type(type, cpp_nullptr);
 
     case CXType_Elaborated:
         if (auto itype = try_parse_instantiation_type(context, cur, type))
@@ -671,32 +679,12 @@ std::unique_ptr<cpp_type> parse_type_impl(const detail::parse_context& context,
     case CXType_Record:
     case CXType_Enum:
     case CXType_Typedef:
-        return make_leave_type(cur, type, [&](std::string&& spelling) {
-            auto decl = clang_getTypeDeclaration(type);
-            if (clang_isInvalid(clang_getCursorKind(decl)))
-            {
-                // We can reach this point if we have an elaborated type referencing a using
-                // declaration. Give it an invalid id, since we have no way of retrieving it, but
-                // keep the spelling.
-                return cpp_user_defined_type::build(
-                    cpp_type_ref(cpp_entity_id(""), std::move(spelling)));
-            }
-            else
-            {
-                if (detail::cxstring(clang_getCursorSpelling(decl)).empty())
-                    spelling = ""; // anonymous type
-                return cpp_user_defined_type::build(
-                    cpp_type_ref(detail::get_entity_id(decl), std::move(spelling)));
-            }
-        });
+        return make_user_defined_type(context, cur, type);
 
     case CXType_Pointer: {
         auto pointee = parse_type_impl(context, cur, clang_getPointeeType(type));
         auto pointer = cpp_pointer_type::build(std::move(pointee));
-
-        auto spelling = get_type_spelling(cur, type);
-        auto cv       = suffix_cv(spelling);
-        return make_cv_qualified(std::move(pointer), cv);
+        return make_cv_qualified(std::move(pointer), get_cv(type));
     }
     case CXType_LValueReference:
     case CXType_RValueReference: {
@@ -718,11 +706,49 @@ std::unique_ptr<cpp_type> parse_type_impl(const detail::parse_context& context,
         return cpp_pointer_type::build(parse_member_pointee_type(context, cur, type));
 
     case CXType_Auto:
-        return make_leave_type(cur, type, [&](std::string&&) { return cpp_auto_type::build(); });
+        return make_cv_qualified(cpp_auto_type::build(), get_cv(type));
     }
 }
 } // namespace
 
+bool detail::type_cache::key::operator==(const key& other) const noexcept
+{
+    return clang_equalTypes(type, other.type) != 0 && remove_scope == other.remove_scope;
+}
+
+std::size_t detail::type_cache::key_hash::operator()(const key& k) const noexcept
+{
+    auto result = std::hash<void*>{}(k.type.data[0]);
+    result ^= std::hash<void*>{}(k.type.data[1]) + 0x9e3779b9 + (result << 6) + (result >> 2);
+    return k.remove_scope ? ~result : result;
+}
+
+detail::type_cache::leave_type& detail::type_cache::get_leave_type(const CXCursor& cur,
+                                                                   const CXType&   type) const
+{
+    // the spelling of a typedef depends on the cursor it is used in, see get_type_spelling()
+    key  k{type, need_to_remove_scope(cur, type)};
+    auto iter = leave_types_.find(k);
+    if (iter != leave_types_.end())
+        return iter->second;
+
+    auto spelling = get_type_spelling(cur, type);
+
+    // check for cv qualifiers on the leave type
+    auto prefix = prefix_cv(spelling);
+    auto suffix = suffix_cv(spelling);
+    auto cv     = merge_cv(prefix, suffix);
+
+    // remove struct/class/union prefix on inline type definition
+    // i.e. C's typedef struct idiom
+    remove_prefix(spelling, "struct", true);
+    remove_prefix(spelling, "class", true);
+    remove_prefix(spelling, "union", true);
+
+    return leave_types_.emplace(k, leave_type{std::move(spelling), cv, type_safe::nullopt})
+        .first->second;
+}
+
 std::unique_ptr<cpp_type> detail::parse_type(const detail::parse_context& context,
                                              const CXCursor& cur, const CXType& type)
 {
@@ -761,7 +787,7 @@ std::unique_ptr<cpp_entity> detail::parse_cpp_type_alias(const detail::parse_con
     }
 
     // look for attributes
-    detail::cxtokenizer    tokenizer(context.tu, context.file, cur);
+    detail::cxtokenizer    tokenizer(context.tokens, cur);
     detail::cxtoken_stream stream(tokenizer, cur);
     if (detail::skip_if(stream, "using"))
     {
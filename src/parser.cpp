@@ -0,0 +1,228 @@
+// Copyright (C) 2017-2023 Jonathan Müller and cppast contributors
+// SPDX-License-Identifier: MIT
+
+#include <cppast/parser.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#    include <process.h>
+#else
+#    include <unistd.h>
+#endif
+
+using namespace cppast;
+
+namespace
+{
+// entries are stored one per line in the file:
+// <path>\t<seconds>\t<heuristic>
+const char costs_header[] = "cppast parse costs 2";
+
+// the size of the file, it must be cheap as it is called while queuing files
+double get_heuristic(const std::string& path)
+{
+#ifdef _WIN32
+    struct _stat info;
+    if (_stat(path.c_str(), &info) != 0)
+        return 0.;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return 0.;
+#endif
+    return double(info.st_size);
+}
+} // namespace
+
+file_parse_costs::file_parse_costs(std::string file)
+: file_(std::move(file)), total_seconds_(0.), total_heuristic_(0.)
+{
+    read_file();
+}
+
+double file_parse_costs::estimate(const std::string& path) const
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto                        iter = entries_.find(path);
+        if (iter != entries_.end())
+            return iter->second.seconds;
+    }
+
+    auto heuristic = get_heuristic(path);
+
+    // scale the heuristic so it matches the recorded times
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (total_seconds_ > 0. && total_heuristic_ > 0.)
+        return heuristic * (total_seconds_ / total_heuristic_);
+    else
+        // nothing recorded, only the relative order matters
+        return heuristic;
+}
+
+void file_parse_costs::record(const std::string& path, double seconds)
+{
+    auto heuristic = get_heuristic(path);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        result = entries_.emplace(path, entry{seconds, heuristic});
+    if (!result.second)
+    {
+        total_seconds_ -= result.first->second.seconds;
+        total_heuristic_ -= result.first->second.heuristic;
+        result.first->second = entry{seconds, heuristic};
+    }
+    total_seconds_ += seconds;
+    total_heuristic_ += heuristic;
+}
+
+bool file_parse_costs::save() const
+{
+    if (file_.empty())
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // merge with entries of other processes, the own entries take precedence
+    read_file();
+
+    // write to a temporary file first and rename it,
+    // so concurrent processes never see partially written files
+#ifdef _WIN32
+    auto temporary = file_ + "." + std::to_string(_getpid()) + ".tmp";
+#else
+    auto temporary = file_ + "." + std::to_string(getpid()) + ".tmp";
+#endif
+    {
+        std::ofstream file(temporary);
+        file << costs_header << '\n';
+        for (auto& entry : entries_)
+            if (entry.first.find('\n') == std::string::npos)
+                file << entry.first << '\t' << std::to_string(entry.second.seconds) << '\t'
+                     << std::to_string(entry.second.heuristic) << '\n';
+
+        if (!file)
+        {
+            file.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), file_.c_str()) != 0)
+    {
+        // rename() doesn't replace existing files on Windows
+        std::remove(file_.c_str());
+        if (std::rename(temporary.c_str(), file_.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+void file_parse_costs::read_file() const
+{
+    std::ifstream file(file_);
+    std::string   line;
+    if (file_.empty() || !std::getline(file, line) || line != costs_header)
+        return;
+
+    while (std::getline(file, line))
+    {
+        // the path can contain tabs, so split at the last ones
+        auto heuristic_sep = line.rfind('\t');
+        if (heuristic_sep == std::string::npos || heuristic_sep == 0u)
+            continue;
+        auto seconds_sep = line.rfind('\t', heuristic_sep - 1u);
+        if (seconds_sep == std::string::npos)
+            continue;
+
+        auto seconds   = std::strtod(line.c_str() + seconds_sep + 1u, nullptr);
+        auto heuristic = std::strtod(line.c_str() + heuristic_sep + 1u, nullptr);
+        if (entries_.emplace(line.substr(0u, seconds_sep), entry{seconds, heuristic}).second)
+        {
+            total_seconds_ += seconds;
+            total_heuristic_ += heuristic;
+        }
+    }
+}
+
+detail::parse_executor::parse_executor(unsigned no_threads)
+: no_submitted_(0u), no_threads_(no_threads), held_(false), stop_(false)
+{
+    if (no_threads_ == 0u)
+        no_threads_ = std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+void detail::parse_executor::submit(std::function<void()> run, std::function<void()> discard,
+                                    double priority)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    DEBUG_ASSERT(!stop_, detail::assert_handler{});
+    if (threads_.empty())
+        for (auto i = 0u; i != no_threads_; ++i)
+            threads_.emplace_back([this] { work(); });
+
+    jobs_.push_back(job{priority, no_submitted_++, std::move(run), std::move(discard)});
+    std::push_heap(jobs_.begin(), jobs_.end(), job_less{});
+    queued_.notify_one();
+}
+
+void detail::parse_executor::hold() noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    held_ = true;
+}
+
+void detail::parse_executor::release() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        held_ = false;
+    }
+    queued_.notify_all();
+}
+
+void detail::parse_executor::stop() noexcept
+{
+    std::vector<job> jobs;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        jobs.swap(jobs_);
+    }
+    queued_.notify_all();
+
+    for (auto& thread : threads_)
+        thread.join();
+    threads_.clear();
+
+    for (auto& cur : jobs)
+        if (cur.discard)
+            cur.discard();
+}
+
+void detail::parse_executor::work()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        queued_.wait(lock, [&] { return stop_ || (!held_ && !jobs_.empty()); });
+        if (stop_)
+            break;
+
+        std::pop_heap(jobs_.begin(), jobs_.end(), job_less{});
+        auto cur = std::move(jobs_.back());
+        jobs_.pop_back();
+        lock.unlock();
+
+        cur.run();
+
+        lock.lock();
+    }
+}
@@ -379,3 +379,43 @@ void foo::a() {}
     });
     REQUIRE(count == 4u);
 }
+
+TEST_CASE("lazy_expressions")
+{
+    write_file("lazy_expressions.cpp", R"(
+constexpr int value = 4 * (2 + 1);
+
+void a(int i = value / 2, const char* str = "hello", int j = int(value));
+void b() noexcept(sizeof(int) == 4 && noexcept(a()));
+
+template <int I = value - 1>
+struct c
+{
+    int member = I << 2;
+    static constexpr bool flag = I > 2;
+};
+
+enum d
+{
+    d_a = 1 << 3,
+    d_b = d_a | value,
+};
+)");
+
+    auto get_code = [](const cpp_entity_index& idx, bool lazy) {
+        libclang_compile_config config;
+        config.set_flags(cpp_standard::cpp_latest);
+        config.lazy_expressions(lazy);
+
+        libclang_parser parser(default_logger());
+        auto            file = parser.parse(idx, "lazy_expressions.cpp", config);
+        REQUIRE(!parser.error());
+        REQUIRE(file);
+        return ::get_code(*file);
+    };
+
+    cpp_entity_index idx_eager, idx_lazy;
+    auto             eager = get_code(idx_eager, false);
+    REQUIRE(eager.find("noexcept") != std::string::npos);
+    REQUIRE(get_code(idx_lazy, true) == eager);
+}
@@ -588,3 +588,62 @@ struct foo
     REQUIRE(count == 2u);
 }
 
+
+TEST_CASE("skip_function_bodies")
+{
+    write_file("skip_function_bodies.cpp", R"(
+struct base
+{
+    virtual void a();
+    virtual void b() = 0;
+};
+
+struct foo : base
+{
+    foo() : i(0), j{1} {}
+    foo(int) try : i(0) {} catch (...) {}
+    foo(char) try : i{0}, j{1} { throw 0; } catch (int) { i = 0; } catch (...) {}
+    foo(const foo&) = default;
+    foo& operator=(const foo&) = delete;
+    ~foo() noexcept(noexcept(int{})) {}
+
+    void a() override {}
+    void b() final { int x = 0; (void)x; }
+
+    auto c() const -> decltype(int{}) { return 0; }
+    void d();
+    constexpr int e() const { return 0; }
+
+    int i, j;
+};
+
+void foo::d() {}
+
+inline int f(int a) noexcept { return a; }
+)");
+
+    // the generated code contains the body kind and the virtual specifiers
+    auto get_functions = [](const cpp_entity_index& idx, bool skip) {
+        libclang_compile_config config;
+        config.set_flags(cpp_standard::cpp_latest);
+        config.skip_function_bodies(skip);
+
+        libclang_parser parser(default_logger());
+        auto            file = parser.parse(idx, "skip_function_bodies.cpp", config);
+        REQUIRE(!parser.error());
+        REQUIRE(file);
+
+        std::vector<std::string> result;
+        visit(*file, [&](const cpp_entity& e, visitor_info info) {
+            if (info.event != visitor_info::container_entity_exit && is_function(e.kind()))
+                result.push_back(get_code(e));
+            return true;
+        });
+        return result;
+    };
+
+    cpp_entity_index idx_full, idx_skipped;
+    auto             full = get_functions(idx_full, false);
+    REQUIRE(full.size() == 15u);
+    REQUIRE(get_functions(idx_skipped, true) == full);
+}
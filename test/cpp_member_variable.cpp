@@ -109,3 +109,41 @@ struct foo
     });
     REQUIRE(count == 5u);
 }
+
+TEST_CASE("cpp_member_variable repeated types")
+{
+    // the same types are used in different scopes,
+    // the spelling of a typedef depends on it
+    auto code = R"(
+struct foo
+{
+    typedef int type;
+
+    /// type a;
+    type a;
+    /// type const b;
+    const type b;
+    /// type c;
+    type c;
+    /// int const* const d;
+    const int* const d;
+    /// int const* e;
+    const int* e;
+};
+
+struct bar
+{
+    /// foo::type f;
+    foo::type f;
+    /// foo::type const g;
+    const foo::type g;
+    /// foo::type h;
+    foo::type h;
+};
+)";
+
+    cpp_entity_index idx;
+    auto             file  = parse(idx, "cpp_member_variable_repeated_types.cpp", code);
+    auto             count = test_visit<cpp_member_variable>(*file, [](const cpp_entity&) {});
+    REQUIRE(count == 8u);
+}
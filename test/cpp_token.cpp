@@ -6,8 +6,13 @@
 #include <catch2/catch.hpp>
 
 #include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <initializer_list>
 
+#include "libclang/cxtokenizer.hpp"
+#include "libclang/libclang_visitor.hpp"
+
 using namespace cppast;
 
 void check_equal_tokens(const std::string& str, std::initializer_list<cpp_token> tokens)
@@ -126,3 +131,95 @@ TEST_CASE("tokenizer")
                                              cpp_token(cpp_token_kind::punctuation, ">")});
     }
 }
+
+TEST_CASE("cxtoken_table")
+{
+    std::ofstream("cxtoken_table.cpp") << R"(// comment
+namespace ns
+{
+    /* comment */ struct foo
+    {
+        int a = 0; // comment
+        void f(int b = 1 << 2) const noexcept;
+    };
+
+    template <typename T>
+    using bar = foo;
+}
+int   x   ;
+)";
+
+    detail::cxindex   index(clang_createIndex(0, 0));
+    const char*       args[] = {"-std=c++11"};
+    CXTranslationUnit unit;
+    REQUIRE(clang_parseTranslationUnit2(index.get(), "cxtoken_table.cpp", args, 1, nullptr, 0,
+                                        CXTranslationUnit_None, &unit)
+            == CXError_Success);
+    detail::cxtranslation_unit tu(unit);
+
+    detail::cxtoken_table table(tu.get(), clang_getFile(tu.get(), "cxtoken_table.cpp"));
+
+    // must return the same tokens as clang_tokenize()
+    auto count = 0u;
+    detail::visit_children(
+        clang_getTranslationUnitCursor(tu.get()),
+        [&](const CXCursor& cur) {
+            auto extent = clang_getCursorExtent(cur);
+            if (!clang_Location_isFromMainFile(clang_getRangeStart(extent)))
+                return;
+
+            CXToken* tokens;
+            unsigned no_tokens;
+            clang_tokenize(tu.get(), extent, &tokens, &no_tokens);
+
+            auto result = table.lookup(extent);
+            REQUIRE(unsigned(result.second - result.first) == no_tokens);
+            for (auto i = 0u; i != no_tokens; ++i)
+            {
+                detail::cxstring spelling(clang_getTokenSpelling(tu.get(), tokens[i]));
+                REQUIRE(result.first[i] == spelling.c_str());
+            }
+
+            clang_disposeTokens(tu.get(), tokens, no_tokens);
+            ++count;
+        },
+        true);
+    REQUIRE(count > 10u);
+}
+
+TEST_CASE("cxtoken_table::get_spelling")
+{
+    auto code = "template <typename T>\nstruct foo : bar<baz<T>>\n{\n"
+                "  [[deprecated]] int a  =  0x1F;\n  void f() const&& noexcept;\n};\n";
+    std::ofstream("cxtoken_table_spelling.cpp") << code;
+
+    detail::cxindex   index(clang_createIndex(0, 0));
+    CXTranslationUnit unit;
+    REQUIRE(clang_parseTranslationUnit2(index.get(), "cxtoken_table_spelling.cpp", nullptr, 0,
+                                        nullptr, 0, CXTranslationUnit_None, &unit)
+            == CXError_Success);
+    detail::cxtranslation_unit tu(unit);
+
+    auto                  file = clang_getFile(tu.get(), "cxtoken_table_spelling.cpp");
+    detail::cxtoken_table table(tu.get(), file);
+
+    // must be the same as the spelling of the tokens returned by clang_tokenize()
+    auto size = unsigned(std::strlen(code));
+    for (auto begin = 0u; begin != size; ++begin)
+        for (auto length = 1u; begin + length <= size && length <= 3u; ++length)
+        {
+            auto range = clang_getRange(clang_getLocationForOffset(tu.get(), file, begin),
+                                        clang_getLocationForOffset(tu.get(), file, begin + length));
+
+            CXToken* tokens;
+            unsigned no_tokens;
+            clang_tokenize(tu.get(), range, &tokens, &no_tokens);
+            std::string expected;
+            for (auto i = 0u; i != no_tokens && expected.length() < length; ++i)
+                expected += detail::cxstring(clang_getTokenSpelling(tu.get(), tokens[i])).c_str();
+            clang_disposeTokens(tu.get(), tokens, no_tokens);
+
+            INFO(begin << ", " << length);
+            REQUIRE(table.get_spelling(begin, begin + length, length) == expected);
+        }
+}
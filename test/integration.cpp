@@ -3,13 +3,15 @@
 
 #include "test_parser.hpp"
 
+#include <chrono>
+
 #include <cppast/cpp_preprocessor.hpp>
 
 using namespace cppast;
 
-TEST_CASE("stdlib", "[!hide][integration]")
+namespace
 {
-    auto code = R"(
+const char stdlib_code[] = R"(
 // list of headers from: http://en.cppreference.com/w/cpp/header
 
 //#include <cstdlib> -- problem with compiler built-in stuff on OSX
@@ -98,7 +100,11 @@ TEST_CASE("stdlib", "[!hide][integration]")
 #include <mutex>
 #include <thread>
 )";
-    write_file("stdlib.cpp", code);
+} // namespace
+
+TEST_CASE("stdlib", "[!hide][integration]")
+{
+    write_file("stdlib.cpp", stdlib_code);
 
     cpp_entity_index                    idx;
     simple_file_parser<libclang_parser> parser(type_safe::ref(idx), default_logger());
@@ -113,6 +119,35 @@ TEST_CASE("stdlib", "[!hide][integration]")
     REQUIRE(!parser.error());
 }
 
+TEST_CASE("stdlib skip_function_bodies", "[!hide][benchmark]")
+{
+    write_file("stdlib_skip_function_bodies.cpp", stdlib_code);
+
+    auto measure = [](bool skip_function_bodies) {
+        cpp_entity_index                    idx;
+        simple_file_parser<libclang_parser> parser(type_safe::ref(idx), default_logger());
+
+        libclang_compile_config config;
+        config.set_flags(cpp_standard::cpp_latest);
+        config.skip_function_bodies(skip_function_bodies);
+
+        auto begin = std::chrono::steady_clock::now();
+        auto file  = parser.parse("stdlib_skip_function_bodies.cpp", config);
+        REQUIRE(file);
+        REQUIRE(resolve_includes(parser, file.value(), config) == 61);
+        auto end = std::chrono::steady_clock::now();
+
+        REQUIRE(!parser.error());
+        return std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    };
+
+    auto full    = measure(false);
+    auto skipped = measure(true);
+    WARN("parsing the stdlib headers: " << full << "ms");
+    WARN("parsing the stdlib headers without function bodies: " << skipped << "ms");
+    WARN("speedup: " << double(full) / double(skipped > 0 ? skipped : 1));
+}
+
 TEST_CASE("cppast", "[!hide][integration]")
 {
     const char* files[] = {
@@ -3,9 +3,21 @@
 
 #include <catch2/catch.hpp>
 
+#include <cppast/cpp_class.hpp>
 #include <cppast/libclang_parser.hpp>
+#include <cppast/visitor.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <thread>
+#include <vector>
+
+#include "libclang/clang_probe.hpp"
+#include "libclang/libclang_visitor.hpp"
+#include "libclang/parse_functions.hpp"
 
 using namespace cppast;
 
@@ -106,3 +118,505 @@ TEST_CASE("libclang_compile_config")
     libclang_compile_config c(database, CPPAST_DETAIL_DRIVE "/c.cpp");
     require_flags(c, "-std=c++14 -fms-extensions -fms-compatibility -fno-strict-aliasing");
 }
+
+TEST_CASE("clang_probe_cache")
+{
+    std::remove("clang_probe_cache.txt");
+    libclang_compile_config::clang_probe_cache("clang_probe_cache.txt");
+
+    libclang_compile_config a;
+    auto                    count = detail::get_probe_count();
+
+    // the binary is unchanged, so it isn't run again
+    libclang_compile_config b;
+    REQUIRE(detail::get_probe_count() == count);
+    REQUIRE(detail::libclang_compile_config_access::flags(a)
+            == detail::libclang_compile_config_access::flags(b));
+
+    std::ifstream file("clang_probe_cache.txt");
+    std::string   line;
+    REQUIRE(std::getline(file, line));
+    REQUIRE(line == "cppast clang probe cache 1");
+
+    // entries for the validity and the include directories of C++ of the binary
+    std::vector<std::string> kinds;
+    while (std::getline(file, line))
+    {
+        // <full path>\t<mtime>\t<kind>\t<value>...
+        auto kind_begin = line.find('\t', line.find('\t') + 1u);
+        REQUIRE(kind_begin != std::string::npos);
+        ++kind_begin;
+        kinds.push_back(line.substr(kind_begin, line.find('\t', kind_begin) - kind_begin));
+    }
+    REQUIRE(std::count(kinds.begin(), kinds.end(), "valid") >= 1);
+    REQUIRE(std::count(kinds.begin(), kinds.end(), "c++") == 1);
+
+    libclang_compile_config::clang_probe_cache("");
+}
+
+TEST_CASE("libclang_parser::preprocess")
+{
+    std::ofstream("libclang_parser_preprocess.hpp") << "#define HEADER\n";
+    std::ofstream("libclang_parser_preprocess.cpp") << R"(#define A 1
+/// b
+#include "libclang_parser_preprocess.hpp"
+#define C(x) x
+
+int a = A;
+)";
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+
+    cpp_entity_index idx;
+    libclang_parser  parser;
+    auto             file = parser.preprocess(idx, "libclang_parser_preprocess.cpp", config);
+    REQUIRE(file);
+    REQUIRE(!parser.error());
+
+    std::vector<std::string> entities;
+    for (auto& entity : *file)
+    {
+        if (entity.kind() == cpp_include_directive::kind())
+        {
+            auto& include = static_cast<const cpp_include_directive&>(entity);
+            REQUIRE(include.include_kind() == cpp_include_kind::local);
+            REQUIRE(include.comment().value() == "b");
+            entities.push_back("include " + include.name());
+        }
+        else
+        {
+            REQUIRE(entity.kind() == cpp_macro_definition::kind());
+            entities.push_back("macro " + entity.name());
+        }
+    }
+    REQUIRE(entities
+            == std::vector<std::string>{"macro A", "include libclang_parser_preprocess.hpp",
+                                        "macro C"});
+}
+
+TEST_CASE("preprocess_database")
+{
+    std::ofstream("preprocess_database.hpp") << "#define HEADER\n";
+    std::ofstream("preprocess_database_a.cpp") << R"(#include "preprocess_database.hpp"
+#ifdef FOO
+#define A
+#endif
+)";
+    std::ofstream("preprocess_database_b.cpp") << "#define B\n";
+
+    auto database = get_database(R"([
+{
+    "directory": ".",
+    "command": "clang++ -DFOO -c -o a.o preprocess_database_a.cpp",
+    "file": "preprocess_database_a.cpp"
+},
+{
+    "directory": ".",
+    "command": "clang++ -c -o b.o preprocess_database_b.cpp",
+    "file": "preprocess_database_b.cpp"
+}
+])");
+
+    cpp_entity_index idx;
+    libclang_parser  parser;
+    auto             files = preprocess_database(parser, idx, database, 2u);
+    REQUIRE(!parser.error());
+    REQUIRE(files.size() == 2u);
+
+    auto get_names = [](const cpp_file& file) {
+        std::vector<std::string> names;
+        for (auto& entity : file)
+            names.push_back(entity.name());
+        return names;
+    };
+    // in the order of the database, using its flags
+    REQUIRE(files[0]);
+    REQUIRE(files[0]->name() == "./preprocess_database_a.cpp");
+    REQUIRE(get_names(*files[0]) == std::vector<std::string>{"preprocess_database.hpp", "A"});
+    REQUIRE(files[1]);
+    REQUIRE(files[1]->name() == "./preprocess_database_b.cpp");
+    REQUIRE(get_names(*files[1]) == std::vector<std::string>{"B"});
+}
+
+TEST_CASE("parse_database_with_headers")
+{
+    std::ofstream("database_headers_nested.hpp") << "struct nested {};\n";
+    std::ofstream("database_headers_shared.hpp") << R"(#include "database_headers_nested.hpp"
+struct shared {};
+)";
+    std::ofstream("database_headers_a.cpp") << R"(#include "database_headers_shared.hpp"
+struct a {};
+)";
+    // a different path to the same header
+    std::ofstream("database_headers_b.cpp") << R"(#include "./database_headers_shared.hpp"
+#include "database_headers_nested.hpp"
+struct b {};
+)";
+
+    auto database = get_database(R"([
+{
+    "directory": ".",
+    "command": "clang++ -c -o a.o database_headers_a.cpp",
+    "file": "database_headers_a.cpp"
+},
+{
+    "directory": ".",
+    "command": "clang++ -c -o b.o database_headers_b.cpp",
+    "file": "database_headers_b.cpp"
+}
+])");
+    auto filter = [](const cpp_include_directive& include) {
+        return include.full_path().find("database_headers_") != std::string::npos;
+    };
+
+    libclang_parser preprocessor;
+    REQUIRE(find_database_headers(preprocessor, database, filter).size() == 2u);
+
+    cpp_entity_index                    idx;
+    simple_file_parser<libclang_parser> parser(type_safe::ref(idx));
+    parse_database_with_headers(parser, preprocessor, database, filter);
+    REQUIRE(!parser.error());
+
+    // every header has been parsed once, so its entities are registered once
+    std::vector<std::string> classes;
+    for (auto& file : parser.files())
+        for (auto& entity : file)
+            if (entity.kind() == cpp_class::kind())
+                classes.push_back(entity.name());
+    std::sort(classes.begin(), classes.end());
+    REQUIRE(classes == std::vector<std::string>{"a", "b", "nested", "shared"});
+}
+
+TEST_CASE("libclang_compile_config::precompiled_preamble")
+{
+    std::ofstream("precompiled_preamble.hpp") << "struct preamble {};\n";
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    config.precompiled_preamble(true);
+
+    struct logger : diagnostic_logger
+    {
+        mutable unsigned errors = 0u;
+
+        bool do_log(const char*, const diagnostic& d) const override
+        {
+            if (d.severity == severity::error)
+                ++errors;
+            return true;
+        }
+    } log;
+
+    libclang_parser parser(type_safe::ref(log));
+    auto            parse = [&](const char* code) {
+        std::ofstream("precompiled_preamble.cpp") << code;
+
+        cpp_entity_index         idx;
+        auto                     file = parser.parse(idx, "precompiled_preamble.cpp", config);
+        std::vector<std::string> names;
+        for (auto& entity : *file)
+            names.push_back(entity.name());
+        return names;
+    };
+
+    auto first = parse("#include \"precompiled_preamble.hpp\"\nstruct a : preamble {};\n");
+    REQUIRE(first == std::vector<std::string>{"precompiled_preamble.hpp", "a"});
+
+    // reparsed with the same preamble
+    auto second = parse("#include \"precompiled_preamble.hpp\"\nstruct b : preamble {};\n"
+                        "struct c {};\n");
+    REQUIRE(second == std::vector<std::string>{"precompiled_preamble.hpp", "b", "c"});
+    REQUIRE(!parser.error());
+
+    // errors in function bodies are only reported if they aren't skipped,
+    // so the unit must not be reparsed once the option changed
+    config.skip_function_bodies(true);
+    parse("#include \"precompiled_preamble.hpp\"\nvoid f() { undeclared(); }\n");
+    REQUIRE(log.errors == 0u);
+    config.skip_function_bodies(false);
+    parse("#include \"precompiled_preamble.hpp\"\nvoid f() { undeclared(); }\n");
+    REQUIRE(log.errors > 0u);
+
+    parser.release_translation_units();
+    auto third = parse("#include \"precompiled_preamble.hpp\"\nstruct d {};\n");
+    REQUIRE(third == std::vector<std::string>{"precompiled_preamble.hpp", "d"});
+}
+
+TEST_CASE("libclang_parser::parse_async")
+{
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+
+    std::vector<std::string> file_names;
+    for (auto i = 0; i != 16; ++i)
+    {
+        file_names.push_back("parse_async_" + std::to_string(i) + ".cpp");
+        std::ofstream(file_names.back()) << "struct s" << i << " {};\n";
+    }
+
+    cpp_entity_index          idx;
+    libclang_parser           parser;
+    std::vector<parse_future> futures;
+    for (auto& name : file_names)
+        futures.push_back(parser.parse_async(idx, name, config));
+
+    // cancelled only if it hasn't been started yet
+    auto cancelled = futures.back().cancel();
+    if (cancelled)
+        REQUIRE_THROWS_AS(futures.back().get(), parse_cancelled);
+    else
+        REQUIRE(futures.back().get());
+    futures.pop_back();
+
+    for (auto i = 0u; i != futures.size(); ++i)
+    {
+        auto file = futures[i].get();
+        REQUIRE(file);
+        REQUIRE(std::next(file->begin()) == file->end());
+        REQUIRE(file->begin()->name() == "s" + std::to_string(i));
+    }
+    REQUIRE(!futures.front().cancel());
+    REQUIRE(!parser.error());
+}
+
+TEST_CASE("libclang_compile_config::parse_filter")
+{
+    std::ofstream("parse_filter.cpp") << R"(namespace api
+{
+    /// a
+    struct a
+    {
+        void f();
+        int  member;
+    };
+
+    namespace detail
+    {
+        /// nested
+        template <typename T>
+        struct nested {};
+    }
+
+    void g();
+}
+
+/// global
+int global;
+)";
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+
+    std::vector<std::string> infos;
+    config.parse_filter([&](const libclang_parse_filter_info& info) {
+        infos.push_back(info.scope + "|" + info.name + "|" + to_string(info.kind));
+        if (info.scope.empty())
+            return info.name == "api";
+        else if (info.scope == "api")
+            return info.name != "detail";
+        else
+            return info.kind != cpp_entity_kind::member_variable_t;
+    });
+
+    libclang_parser  parser;
+    cpp_entity_index idx;
+    auto             file = parser.parse(idx, "parse_filter.cpp", config);
+    REQUIRE(!parser.error());
+
+    std::string result;
+    visit(*file, [&](const cpp_entity& e, const visitor_info& info) {
+        if (info.event != visitor_info::container_entity_exit && e.kind() != cpp_file::kind())
+            result += e.name() + ";";
+    });
+    REQUIRE(result == "api;a;f;g;");
+    REQUIRE(infos
+            == std::vector<std::string>{"|api|namespace", "api|a|class", "api::a|f|member function",
+                                        "api::a|member|member variable", "api|detail|namespace",
+                                        "api|g|function", "|global|variable"});
+
+    // comments of rejected entities are dropped
+    REQUIRE((file->unmatched_comments().size() == 0u));
+}
+
+TEST_CASE("libclang_parser scaling benchmark", "[!hide][benchmark]")
+{
+    std::ofstream("libclang_parser_scaling_benchmark.cpp") << R"(#include <map>
+#include <string>
+#include <vector>
+
+struct foo
+{
+    std::map<std::string, std::vector<int>> map;
+};
+)";
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+
+    libclang_parser parser;
+    auto            measure = [&](unsigned no_threads) {
+        auto no_files = 4u * std::max(std::thread::hardware_concurrency(), 1u);
+
+        std::atomic<unsigned> next(0u);
+        auto                  work = [&] {
+            while (next++ < no_files)
+            {
+                cpp_entity_index idx;
+                parser.parse(idx, "libclang_parser_scaling_benchmark.cpp", config);
+            }
+        };
+
+        auto begin = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (auto i = 0u; i != no_threads; ++i)
+            threads.emplace_back(work);
+        for (auto& thread : threads)
+            thread.join();
+
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    };
+
+    for (auto no_threads = 1u; no_threads <= std::max(std::thread::hardware_concurrency(), 1u);
+         no_threads *= 2u)
+        WARN(no_threads << " thread(s): " << measure(no_threads) << "ms");
+    REQUIRE(!parser.error());
+}
+
+namespace
+{
+// the pieces get_entity_id() combines for the cursor
+std::vector<std::string> get_id_pieces(const CXCursor& cur)
+{
+    std::vector<std::string> result;
+    result.push_back(detail::cxstring(clang_getCursorUSR(cur)).std_str());
+    if (clang_getCursorKind(cur) == CXCursor_FunctionTemplate
+        || clang_getCursorKind(cur) == CXCursor_ConversionFunction)
+        result.push_back(
+            detail::cxstring(clang_getTypeSpelling(clang_getCursorResultType(cur))).std_str());
+    else if (clang_getCursorKind(cur) == CXCursor_ClassTemplatePartialSpecialization)
+        result.push_back(detail::cxstring(clang_getCursorDisplayName(cur)).std_str());
+    return result;
+}
+
+// the hash of the id as it was computed originally
+detail::hash_type get_concatenated_id(const std::vector<std::string>& pieces)
+{
+    std::string str;
+    for (auto& piece : pieces)
+        str += piece;
+    return detail::id_hash(str.c_str());
+}
+
+// visits all cursors of the file that have an id
+template <typename Func>
+void visit_ids(const char* file, Func f)
+{
+    detail::cxindex   index(clang_createIndex(0, 0));
+    const char*       args[] = {"-std=c++11"};
+    CXTranslationUnit unit;
+    REQUIRE(clang_parseTranslationUnit2(index.get(), file, args, 1, nullptr, 0,
+                                        CXTranslationUnit_None, &unit)
+            == CXError_Success);
+    detail::cxtranslation_unit tu(unit);
+
+    detail::visit_children(
+        clang_getTranslationUnitCursor(tu.get()),
+        [&](const CXCursor& cur) {
+            if (clang_isDeclaration(clang_getCursorKind(cur))
+                && !detail::cxstring(clang_getCursorUSR(cur)).empty())
+                f(cur);
+        },
+        true);
+}
+} // namespace
+
+TEST_CASE("detail::get_entity_id")
+{
+    std::ofstream("get_entity_id.cpp") << R"(namespace ns
+{
+    struct foo
+    {
+        operator int() const;
+        template <typename T>
+        operator T*() const;
+    };
+
+    template <typename T>
+    T f(T t);
+
+    template <typename T>
+    struct bar {};
+    template <typename T>
+    struct bar<T()> {};
+    template <typename T>
+    struct bar<T() &> {};
+
+    int \u00fc;
+}
+)";
+
+    // the ids must not change, as they might be persisted
+    auto count = 0u;
+    visit_ids("get_entity_id.cpp", [&](const CXCursor& cur) {
+        REQUIRE(static_cast<detail::hash_type>(detail::get_entity_id(cur))
+                == get_concatenated_id(get_id_pieces(cur)));
+        ++count;
+    });
+    REQUIRE(count >= 10u);
+
+    auto pieces = {"c:@N@ns", "\xc3\xbc", "", "int (T)"};
+    detail::id_hasher hasher;
+    std::string       str;
+    for (auto piece : pieces)
+    {
+        hasher.append(piece);
+        str += piece;
+        REQUIRE(hasher.hash() == detail::id_hash(str.c_str()));
+    }
+    REQUIRE(cpp_entity_id(hasher) == cpp_entity_id(str));
+}
+
+TEST_CASE("detail::get_entity_id benchmark", "[!hide][benchmark]")
+{
+    std::ofstream("get_entity_id_benchmark.cpp") << R"(#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+)";
+
+    std::vector<std::vector<std::string>> ids;
+    visit_ids("get_entity_id_benchmark.cpp",
+              [&](const CXCursor& cur) { ids.push_back(get_id_pieces(cur)); });
+    REQUIRE(!ids.empty());
+
+    auto measure = [&](const char* name,
+                       detail::hash_type (*get_id)(const std::vector<std::string>&)) {
+        auto no_iterations = 100u;
+        auto checksum      = detail::hash_type(0);
+
+        auto begin = std::chrono::steady_clock::now();
+        for (auto i = 0u; i != no_iterations; ++i)
+            for (auto& pieces : ids)
+                checksum ^= get_id(pieces);
+        auto end = std::chrono::steady_clock::now();
+
+        WARN(name << ": "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()
+                  << "us for " << no_iterations << " x " << ids.size() << " ids");
+        return checksum;
+    };
+
+    auto concatenated = measure("concatenated", &get_concatenated_id);
+    auto incremental  = measure("incremental", [](const std::vector<std::string>& pieces) {
+        detail::id_hasher hasher;
+        for (auto& piece : pieces)
+            hasher.append(piece.c_str());
+        return static_cast<detail::hash_type>(cpp_entity_id(hasher));
+    });
+    REQUIRE(concatenated == incremental);
+}
+
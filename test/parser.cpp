@@ -3,53 +3,73 @@
 
 #include <cppast/parser.hpp>
 
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+
 #include <catch2/catch.hpp>
 
 using namespace cppast;
 
-TEST_CASE("parse_files")
+namespace
 {
-    class null_compile_config : public compile_config
-    {
-    public:
-        null_compile_config() : compile_config({}) {}
-
-    private:
-        void do_set_flags(cpp_standard, compile_flags) override {}
+class null_compile_config : public compile_config
+{
+public:
+    null_compile_config() : compile_config({}) {}
 
-        void do_add_include_dir(std::string) override {}
+private:
+    void do_set_flags(cpp_standard, compile_flags) override {}
 
-        void do_add_macro_definition(std::string, std::string) override {}
+    void do_add_include_dir(std::string) override {}
 
-        void do_remove_macro_definition(std::string) override {}
+    void do_add_macro_definition(std::string, std::string) override {}
 
-        const char* do_get_name() const noexcept override
-        {
-            return "null";
-        }
+    void do_remove_macro_definition(std::string) override {}
 
-        bool do_use_c() const noexcept override
-        {
-            return false;
-        }
-    } config;
+    const char* do_get_name() const noexcept override
+    {
+        return "null";
+    }
 
-    class null_parser : public parser
+    bool do_use_c() const noexcept override
     {
-    public:
-        using config = null_compile_config;
+        return false;
+    }
+};
+
+// the files in the order they were parsed by any null_parser
+std::mutex               parsed_mutex;
+std::vector<std::string> parsed;
+
+class null_parser : public parser
+{
+public:
+    using config = null_compile_config;
 
-        null_parser() : parser(type_safe::ref(logger_)) {}
+    null_parser() : parser(type_safe::ref(logger_)) {}
 
-    private:
-        std::unique_ptr<cpp_file> do_parse(const cpp_entity_index& idx, std::string path,
-                                           const compile_config&) const override
+private:
+    std::unique_ptr<cpp_file> do_parse(const cpp_entity_index& idx, std::string path,
+                                       const compile_config&) const override
+    {
         {
-            return cpp_file::builder(std::move(path)).finish(idx);
+            std::lock_guard<std::mutex> lock(parsed_mutex);
+            parsed.push_back(path);
         }
 
-        stderr_diagnostic_logger logger_;
-    };
+        if (path == "error.cpp")
+            throw std::runtime_error("error");
+        return cpp_file::builder(std::move(path)).finish(idx);
+    }
+
+    stderr_diagnostic_logger logger_;
+};
+} // namespace
+
+TEST_CASE("parse_files")
+{
+    null_compile_config config;
 
     cpp_entity_index                idx;
     simple_file_parser<null_parser> parser(type_safe::ref(idx));
@@ -61,3 +81,105 @@ TEST_CASE("parse_files")
     for (auto& file : parser.files())
         REQUIRE(file.name() == *iter++);
 }
+
+TEST_CASE("parallel_file_parser")
+{
+    null_compile_config config;
+
+    cpp_entity_index                  idx;
+    parallel_file_parser<null_parser> parser(type_safe::ref(idx), 4u);
+
+    std::vector<std::string> file_names;
+    for (auto i = 0; i != 100; ++i)
+        file_names.push_back(std::to_string(i) + ".cpp");
+    parse_files(parser, file_names, config);
+    parser.finish();
+
+    // registered by the first parse, which has finished, so not part of the result
+    parser.parse("0.cpp", config);
+    parser.finish();
+
+    auto iter = file_names.begin();
+    for (auto& file : parser.files())
+    {
+        REQUIRE(file.name() == *iter++);
+        REQUIRE(idx.lookup(cpp_entity_id(file.name())));
+    }
+    REQUIRE(iter == file_names.end());
+
+    SECTION("error")
+    {
+        parser.parse("error.cpp", config);
+        parser.parse("last.cpp", config);
+        REQUIRE_THROWS_AS(parser.finish(), std::runtime_error);
+
+        // the other files are still parsed
+        auto last = std::string();
+        for (auto& file : parser.files())
+            last = file.name();
+        REQUIRE(last == "last.cpp");
+    }
+}
+
+TEST_CASE("file_parse_costs")
+{
+    std::ofstream("parse_costs_a.cpp") << "#include <a>\n #  include <b>\nint a;\n";
+    std::ofstream("parse_costs_b.cpp") << "int b;\n";
+    std::remove("parse_costs.txt");
+
+    {
+        file_parse_costs costs("parse_costs.txt");
+        // estimated from the size
+        REQUIRE(costs.estimate("parse_costs_a.cpp") > costs.estimate("parse_costs_b.cpp"));
+        REQUIRE(costs.estimate("parse_costs_c.cpp") == 0.);
+
+        costs.record("parse_costs_b.cpp", 2.);
+        REQUIRE(costs.estimate("parse_costs_b.cpp") == 2.);
+        // scaled to match the recorded time
+        REQUIRE(costs.estimate("parse_costs_a.cpp") > 2.);
+
+        REQUIRE(costs.save());
+    }
+
+    file_parse_costs costs("parse_costs.txt");
+    REQUIRE(costs.estimate("parse_costs_b.cpp") == 2.);
+
+    cpp_entity_index                  idx;
+    parallel_file_parser<null_parser> parser(type_safe::ref(idx), 2u);
+    parser.set_costs(type_safe::ref(costs));
+
+    auto file_names = {"parse_costs_a.cpp", "parse_costs_b.cpp"};
+    parse_files(parser, file_names, null_compile_config());
+    parser.finish();
+
+    // still in the order they were queued
+    auto iter = file_names.begin();
+    for (auto& file : parser.files())
+        REQUIRE(file.name() == *iter++);
+    REQUIRE(iter == file_names.end());
+
+    // the times have been recorded
+    REQUIRE(costs.estimate("parse_costs_b.cpp") < 2.);
+
+    SECTION("hold")
+    {
+        costs.record("parse_costs_b.cpp", 4.);
+        costs.record("parse_costs_c.cpp", 2.);
+        costs.record("parse_costs_d.cpp", 3.);
+
+        cpp_entity_index                  held_idx;
+        parallel_file_parser<null_parser> held_parser(type_safe::ref(held_idx), 1u);
+        held_parser.set_costs(type_safe::ref(costs));
+        // otherwise the idle thread would start with the first file
+        held_parser.hold();
+
+        parsed.clear();
+        auto held_file_names = {"parse_costs_c.cpp", "parse_costs_d.cpp", "parse_costs_b.cpp"};
+        parse_files(held_parser, held_file_names, null_compile_config());
+        held_parser.finish();
+
+        REQUIRE(parsed
+                == std::vector<std::string>{"parse_costs_b.cpp", "parse_costs_d.cpp",
+                                            "parse_costs_c.cpp"});
+    }
+}
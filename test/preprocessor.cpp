@@ -1,7 +1,14 @@
 #include <catch2/catch.hpp>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <random>
 
+#include "libclang/char_search.hpp"
+#include "libclang/file_metadata.hpp"
 #include "libclang/preprocessor.hpp"
+#include "libclang/preprocessor_cache.hpp"
+#include "libclang/process_pool.hpp"
 #include "test_parser.hpp"
 
 #include <cppast/cpp_variable.hpp>
@@ -97,7 +104,7 @@ struct foo {};
     {
         auto result = detail::preprocess(config, file_name, default_logger().get());
         REQUIRE(result.macros.size() == 1u);
-        REQUIRE(result.macros[0].macro->name() == "INCLUDE_GUARD");
+        REQUIRE(result.macros[0].name == "INCLUDE_GUARD");
     }
     catch (libclang_error& ex)
     {
@@ -105,6 +112,137 @@ struct foo {};
     }
 }
 
+TEST_CASE("preprocessing #pragma once")
+{
+    // the file includes itself through the other header,
+    // #pragma once must prevent that like an include guard does
+    write_file("preprocessing_pragma_once.hpp", R"(#pragma once
+#include "preprocessing_pragma_once_other.hpp"
+#define PRAGMA_ONCE_DEFINED
+
+#ifdef OTHER_SAW_PRAGMA_ONCE
+int included_again;
+#endif
+struct pragma_once {};
+)");
+    write_file("preprocessing_pragma_once_other.hpp", R"(#pragma once
+#include "preprocessing_pragma_once.hpp"
+#ifdef PRAGMA_ONCE_DEFINED
+#define OTHER_SAW_PRAGMA_ONCE
+#endif
+)");
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    SECTION("fast")
+    {
+        config.fast_preprocessing(true);
+    }
+    SECTION("normal")
+    {
+        config.fast_preprocessing(false);
+    }
+    SECTION("in-process")
+    {
+        config.in_process_preprocessing(true);
+    }
+
+    libclang_parser  p(default_logger());
+    cpp_entity_index idx;
+    auto             file = p.parse(idx, "preprocessing_pragma_once.hpp", config);
+    REQUIRE(file);
+    REQUIRE(!p.error());
+
+    auto classes = 0u;
+    for (auto& e : *file)
+    {
+        REQUIRE(e.kind() != cpp_variable::kind());
+        if (e.kind() == cpp_class::kind())
+            ++classes;
+    }
+    REQUIRE(classes == 1u);
+}
+
+TEST_CASE("fast_preprocessing macro prelude")
+{
+    // same directives, so they share the macro prelude
+    write_file("fast_preprocessing_macro_prelude_a.cpp", R"(
+#include <cstddef>
+#define A 1
+
+/// a
+int a = A;
+)");
+    write_file("fast_preprocessing_macro_prelude_b.cpp", R"(
+#include <cstddef> // std::size_t
+/* different */ #define A 1
+
+/// b
+std::size_t b = A;
+)");
+
+    struct logger : diagnostic_logger
+    {
+        mutable std::vector<std::string> messages;
+
+        logger() : diagnostic_logger(true) {}
+
+        bool do_log(const char*, const diagnostic& d) const override
+        {
+            messages.push_back(d.message);
+            return true;
+        }
+    } log;
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    config.fast_preprocessing(true);
+
+    auto a = detail::preprocess(config, "fast_preprocessing_macro_prelude_a.cpp", log);
+    auto b = detail::preprocess(config, "fast_preprocessing_macro_prelude_b.cpp", log);
+    REQUIRE(std::count(log.messages.begin(), log.messages.end(), "using shared macro prelude")
+            == 1);
+
+    for (auto result : {&a, &b})
+    {
+        REQUIRE(result->includes.size() == 1u);
+        REQUIRE(result->includes[0].file_name == "cstddef");
+        REQUIRE(result->macros.size() == 1u);
+        REQUIRE(result->macros[0].name == "A");
+        REQUIRE(result->comments.size() == 1u);
+    }
+    REQUIRE(a.comments[0].comment == "a");
+    REQUIRE(b.comments[0].comment == "b");
+}
+
+TEST_CASE("fast_preprocessing macro prelude changed header")
+{
+    write_file("fast_preprocessing_macro_prelude_changed.hpp", R"(
+#define VALUE 1
+)");
+    write_file("fast_preprocessing_macro_prelude_changed.cpp", R"(
+#include "fast_preprocessing_macro_prelude_changed.hpp"
+
+int a = VALUE;
+)");
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    config.fast_preprocessing(true);
+
+    auto before = detail::preprocess(config, "fast_preprocessing_macro_prelude_changed.cpp",
+                                     default_logger().get());
+    REQUIRE(before.source.find("int a = 1;") != std::string::npos);
+
+    // the prelude of the unchanged file must not be reused
+    write_file("fast_preprocessing_macro_prelude_changed.hpp", R"(
+#define VALUE 42
+)");
+    auto after = detail::preprocess(config, "fast_preprocessing_macro_prelude_changed.cpp",
+                                    default_logger().get());
+    REQUIRE(after.source.find("int a = 42;") != std::string::npos);
+}
+
 TEST_CASE("preprocessor line numbers")
 {
     bool fast_preprocessing = false;
@@ -307,3 +445,478 @@ void j();
     }
     REQUIRE((file->unmatched_comments().size() == 3u + add));
 }
+
+TEST_CASE("in-process preprocessing")
+{
+    write_file("in_process_preprocessing.hpp", R"(
+#define HEADER_MACRO 0
+)");
+    auto code = R"(
+#include "in_process_preprocessing.hpp"
+#include <cstddef>
+
+/// a
+#define a 1 +  2
+  #  define b(x, y)   x ## y
+#define c(...) __VA_ARGS__
+#define d
+
+#if 0
+/// skipped
+#define e
+#endif
+
+#undef d
+
+/// f
+struct f {};
+)";
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    config.in_process_preprocessing(true);
+
+    write_file("in_process_preprocessing.cpp", code);
+    libclang_parser p(default_logger());
+
+    cpp_entity_index          idx;
+    std::unique_ptr<cpp_file> file;
+    REQUIRE_NOTHROW(file = p.parse(idx, "in_process_preprocessing.cpp", config));
+    REQUIRE(!p.error());
+
+    auto includes = 0u, macros = 0u, classes = 0u;
+    for (auto& e : *file)
+    {
+        if (e.kind() == cpp_include_directive::kind())
+        {
+            auto& include = static_cast<const cpp_include_directive&>(e);
+            if (include.name() == "in_process_preprocessing.hpp")
+            {
+                REQUIRE(include.include_kind() == cpp_include_kind::local);
+                REQUIRE(include.full_path().find("in_process_preprocessing.hpp")
+                        != std::string::npos);
+            }
+            else
+            {
+                REQUIRE(include.name() == "cstddef");
+                REQUIRE(include.include_kind() == cpp_include_kind::system);
+            }
+            ++includes;
+        }
+        else if (e.kind() == cpp_macro_definition::kind())
+        {
+            auto& macro = static_cast<const cpp_macro_definition&>(e);
+            if (macro.name() == "a")
+            {
+                REQUIRE(macro.is_object_like());
+                REQUIRE(macro.replacement() == "1 + 2");
+                REQUIRE(macro.comment());
+                REQUIRE(macro.comment().value() == "a");
+            }
+            else if (macro.name() == "b")
+            {
+                REQUIRE(macro.is_function_like());
+                REQUIRE(!macro.is_variadic());
+                REQUIRE(macro.replacement() == "x ## y");
+
+                auto params = 0u;
+                for (auto& param : macro.parameters())
+                {
+                    REQUIRE(param.name() == (params == 0u ? "x" : "y"));
+                    ++params;
+                }
+                REQUIRE(params == 2u);
+            }
+            else
+            {
+                REQUIRE(macro.name() == "c");
+                REQUIRE(macro.is_variadic());
+                REQUIRE(macro.replacement() == "__VA_ARGS__");
+            }
+            ++macros;
+        }
+        else if (e.kind() == cpp_class::kind())
+        {
+            REQUIRE(e.name() == "f");
+            REQUIRE(e.comment());
+            REQUIRE(e.comment().value() == "f");
+            ++classes;
+        }
+    }
+    REQUIRE(includes == 2u);
+    REQUIRE(macros == 3u);
+    REQUIRE(classes == 1u);
+    REQUIRE((file->unmatched_comments().size() == 0u));
+}
+
+TEST_CASE("in-process preprocessing computed include")
+{
+    write_file("in_process_computed.hpp", "\n");
+    auto code = R"(
+#define COMPUTED_LOCAL "in_process_computed.hpp"
+#include COMPUTED_LOCAL
+#define COMPUTED_SYSTEM <cstddef>
+#define COMPUTED_INDIRECT COMPUTED_SYSTEM
+#include COMPUTED_INDIRECT
+int a;
+)";
+    write_file("in_process_computed.cpp", code);
+
+    // must be the same as with the external preprocessor
+    auto get_includes = [](bool in_process) {
+        libclang_compile_config config;
+        config.set_flags(cpp_standard::cpp_latest);
+        config.in_process_preprocessing(in_process);
+
+        libclang_parser  p(default_logger());
+        cpp_entity_index idx;
+        auto             file = p.parse(idx, "in_process_computed.cpp", config);
+        REQUIRE(file);
+        REQUIRE(!p.error());
+
+        std::vector<std::string> result;
+        for (auto& e : *file)
+            if (e.kind() == cpp_include_directive::kind())
+            {
+                auto& include = static_cast<const cpp_include_directive&>(e);
+                auto  system  = include.include_kind() == cpp_include_kind::system;
+                result.push_back((system ? "<" : "\"") + include.name());
+            }
+        return result;
+    };
+
+    auto includes = get_includes(true);
+    REQUIRE(includes == std::vector<std::string>{"\"in_process_computed.hpp", "<cstddef"});
+    REQUIRE(includes == get_includes(false));
+}
+
+TEST_CASE("in-process preprocessing line directives")
+{
+    auto code = R"(int a;
+#line 1 "in_process_line_directives_other.hpp"
+int b;
+int c;
+#line 3
+int d;
+  #  line 5 "in_process_line_directives.cpp"
+int e;
+# 10 "in_process_line_directives_other.hpp"
+int f;
+#line 12 \
+  "in_process_line_directives.cpp"
+int g;
+)";
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    config.in_process_preprocessing(true);
+
+    write_file("in_process_line_directives.cpp", code);
+    libclang_parser p(default_logger());
+
+    cpp_entity_index          idx;
+    std::unique_ptr<cpp_file> file;
+    REQUIRE_NOTHROW(file = p.parse(idx, "in_process_line_directives.cpp", config));
+
+    // only the entities whose presumed location is in the file itself
+    std::string names;
+    for (auto& e : *file)
+        if (e.kind() == cpp_variable::kind())
+            names += e.name();
+    REQUIRE(names == "aeg");
+}
+
+TEST_CASE("preprocessor worker pool")
+{
+    std::string out, err;
+    auto        exit_code = detail::run_process(
+        "echo out && echo err 1>&2 && exit 42", 2u,
+        [&](const char* str, std::size_t n) { out.append(str, n); },
+        [&](const char* str, std::size_t n) { err.append(str, n); });
+    REQUIRE(exit_code == 42);
+    REQUIRE(out == "out\n");
+    REQUIRE(err == "err\n");
+
+    // output without a trailing newline
+    out.clear();
+    err.clear();
+    exit_code = detail::run_process(
+        "printf out && printf err 1>&2", 2u,
+        [&](const char* str, std::size_t n) { out.append(str, n); },
+        [&](const char* str, std::size_t n) { err.append(str, n); });
+    REQUIRE(exit_code == 0);
+    REQUIRE(out == "out");
+    REQUIRE(err == "err");
+
+    write_file("preprocessor_worker_pool.cpp", R"(
+#include <cstddef>
+
+/// a
+#define a 1
+#undef a
+#define b(x) x
+
+/// c
+struct c {};
+)");
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    SECTION("fast")
+    {
+        config.fast_preprocessing(true);
+    }
+    SECTION("normal")
+    {
+        config.fast_preprocessing(false);
+    }
+
+    auto expected = detail::preprocess(config, "preprocessor_worker_pool.cpp",
+                                       default_logger().get());
+    config.preprocessor_workers(2u);
+    auto result = detail::preprocess(config, "preprocessor_worker_pool.cpp",
+                                     default_logger().get());
+
+    REQUIRE(result.source == expected.source);
+    REQUIRE(result.includes.size() == 1u);
+    REQUIRE(result.includes[0].file_name == "cstddef");
+    REQUIRE(result.macros.size() == 1u);
+    REQUIRE(result.macros[0].name == "b");
+    REQUIRE(result.comments.size() == 1u);
+    REQUIRE(result.comments[0].comment == "c");
+}
+
+TEST_CASE("preprocessor worker pool benchmark", "[!hide][benchmark]")
+{
+    write_file("preprocessor_worker_pool_benchmark.cpp", R"(
+#define a 1
+int b = a;
+)");
+
+    // the cost of starting a process grows with the memory of the parser process
+    std::vector<char> memory(std::size_t(1) << 30, 'a');
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+
+    auto measure = [&](std::size_t workers) {
+        config.preprocessor_workers(workers);
+        // start the workers
+        detail::preprocess(config, "preprocessor_worker_pool_benchmark.cpp",
+                           default_logger().get());
+
+        auto begin = std::chrono::steady_clock::now();
+        for (auto i = 0; i != 100; ++i)
+            detail::preprocess(config, "preprocessor_worker_pool_benchmark.cpp",
+                               default_logger().get());
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 100;
+    };
+
+    auto new_process = measure(0u);
+    auto worker      = measure(1u);
+    WARN("preprocessing with a new process: " << new_process << "us per file");
+    WARN("preprocessing with a worker process: " << worker << "us per file");
+    REQUIRE(memory.back() == 'a');
+}
+
+TEST_CASE("preprocessor cache")
+{
+    write_file("preprocessor_cache.hpp", R"(
+#define HEADER 1
+)");
+    write_file("preprocessor_cache.cpp", R"(
+#include "preprocessor_cache.hpp"
+
+/// a
+#define a(x) x
+
+/// b
+int b = HEADER;
+)");
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    SECTION("fast")
+    {
+        config.fast_preprocessing(true);
+    }
+    SECTION("normal")
+    {
+        config.fast_preprocessing(false);
+    }
+    config.preprocessor_cache("preprocessor_cache");
+
+    auto check = [](const detail::preprocessor_output& result,
+                    const detail::preprocessor_output& expected) {
+        REQUIRE(result.source == expected.source);
+        REQUIRE(result.includes.size() == 1u);
+        REQUIRE(result.includes[0].file_name == expected.includes[0].file_name);
+        REQUIRE(result.includes[0].full_path == expected.includes[0].full_path);
+        REQUIRE(result.includes[0].kind == cpp_include_kind::local);
+        REQUIRE(result.includes[0].line == expected.includes[0].line);
+        REQUIRE(result.macros.size() == 1u);
+        REQUIRE(result.macros[0].name == "a");
+        REQUIRE(result.macros[0].parameters.has_value());
+        REQUIRE(result.macros[0].replacement == "x");
+        REQUIRE(result.macros[0].comment.has_value());
+        REQUIRE(result.macros[0].comment.value() == "a");
+        REQUIRE(result.macros[0].line == expected.macros[0].line);
+        REQUIRE(result.comments.size() == 1u);
+        REQUIRE(result.comments[0].comment == "b");
+        REQUIRE(result.comments[0].line == expected.comments[0].line);
+    };
+
+    auto expected = detail::preprocess(config, "preprocessor_cache.cpp", default_logger().get());
+    auto cached   = detail::preprocessor_cache(config, "preprocessor_cache.cpp").load();
+    REQUIRE(cached);
+    check(cached.value(), expected);
+    check(detail::preprocess(config, "preprocessor_cache.cpp", default_logger().get()), expected);
+
+    // changing an included file invalidates the entry
+    write_file("preprocessor_cache.hpp", R"(
+#define HEADER 2
+)");
+    REQUIRE(!detail::preprocessor_cache(config, "preprocessor_cache.cpp").load());
+    detail::preprocess(config, "preprocessor_cache.cpp", default_logger().get());
+    REQUIRE(detail::preprocessor_cache(config, "preprocessor_cache.cpp").load());
+}
+
+TEST_CASE("preprocessor streaming")
+{
+    // larger than the output buffered between preprocessor and scanner
+    std::string source;
+    for (auto i = 0; i != 100000; ++i)
+    {
+        auto n = std::to_string(i);
+        source += "/// c" + n + "\n";
+        source += "#define m" + n + " /* multi\nline */ " + n + "\n";
+        source += "int v" + n + " = '\\''; // \"\n";
+    }
+    write_file("preprocessor_streaming.cpp", source.c_str());
+
+    libclang_compile_config config;
+    config.set_flags(cpp_standard::cpp_latest);
+    SECTION("fast")
+    {
+        config.fast_preprocessing(true);
+    }
+    SECTION("normal")
+    {
+        config.fast_preprocessing(false);
+    }
+
+    auto result
+        = detail::preprocess(config, "preprocessor_streaming.cpp", default_logger().get());
+    REQUIRE(result.macros.size() == 100000u);
+    REQUIRE(result.macros.back().name == "m99999");
+    REQUIRE(result.comments.size() == 100000u);
+    REQUIRE(result.comments.back().comment == "c99999");
+}
+
+TEST_CASE("pp_arena")
+{
+    detail::pp_arena arena;
+
+    auto a = arena.store("a", 1u);
+    REQUIRE(a == "a");
+    REQUIRE(a.c_str()[1] == '\0');
+
+    std::string big(100000u, 'x');
+    auto        b = arena.store(big);
+    REQUIRE(b == big);
+
+    auto c = arena.store("c", 1u);
+    REQUIRE(arena.join(a, '\n', c) == "a\nc");
+    REQUIRE(arena.join(b, ' ', arena.store("d", 1u)) == big + " d");
+
+    std::vector<detail::pp_string> strings;
+    for (auto i = 0; i != 10000; ++i)
+        strings.push_back(arena.store(std::to_string(i)));
+
+    auto moved = std::move(arena);
+    for (auto i = 0; i != 10000; ++i)
+        REQUIRE(strings[std::size_t(i)] == std::to_string(i));
+}
+
+TEST_CASE("parse_dependency_file")
+{
+    write_file("parse_dependency_file.d", "foo.o: foo.cpp C:/foo/bar.hpp \\\n"
+                                          "  /usr/include/with\\ space.h \\\n"
+                                          "  /usr/include/dollar$$.h\n");
+
+    auto dependencies = detail::parse_dependency_file("parse_dependency_file.d");
+    REQUIRE(dependencies.size() == 4u);
+    REQUIRE(dependencies[0] == "foo.cpp");
+    REQUIRE(dependencies[1] == "C:/foo/bar.hpp");
+    REQUIRE(dependencies[2] == "/usr/include/with space.h");
+    REQUIRE(dependencies[3] == "/usr/include/dollar$.h");
+}
+
+TEST_CASE("file_metadata")
+{
+    auto file_name = "file_metadata.hpp";
+    write_file(file_name, R"(// comment
+#ifndef FILE_METADATA_HPP
+#define FILE_METADATA_HPP
+#endif
+)");
+
+    auto metadata = detail::get_file_metadata(file_name, true);
+    REQUIRE(metadata->exists);
+    REQUIRE(metadata->include_guard.value() == "FILE_METADATA_HPP");
+    REQUIRE(!metadata->pragma_once);
+    REQUIRE(detail::get_file_metadata(file_name, true) == metadata);
+    REQUIRE(detail::get_file_metadata(file_name, false) == metadata);
+
+    // different size, so it is detected even if the modification time is the same
+    write_file(file_name, R"(
+  #  pragma  once
+int a;
+)");
+    REQUIRE(detail::get_file_metadata(file_name, false) == metadata);
+
+    auto changed = detail::get_file_metadata(file_name, true);
+    REQUIRE(changed->exists);
+    REQUIRE(!changed->include_guard);
+    REQUIRE(changed->pragma_once);
+    REQUIRE(changed->hash != metadata->hash);
+
+    // same size and most likely the same modification time, but the file was just written
+    write_file(file_name, R"(
+  #  pragma  once
+int b;
+)");
+    auto same_size = detail::get_file_metadata(file_name, true);
+    REQUIRE(same_size->size == changed->size);
+    REQUIRE(same_size->hash != changed->hash);
+
+    REQUIRE(!detail::get_file_metadata("file_metadata_missing.hpp", true)->exists);
+
+    REQUIRE(!detail::get_include_guard_macro("#ifndef A\n#define B\n"));
+    REQUIRE(!detail::get_include_guard_macro("int a;\n#ifndef A\n#define A\n"));
+    REQUIRE(detail::get_include_guard_macro("/* a */ #if !defined(A)\n  #define A \n").value()
+            == "A");
+}
+
+TEST_CASE("find_first_of")
+{
+    // compare against the scalar implementation for all alignments
+    std::mt19937 generator(0x5eed);
+    const char   alphabet[] = "ab \n\\\"'#/";
+    const char*  sets[]     = {R"(\"'#/)", R"(\")", R"(\')", "#"};
+
+    for (auto i = 0; i != 200; ++i)
+    {
+        std::string str(generator() % 300u, ' ');
+        for (auto& c : str)
+            c = alphabet[generator() % (sizeof(alphabet) - 1u)];
+
+        for (auto begin = std::size_t(0); begin <= str.size(); ++begin)
+            for (auto set : sets)
+            {
+                auto ptr = str.c_str() + begin;
+                REQUIRE(detail::find_first_of(ptr, set) == detail::find_first_of_scalar(ptr, set));
+            }
+    }
+}